@@ -0,0 +1,403 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <string.h>
+#include <limits.h>
+#include "bucket_key.h"
+
+using namespace std;
+using namespace scribe;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BUCKET_HASH_X86 1
+#include <nmmintrin.h>
+#endif
+
+// The delimiter scans use memchr(), which libc already vectorizes, so
+// long messages are scanned many bytes at a time.
+
+const char* bucketkey::find(const char* data, size_t len, char delimiter,
+                            size_t& key_len) {
+  const char* end = (const char*) memchr(data, delimiter, len);
+  if (end == NULL) {
+    return NULL;
+  }
+  key_len = end - data;
+
+  // the key used to be copied out with c_str(), which ended it at a NUL
+  const char* nul = (const char*) memchr(data, '\0', key_len);
+  if (nul != NULL) {
+    key_len = nul - data;
+  }
+  return data;
+}
+
+size_t bucketkey::payloadOffset(const char* data, size_t len,
+                                char delimiter) {
+  const char* end = (const char*) memchr(data, delimiter, len);
+  return end == NULL ? 0 : end - data + 1;
+}
+
+uint32_t bucketkey::contextLogId(const char* data, size_t len) {
+  // the key is in ascii after the third delimiter
+  const char delim = 1;
+  const char* pos = data;
+  const char* end = data + len;
+  for (int i = 0; i < 3; ++i) {
+    pos = (const char*) memchr(pos, delim, end - pos);
+    if (pos == NULL || end - pos <= 1) {
+      return 0;
+    }
+    ++pos;
+  }
+  if (*pos == delim) {
+    return 0;
+  }
+
+  // parsing stops at the first non digit, so unlike the key in find()
+  // there's no need to look for a NUL
+  return toUnsignedLong(pos, end - pos);
+}
+
+// Skips leading space and an optional sign like strtol(), then reads
+// the digits. Returns false if the magnitude does not fit.
+static bool parseDigits(const char* s, size_t len, bool& negative,
+                        unsigned long& value) {
+  const char* end = s + len;
+  while (s < end && (*s == ' ' || (*s >= '\t' && *s <= '\r'))) {
+    ++s;
+  }
+  negative = false;
+  if (s < end && (*s == '+' || *s == '-')) {
+    negative = (*s == '-');
+    ++s;
+  }
+
+  value = 0;
+  for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+    unsigned long digit = *s - '0';
+    if (value > (ULONG_MAX - digit) / 10) {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  return true;
+}
+
+long bucketkey::toLong(const char* s, size_t len) {
+  bool negative;
+  unsigned long value;
+  bool fits = parseDigits(s, len, negative, value);
+
+  // strtol() saturates at LONG_MIN and LONG_MAX
+  if (negative) {
+    if (!fits || value > (unsigned long) LONG_MAX + 1) {
+      return LONG_MIN;
+    }
+    return value == (unsigned long) LONG_MAX + 1 ? LONG_MIN : -(long) value;
+  }
+  if (!fits || value > (unsigned long) LONG_MAX) {
+    return LONG_MAX;
+  }
+  return (long) value;
+}
+
+unsigned long bucketkey::toUnsignedLong(const char* s, size_t len) {
+  bool negative;
+  unsigned long value;
+  if (!parseDigits(s, len, negative, value)) {
+    // strtoul() saturates
+    return ULONG_MAX;
+  }
+  return negative ? -value : value;
+}
+
+uint32_t bucketkey::hash32(const char* s, size_t len) {
+  // djb2, see strhash::hash32() in env_default.cpp
+  uint32_t hash = 5381;
+  for (const char* end = s + len; s < end; ++s) {
+    // plain char like the original, so high bytes hash the same
+    int c = *s;
+    hash = ((hash << 5) + hash) + c; // hash * 33 + c
+  }
+  return hash;
+}
+
+bool buckethash::parse(const string& name, type_t& _return) {
+  if (name == "default") {
+    _return = DEFAULT;
+  } else if (name == "murmur3") {
+    _return = MURMUR3;
+  } else if (name == "xxhash64") {
+    _return = XXHASH64;
+  } else if (name == "crc32c") {
+    _return = CRC32C;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* buckethash::name(type_t type) {
+  switch (type) {
+  case DEFAULT:
+    return "default";
+  case MURMUR3:
+    return "murmur3";
+  case XXHASH64:
+    return "xxhash64";
+  case CRC32C:
+    return "crc32c";
+  default:
+    return "unknown";
+  }
+}
+
+uint32_t buckethash::hash32(type_t type, const char* data, size_t len) {
+  switch (type) {
+  case MURMUR3:
+    return murmur3(data, len, 0);
+  case XXHASH64: {
+    uint64_t hash = xxhash64(data, len, 0);
+    return (uint32_t) (hash ^ (hash >> 32));
+  }
+  case CRC32C:
+    return crc32c(data, len);
+  case DEFAULT:
+  default:
+    return bucketkey::hash32(data, len);
+  }
+}
+
+uint32_t buckethash::hash32(type_t type, uint32_t id) {
+  if (type == DEFAULT) {
+    // same as integerhash::hash32()
+    return id;
+  }
+  char bytes[4];
+  for (int i = 0; i < 4; ++i) {
+    bytes[i] = (char) (id >> (8 * i));
+  }
+  return hash32(type, bytes, sizeof(bytes));
+}
+
+static inline uint32_t read32(const char* p) {
+  // little endian regardless of the host, so buckets don't depend on it
+  const unsigned char* b = (const unsigned char*) p;
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static inline uint64_t read64(const char* p) {
+  return read32(p) | ((uint64_t) read32(p + 4) << 32);
+}
+
+static inline uint32_t rotl32(uint32_t x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+uint32_t buckethash::murmur3(const char* data, size_t len, uint32_t seed) {
+  const uint32_t c1 = 0xcc9e2d51;
+  const uint32_t c2 = 0x1b873593;
+  uint32_t h = seed;
+
+  size_t num_blocks = len / 4;
+  for (size_t i = 0; i < num_blocks; ++i) {
+    uint32_t k = read32(data + i * 4);
+    k *= c1;
+    k = rotl32(k, 15);
+    k *= c2;
+    h ^= k;
+    h = rotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  const unsigned char* tail = (const unsigned char*) data + num_blocks * 4;
+  uint32_t k = 0;
+  switch (len & 3) {
+  case 3:
+    k ^= tail[2] << 16;
+    // fall through
+  case 2:
+    k ^= tail[1] << 8;
+    // fall through
+  case 1:
+    k ^= tail[0];
+    k *= c1;
+    k = rotl32(k, 15);
+    k *= c2;
+    h ^= k;
+  }
+
+  h ^= (uint32_t) len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t val) {
+  acc ^= xxhRound(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t buckethash::xxhash64(const char* data, size_t len, uint64_t seed) {
+  const char* p = data;
+  const char* end = data + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+    do {
+      v1 = xxhRound(v1, read64(p));
+      v2 = xxhRound(v2, read64(p + 8));
+      v3 = xxhRound(v3, read64(p + 16));
+      v4 = xxhRound(v4, read64(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxhMerge(h, v1);
+    h = xxhMerge(h, v2);
+    h = xxhMerge(h, v3);
+    h = xxhMerge(h, v4);
+  } else {
+    h = seed + XXH_PRIME64_5;
+  }
+
+  h += (uint64_t) len;
+
+  while (end - p >= 8) {
+    h ^= xxhRound(0, read64(p));
+    h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    h ^= (uint64_t) read32(p) * XXH_PRIME64_1;
+    h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (unsigned char) *p * XXH_PRIME64_5;
+    h = rotl64(h, 11) * XXH_PRIME64_1;
+    ++p;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint32_t buckethash::crc32c(const char* data, size_t len) {
+  static const bool hardware = hasHardwareCrc32c();
+  uint32_t crc = hardware ? crc32cHardware(0xffffffff, data, len)
+                          : crc32cSoftware(0xffffffff, data, len);
+  return crc ^ 0xffffffff;
+}
+
+uint32_t buckethash::crc32cSoftware(uint32_t crc, const char* data,
+                                    size_t len) {
+  static uint32_t table[256];
+  static bool initialized = false;
+  if (!initialized) {
+    // racing threads compute the same table, so no lock is needed
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t entry = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        entry = (entry >> 1) ^ ((entry & 1) ? 0x82f63b78 : 0);
+      }
+      table[i] = entry;
+    }
+    initialized = true;
+  }
+
+  const unsigned char* p = (const unsigned char*) data;
+  for (size_t i = 0; i < len; ++i) {
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef BUCKET_HASH_X86
+
+bool buckethash::hasHardwareCrc32c() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+
+// Only called when the cpu supports it, the rest of scribe isn't built
+// with -msse4.2
+__attribute__((target("sse4.2")))
+uint32_t buckethash::crc32cHardware(uint32_t crc, const char* data,
+                                    size_t len) {
+  const char* p = data;
+  const char* end = data + len;
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for (; end - p >= 8; p += 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t) crc64;
+#endif
+  for (; end - p >= 4; p += 4) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    crc = _mm_crc32_u32(crc, word);
+  }
+  for (; p < end; ++p) {
+    crc = _mm_crc32_u8(crc, (unsigned char) *p);
+  }
+  return crc;
+}
+
+#else
+
+bool buckethash::hasHardwareCrc32c() {
+  return false;
+}
+
+uint32_t buckethash::crc32cHardware(uint32_t crc, const char* data,
+                                    size_t len) {
+  return crc32cSoftware(crc, data, len);
+}
+
+#endif // BUCKET_HASH_X86
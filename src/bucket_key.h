@@ -0,0 +1,90 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_BUCKET_KEY_H
+#define SCRIBE_BUCKET_KEY_H
+
+// No thrift or boost here, so the benchmarks in test/ can build it alone
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace scribe {
+
+/*
+ * Finds and parses the bucketing key of a message in place, without
+ * copying it out of the message. Results are the same as the old code
+ * that did message.substr(...).c_str(), so keys still stop at the first
+ * NUL and messages keep going to the same buckets.
+ */
+class bucketkey {
+ public:
+  // Returns the key before the first delimiter and sets key_len, or
+  // returns NULL if the message has no delimiter.
+  static const char* find(const char* data, size_t len, char delimiter,
+                          size_t& key_len);
+
+  // Returns where the message continues after the key and its delimiter,
+  // 0 if there is no delimiter. see remove_key in BucketStore
+  static size_t payloadOffset(const char* data, size_t len, char delimiter);
+
+  // Returns the id after the third ^A of a context_log message, 0 if
+  // there isn't one
+  static uint32_t contextLogId(const char* data, size_t len);
+
+  // Same as atol() and strtoul(s, NULL, 10), but stop after len chars
+  static long toLong(const char* s, size_t len);
+  static unsigned long toUnsignedLong(const char* s, size_t len);
+
+  // Same value as strhash::hash32() for a NUL terminated copy of the key
+  static uint32_t hash32(const char* s, size_t len);
+};
+
+/*
+ * Hash functions BucketStore can use for key_hash and context_log instead
+ * of djb2 and the identity, see the bucket_hash option. They work on the
+ * key's length and spread sequential ids much better.
+ */
+class buckethash {
+ public:
+  enum type_t {
+    DEFAULT,   // djb2 of the key, the id itself for context_log
+    MURMUR3,   // MurmurHash3 x86_32
+    XXHASH64,  // XXH64 folded to 32 bits
+    CRC32C     // Castagnoli CRC, with SSE4.2 instructions when available
+  };
+
+  static bool parse(const std::string& name, type_t& _return);
+  static const char* name(type_t type);
+
+  static uint32_t hash32(type_t type, const char* data, size_t len);
+  // Hashes the id as 4 little endian bytes
+  static uint32_t hash32(type_t type, uint32_t id);
+
+  static uint32_t murmur3(const char* data, size_t len, uint32_t seed);
+  static uint64_t xxhash64(const char* data, size_t len, uint64_t seed);
+  static uint32_t crc32c(const char* data, size_t len);
+
+ protected:
+  static uint32_t crc32cSoftware(uint32_t crc, const char* data, size_t len);
+  static uint32_t crc32cHardware(uint32_t crc, const char* data, size_t len);
+  static bool hasHardwareCrc32c();
+};
+
+} // !namespace scribe
+
+#endif // SCRIBE_BUCKET_KEY_H
@@ -0,0 +1,318 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <time.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <zlib.h>
+#ifdef USE_SCRIBE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_SCRIBE_ZSTD
+#include <zstd.h>
+#endif
+#include "common.h"
+#include "scribe_server.h"
+#include "compression.h"
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+using boost::shared_ptr;
+using namespace apache::thrift::transport;
+
+bool WireCompression::parse(const string& name,
+                            compression_type_t& _return) {
+  if (name == "none") {
+    _return = COMPRESSION_NONE;
+  } else if (name == "zlib") {
+    _return = COMPRESSION_ZLIB;
+  } else if (name == "lz4") {
+    _return = COMPRESSION_LZ4;
+  } else if (name == "zstd") {
+    _return = COMPRESSION_ZSTD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* WireCompression::name(compression_type_t type) {
+  switch (type) {
+  case COMPRESSION_NONE:
+    return "none";
+  case COMPRESSION_ZLIB:
+    return "zlib";
+  case COMPRESSION_LZ4:
+    return "lz4";
+  case COMPRESSION_ZSTD:
+    return "zstd";
+  default:
+    return "unknown";
+  }
+}
+
+string WireCompression::supported() {
+  string codecs;
+#ifdef USE_SCRIBE_ZSTD
+  codecs += "zstd,";
+#endif
+#ifdef USE_SCRIBE_LZ4
+  codecs += "lz4,";
+#endif
+  // zlib is always available, thrift already depends on it
+  codecs += "zlib";
+  return codecs;
+}
+
+compression_type_t
+WireCompression::negotiate(const string& preferred,
+                           const string& remote_supported) {
+  vector<string> local, remote;
+  string local_supported = supported();
+  boost::split(local, local_supported, boost::is_any_of(","));
+  boost::split(remote, remote_supported, boost::is_any_of(", \t"));
+
+  vector<string> wanted;
+  boost::split(wanted, preferred, boost::is_any_of(", \t"));
+  for (vector<string>::iterator iter = wanted.begin();
+       iter != wanted.end();
+       ++iter) {
+    compression_type_t type;
+    if (iter->empty() || !parse(*iter, type) || type == COMPRESSION_NONE) {
+      continue;
+    }
+    if (find(local.begin(), local.end(), *iter) != local.end() &&
+        find(remote.begin(), remote.end(), *iter) != remote.end()) {
+      return type;
+    }
+  }
+  return COMPRESSION_NONE;
+}
+
+bool WireCompression::compressFrame(compression_type_t type,
+                                    const uint8_t* data, uint32_t len,
+                                    string& _return) {
+  size_t bound;
+  switch (type) {
+  case COMPRESSION_ZLIB:
+    bound = compressBound(len);
+    break;
+#ifdef USE_SCRIBE_LZ4
+  case COMPRESSION_LZ4:
+    bound = LZ4_compressBound(len);
+    break;
+#endif
+#ifdef USE_SCRIBE_ZSTD
+  case COMPRESSION_ZSTD:
+    bound = ZSTD_compressBound(len);
+    break;
+#endif
+  default:
+    return false;
+  }
+
+  _return.resize(HEADER_SIZE + bound);
+  char* out = &_return[0];
+  out[0] = (char) FRAME_MAGIC;
+  out[1] = (char) type;
+  uint32_t net_len = htonl(len);
+  memcpy(out + 2, &net_len, 4);
+
+  size_t out_len = 0;
+  switch (type) {
+  case COMPRESSION_ZLIB: {
+    uLongf zlen = bound;
+    if (compress2((Bytef*) out + HEADER_SIZE, &zlen, data, len,
+                  Z_BEST_SPEED) != Z_OK) {
+      return false;
+    }
+    out_len = zlen;
+    break;
+  }
+#ifdef USE_SCRIBE_LZ4
+  case COMPRESSION_LZ4: {
+    int lz4_len = LZ4_compress_default((const char*) data,
+                                       out + HEADER_SIZE, len, bound);
+    if (lz4_len <= 0) {
+      return false;
+    }
+    out_len = lz4_len;
+    break;
+  }
+#endif
+#ifdef USE_SCRIBE_ZSTD
+  case COMPRESSION_ZSTD: {
+    size_t zstd_len = ZSTD_compress(out + HEADER_SIZE, bound, data, len, 1);
+    if (ZSTD_isError(zstd_len)) {
+      return false;
+    }
+    out_len = zstd_len;
+    break;
+  }
+#endif
+  default:
+    return false;
+  }
+
+  if (HEADER_SIZE + out_len >= len) {
+    // not worth it, send it uncompressed
+    return false;
+  }
+  _return.resize(HEADER_SIZE + out_len);
+  return true;
+}
+
+bool WireCompression::decompressFrame(const uint8_t* data, uint32_t len,
+                                      string& _return) {
+  if (!isCompressedFrame(data, len)) {
+    return false;
+  }
+  compression_type_t type = (compression_type_t) data[1];
+  uint32_t net_len;
+  memcpy(&net_len, data + 2, 4);
+  uint32_t raw_len = ntohl(net_len);
+  if (raw_len > MAX_UNCOMPRESSED_SIZE) {
+    LOG_OPER("compressed frame too large: <%u> bytes", raw_len);
+    return false;
+  }
+
+  const uint8_t* in = data + HEADER_SIZE;
+  uint32_t in_len = len - HEADER_SIZE;
+  _return.resize(raw_len);
+  char* out = raw_len ? &_return[0] : NULL;
+
+  switch (type) {
+  case COMPRESSION_ZLIB: {
+    uLongf zlen = raw_len;
+    return uncompress((Bytef*) out, &zlen, in, in_len) == Z_OK &&
+           zlen == raw_len;
+  }
+#ifdef USE_SCRIBE_LZ4
+  case COMPRESSION_LZ4:
+    return LZ4_decompress_safe((const char*) in, out, in_len, raw_len) ==
+           (int) raw_len;
+#endif
+#ifdef USE_SCRIBE_ZSTD
+  case COMPRESSION_ZSTD:
+    return ZSTD_decompress(out, raw_len, in, in_len) == raw_len;
+#endif
+  default:
+    LOG_OPER("compressed frame uses unsupported codec <%d>", (int) type);
+    return false;
+  }
+}
+
+unsigned long WireCompression::threadCpuUsec() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+CompressedFrameTransport::CompressedFrameTransport(
+  shared_ptr<TTransport> transport_)
+  : transport(transport_),
+    frame(new TMemoryBuffer()),
+    inFrame(false),
+    compressed(false) {
+}
+
+bool CompressedFrameTransport::isOpen() {
+  return transport->isOpen();
+}
+
+bool CompressedFrameTransport::peek() {
+  if (inFrame && compressed) {
+    return frame->peek();
+  }
+  return transport->peek();
+}
+
+void CompressedFrameTransport::open() {
+  transport->open();
+}
+
+void CompressedFrameTransport::close() {
+  transport->close();
+}
+
+// The underlying transport holds exactly one frame, so everything it has
+// left to read when we start a frame is the frame itself.
+void CompressedFrameTransport::startFrame() {
+  inFrame = true;
+  compressed = false;
+
+  shared_ptr<TMemoryBuffer> buffer =
+    boost::dynamic_pointer_cast<TMemoryBuffer>(transport);
+  if (!buffer) {
+    return;
+  }
+  uint32_t len = buffer->available_read();
+  if (len < WireCompression::HEADER_SIZE) {
+    return;
+  }
+  const uint8_t* data = buffer->borrow(NULL, &len);
+  if (!data || !WireCompression::isCompressedFrame(data, len)) {
+    return;
+  }
+
+  unsigned long start_usec = WireCompression::threadCpuUsec();
+  string raw;
+  if (!WireCompression::decompressFrame(data, len, raw)) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "failed to decompress frame");
+  }
+  buffer->consume(len);
+  frame->resetBuffer();
+  frame->write((const uint8_t*) raw.data(), raw.size());
+  compressed = true;
+
+  g_Handler->incCounter("wire bytes compressed in", len);
+  g_Handler->incCounter("wire bytes decompressed", raw.size());
+  g_Handler->incCounter("wire decompress usec",
+                        WireCompression::threadCpuUsec() - start_usec);
+}
+
+uint32_t CompressedFrameTransport::read(uint8_t* buf, uint32_t len) {
+  if (!inFrame) {
+    startFrame();
+  }
+  if (compressed) {
+    return frame->read(buf, len);
+  }
+  return transport->read(buf, len);
+}
+
+uint32_t CompressedFrameTransport::readEnd() {
+  inFrame = false;
+  compressed = false;
+  return transport->readEnd();
+}
+
+void CompressedFrameTransport::write(const uint8_t* buf, uint32_t len) {
+  transport->write(buf, len);
+}
+
+uint32_t CompressedFrameTransport::writeEnd() {
+  return transport->writeEnd();
+}
+
+void CompressedFrameTransport::flush() {
+  transport->flush();
+}
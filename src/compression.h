@@ -0,0 +1,125 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_COMPRESSION_H
+#define SCRIBE_COMPRESSION_H
+
+#include "common.h"
+#include "thrift/transport/TVirtualTransport.h"
+
+/*
+ * Optional compression of Log() requests between scribe servers.
+ *
+ * A compressed request is sent as a normal thrift frame whose payload is
+ *   <magic byte> <codec byte> <uncompressed length, 4 bytes> <data>
+ * The magic byte can't start a TBinaryProtocol message, so a server can
+ * accept compressed and uncompressed frames on the same port.
+ *
+ * Servers that accept compressed frames list the codecs they support in
+ * the fb303 option WIRE_COMPRESSION_OPTION. Clients read it after
+ * connecting and pick the first codec they prefer that the server
+ * supports, so a client talking to an older server keeps sending plain
+ * frames. Replies are never compressed.
+ */
+
+#define WIRE_COMPRESSION_OPTION "wire_compression"
+
+enum compression_type_t {
+  COMPRESSION_NONE = 0,
+  COMPRESSION_ZLIB = 1,
+  COMPRESSION_LZ4 = 2,
+  COMPRESSION_ZSTD = 3
+};
+
+class WireCompression {
+ public:
+  static const uint8_t FRAME_MAGIC = 0xc5;
+  static const uint32_t HEADER_SIZE = 6;
+  // refuse to inflate frames larger than this
+  static const uint32_t MAX_UNCOMPRESSED_SIZE = 512 * 1024 * 1024;
+
+  static bool parse(const std::string& name, compression_type_t& _return);
+  static const char* name(compression_type_t type);
+
+  // comma separated list of codecs compiled into this binary
+  static std::string supported();
+
+  // Returns the first codec in 'preferred' (a comma or space separated
+  // list) that is both compiled in and listed in 'remote_supported'
+  static compression_type_t negotiate(const std::string& preferred,
+                                      const std::string& remote_supported);
+
+  // Builds a compressed frame payload, header included.
+  // Returns false if compression failed or didn't make the data smaller.
+  static bool compressFrame(compression_type_t type,
+                            const uint8_t* data, uint32_t len,
+                            std::string& _return);
+
+  // Inflates a payload built by compressFrame, header included.
+  static bool decompressFrame(const uint8_t* data, uint32_t len,
+                              std::string& _return);
+
+  static bool isCompressedFrame(const uint8_t* data, uint32_t len) {
+    return len >= HEADER_SIZE && data[0] == FRAME_MAGIC;
+  }
+
+  // CPU time used by this thread, for the compression counters
+  static unsigned long threadCpuUsec();
+};
+
+/*
+ * Server side transport that inflates compressed request frames.
+ * TNonblockingServer reads each frame into a memory buffer that this
+ * transport wraps. Uncompressed frames are passed through untouched.
+ */
+class CompressedFrameTransport
+  : public apache::thrift::transport::TVirtualTransport<CompressedFrameTransport> {
+ public:
+  CompressedFrameTransport(
+    boost::shared_ptr<apache::thrift::transport::TTransport> transport);
+
+  bool isOpen();
+  bool peek();
+  void open();
+  void close();
+  uint32_t read(uint8_t* buf, uint32_t len);
+  uint32_t readEnd();
+  void write(const uint8_t* buf, uint32_t len);
+  uint32_t writeEnd();
+  void flush();
+
+ protected:
+  // Checks whether the frame being read is compressed
+  void startFrame();
+
+  boost::shared_ptr<apache::thrift::transport::TTransport> transport;
+  boost::shared_ptr<apache::thrift::transport::TMemoryBuffer> frame;
+  bool inFrame;
+  bool compressed;
+};
+
+class CompressedFrameTransportFactory
+  : public apache::thrift::transport::TTransportFactory {
+ public:
+  boost::shared_ptr<apache::thrift::transport::TTransport>
+    getTransport(boost::shared_ptr<apache::thrift::transport::TTransport> trans) {
+    return boost::shared_ptr<apache::thrift::transport::TTransport>(
+      new CompressedFrameTransport(trans));
+  }
+};
+
+#endif // !defined SCRIBE_COMPRESSION_H
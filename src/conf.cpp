@@ -55,6 +55,10 @@ void StoreConf::getAllStores(vector<pStoreConf>& _return) {
   }
 }
 
+void StoreConf::getAllValues(string_map_t& _return) const {
+  _return = values;
+}
+
 bool StoreConf::getInt(const string& intName, long int& _return) const {
   string str;
   if (getString(intName, str)) {
@@ -48,6 +48,8 @@ class StoreConf {
   // This doesn't check for garbage ints or empty strings.
   // The return parameter is untouched if the key isn't found.
   void getAllStores(std::vector<pStoreConf>& _return);
+  // This store's own values, without the ones of its sub stores
+  void getAllValues(string_map_t& _return) const;
   bool getStore(const std::string& storeName, pStoreConf& _return);
   bool getInt(const std::string& intName, long int& _return) const;
   bool getUnsigned(const std::string& intName, unsigned long int& _return) const;
@@ -21,13 +21,25 @@
 // @author Avinash Lakshman
 
 
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <algorithm>
 #include "common.h"
 #include "scribe_server.h"
 #include "conn_pool.h"
+#include "bucket_key.h"
 
 using std::string;
 using std::ostringstream;
 using std::map;
+using std::max;
+using std::min;
+using std::vector;
 using boost::shared_ptr;
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -35,6 +47,394 @@ using namespace apache::thrift::transport;
 using namespace apache::thrift::server;
 using namespace scribe::thrift;
 
+// smaller requests are not worth compressing
+#define WIRE_COMPRESSION_MIN_SIZE 512
+
+// how long to wait on one server in a service before also trying the next
+#define CONNECT_STAGGER_MS 250
+
+// load balancing across the servers of a service, see scribeConnSet
+#define BALANCE_EWMA_ALPHA          0.3
+#define BALANCE_FAILURE_LATENCY_MS  5000
+#define BALANCE_REBALANCE_MS        30000
+
+// recent send latencies kept to find the p99 for hedging
+#define HEDGE_SAMPLES               256
+#define HEDGE_MIN_SAMPLES           50
+
+struct connect_addr_t {
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
+
+// Starts a non-blocking connect. Returns the socket or -1.
+static int startConnect(const connect_addr_t& target) {
+  int fd = socket(target.addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      (connect(fd, (const struct sockaddr*) &target.addr, target.len) != 0 &&
+       errno != EINPROGRESS)) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Connects to whichever server in a service answers first. Attempts are
+ * started CONNECT_STAGGER_MS apart, or as soon as the previous one fails,
+ * and run in parallel, so a blackholed server doesn't cost a whole
+ * connect timeout. Servers are tried in random order to spread the load.
+ * Returns a connected, blocking socket or -1.
+ */
+static int connectFirst(const server_vector_t& servers, int timeout_ms) {
+  server_vector_t order(servers);
+  std::random_shuffle(order.begin(), order.end());
+
+  vector<connect_addr_t> targets;
+  for (server_vector_t::iterator iter = order.begin();
+       iter != order.end();
+       ++iter) {
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ostringstream port;
+    port << iter->second;
+    if (getaddrinfo(iter->first.c_str(), port.str().c_str(), &hints,
+                    &res) != 0) {
+      LOG_OPER("failed to resolve <%s>", iter->first.c_str());
+      continue;
+    }
+    for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+      connect_addr_t target;
+      memcpy(&target.addr, ai->ai_addr, ai->ai_addrlen);
+      target.len = ai->ai_addrlen;
+      targets.push_back(target);
+    }
+    freeaddrinfo(res);
+  }
+
+  unsigned long now = scribe::clock::nowInMsec();
+  unsigned long deadline = now + timeout_ms;
+  unsigned long next_start = now;
+  size_t next = 0;
+  vector<struct pollfd> pending;
+  int connected = -1;
+
+  while (connected < 0 && now < deadline) {
+    if (next < targets.size() && (pending.empty() || now >= next_start)) {
+      int fd = startConnect(targets[next++]);
+      if (fd >= 0) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        pending.push_back(pfd);
+        next_start = now + CONNECT_STAGGER_MS;
+      }
+      continue;
+    }
+    if (pending.empty()) {
+      break; // every attempt failed
+    }
+
+    unsigned long wait = deadline - now;
+    if (next < targets.size()) {
+      wait = min(wait, next_start - now);
+    }
+    if (poll(&pending[0], pending.size(), wait) < 0 && errno != EINTR) {
+      break;
+    }
+    for (size_t i = pending.size(); i-- > 0; ) {
+      if (pending[i].revents == 0) {
+        continue;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (connected < 0 &&
+          getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+          err == 0) {
+        connected = pending[i].fd;
+      } else {
+        ::close(pending[i].fd);
+      }
+      pending.erase(pending.begin() + i);
+    }
+    now = scribe::clock::nowInMsec();
+  }
+
+  for (size_t i = 0; i < pending.size(); ++i) {
+    ::close(pending[i].fd);
+  }
+  if (connected >= 0) {
+    int flags = fcntl(connected, F_GETFL, 0);
+    fcntl(connected, F_SETFL, flags & ~O_NONBLOCK);
+  }
+  return connected;
+}
+
+
+LogRequestCache::LogRequestCache() {
+  pthread_mutex_init(&cacheMutex, NULL);
+}
+
+LogRequestCache::~LogRequestCache() {
+  pthread_mutex_destroy(&cacheMutex);
+}
+
+/*
+ * Writes a Log() call straight from the vector of pointers, using the same
+ * wire format as scribeClient::send_Log(). The generated client needs a
+ * vector of LogEntry objects, which would mean copying every message in
+ * the batch just to serialize it.
+ */
+void LogRequestCache::writeRequest(TProtocol* prot,
+                                   const logentry_vector_t& messages) {
+  prot->writeMessageBegin("Log", T_CALL, 0);
+
+  prot->writeStructBegin("scribe_Log_pargs");
+  prot->writeFieldBegin("messages", T_LIST, 1);
+  prot->writeListBegin(T_STRUCT, messages.size());
+  for (logentry_vector_t::const_iterator iter = messages.begin();
+       iter != messages.end();
+       ++iter) {
+    (*iter)->write(prot);
+  }
+  prot->writeListEnd();
+  prot->writeFieldEnd();
+  prot->writeFieldStop();
+  prot->writeStructEnd();
+
+  prot->writeMessageEnd();
+}
+
+log_request_ptr_t
+LogRequestCache::get(shared_ptr<logentry_vector_t> messages) {
+  pthread_mutex_lock(&cacheMutex);
+  removeExpired();
+  request_map_t::iterator iter = requests.find(messages.get());
+  if (iter != requests.end()) {
+    if (matches(iter->second, messages)) {
+      log_request_ptr_t request = iter->second.request;
+      pthread_mutex_unlock(&cacheMutex);
+      g_Handler->incCounter("reused serialized batch");
+      return request;
+    }
+    // batch changed since it was serialized
+    requests.erase(iter);
+  }
+  pthread_mutex_unlock(&cacheMutex);
+
+  // serialize outside of the lock, other store threads may need the cache
+  log_request_ptr_t request = serialize(*messages);
+
+  CacheEntry entry;
+  entry.batch = messages;
+  entry.count = messages->size();
+  entry.first = messages->empty() ? NULL : messages->front().get();
+  entry.last = messages->empty() ? NULL : messages->back().get();
+  entry.request = request;
+
+  pthread_mutex_lock(&cacheMutex);
+  requests[messages.get()] = entry;
+  pthread_mutex_unlock(&cacheMutex);
+  return request;
+}
+
+log_request_ptr_t
+LogRequestCache::serialize(const logentry_vector_t& messages) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TBinaryProtocol prot(buffer);
+  prot.setStrict(false, false);
+  writeRequest(&prot, messages);
+  return log_request_ptr_t(new string(buffer->getBufferAsString()));
+}
+
+log_request_ptr_t
+LogRequestCache::serializeWithoutKeys(const logentry_vector_t& messages,
+                                      char key_delimiter) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TBinaryProtocol prot(buffer);
+  prot.setStrict(false, false);
+  prot.writeMessageBegin("Log", T_CALL, 0);
+  prot.writeStructBegin("scribe_Log_pargs");
+  prot.writeFieldBegin("messages", T_LIST, 1);
+  prot.writeListBegin(T_STRUCT, messages.size());
+  for (logentry_vector_t::const_iterator iter = messages.begin();
+       iter != messages.end();
+       ++iter) {
+    const string& message = (*iter)->message;
+    size_t offset = scribe::bucketkey::payloadOffset(
+      message.data(), message.size(), key_delimiter);
+
+    // same as LogEntry::write(), but writes the string by hand to skip
+    // the key without copying the rest of the message
+    prot.writeStructBegin("LogEntry");
+    prot.writeFieldBegin("category", T_STRING, 1);
+    prot.writeString((*iter)->category);
+    prot.writeFieldEnd();
+    prot.writeFieldBegin("message", T_STRING, 2);
+    prot.writeI32(message.size() - offset);
+    buffer->write((const uint8_t*) message.data() + offset,
+                  message.size() - offset);
+    prot.writeFieldEnd();
+    prot.writeFieldStop();
+    prot.writeStructEnd();
+  }
+  prot.writeListEnd();
+  prot.writeFieldEnd();
+  prot.writeFieldStop();
+  prot.writeStructEnd();
+  prot.writeMessageEnd();
+  return log_request_ptr_t(new string(buffer->getBufferAsString()));
+}
+
+void LogRequestCache::invalidate(shared_ptr<logentry_vector_t> messages) {
+  pthread_mutex_lock(&cacheMutex);
+  requests.erase(messages.get());
+  removeExpired();
+  pthread_mutex_unlock(&cacheMutex);
+}
+
+// A cached request is only valid for the same, unmodified batch.
+// Batches are only ever trimmed or replaced, never edited in place,
+// so comparing the size and the first and last entries is enough.
+bool LogRequestCache::matches(const CacheEntry& entry,
+                              const shared_ptr<logentry_vector_t>& messages) {
+  if (entry.batch.lock() != messages ||
+      entry.count != messages->size()) {
+    return false;
+  }
+  if (messages->empty()) {
+    return true;
+  }
+  return entry.first == messages->front().get() &&
+         entry.last == messages->back().get();
+}
+
+// Should be called while holding cacheMutex
+void LogRequestCache::removeExpired() {
+  request_map_t::iterator iter = requests.begin();
+  while (iter != requests.end()) {
+    if (iter->second.batch.expired()) {
+      requests.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+LogCoalescer::Batch::Batch()
+  : messages(new logentry_vector_t),
+    bytes(0),
+    senders(0),
+    sealed(false),
+    done(false),
+    result(CONN_FATAL) {
+  pthread_cond_init(&cond, NULL);
+}
+
+LogCoalescer::Batch::~Batch() {
+  pthread_cond_destroy(&cond);
+}
+
+LogCoalescer::LogCoalescer() {
+  pthread_mutex_init(&coalesceMutex, NULL);
+}
+
+LogCoalescer::~LogCoalescer() {
+  pthread_mutex_destroy(&coalesceMutex);
+}
+
+LogCoalescer::batch_ptr_t
+LogCoalescer::join(const string& key, shared_ptr<logentry_vector_t> messages,
+                   unsigned long maxBytes, unsigned long maxMs, int* result) {
+  unsigned long bytes = 0;
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end();
+       ++iter) {
+    bytes += (*iter)->category.size() + (*iter)->message.size();
+  }
+
+  pthread_mutex_lock(&coalesceMutex);
+  batch_ptr_t batch;
+  batch_map_t::iterator iter = pending.find(key);
+  if (iter != pending.end()) {
+    batch = iter->second;
+    if (batch->bytes + bytes > maxBytes) {
+      // too big to add, let the leader send what it has
+      seal(key, batch);
+      batch.reset();
+    }
+  }
+
+  bool leader = !batch;
+  if (leader) {
+    batch = batch_ptr_t(new Batch());
+    pending[key] = batch;
+  }
+  batch->messages->insert(batch->messages->end(), messages->begin(),
+                          messages->end());
+  batch->bytes += bytes;
+  ++batch->senders;
+
+  if (!leader) {
+    if (batch->bytes >= maxBytes) {
+      seal(key, batch);
+    }
+    while (!batch->done) {
+      pthread_cond_wait(&batch->cond, &coalesceMutex);
+    }
+    *result = batch->result;
+    pthread_mutex_unlock(&coalesceMutex);
+    return batch_ptr_t();
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  unsigned long long deadline_usec =
+    now.tv_sec * 1000000ULL + now.tv_usec + maxMs * 1000ULL;
+  struct timespec deadline;
+  deadline.tv_sec = deadline_usec / 1000000;
+  deadline.tv_nsec = (deadline_usec % 1000000) * 1000;
+
+  while (!batch->sealed && batch->bytes < maxBytes) {
+    if (pthread_cond_timedwait(&batch->cond, &coalesceMutex,
+                               &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  seal(key, batch);
+  pthread_mutex_unlock(&coalesceMutex);
+  return batch;
+}
+
+void LogCoalescer::finish(batch_ptr_t batch, int result) {
+  pthread_mutex_lock(&coalesceMutex);
+  batch->result = result;
+  batch->done = true;
+  pthread_cond_broadcast(&batch->cond);
+  pthread_mutex_unlock(&coalesceMutex);
+}
+
+void LogCoalescer::seal(const string& key, batch_ptr_t batch) {
+  if (batch->sealed) {
+    return;
+  }
+  batch->sealed = true;
+  batch_map_t::iterator iter = pending.find(key);
+  if (iter != pending.end() && iter->second == batch) {
+    pending.erase(iter);
+  }
+  g_Handler->incCounter("coalesced sends");
+  g_Handler->incCounter("coalesced stores", batch->senders);
+  // wake up the leader
+  pthread_cond_broadcast(&batch->cond);
+}
 
 ConnPool::ConnPool() {
   pthread_mutex_init(&mapMutex, NULL);
@@ -54,14 +454,55 @@ string ConnPool::makeKey(const string& hostname, unsigned long port) {
   return key;
 }
 
-bool ConnPool::open(const string& hostname, unsigned long port, int timeout) {
-        return openCommon(makeKey(hostname, port),
-                    shared_ptr<scribeConn>(new scribeConn(hostname, port, timeout)));
+bool ConnPool::open(const string& hostname, unsigned long port, int timeout,
+                    unsigned long numConns, const string& compression) {
+  return openCommon(makeKey(hostname, port),
+                    scribeConnSet::forHost(hostname, port, timeout, numConns,
+                                           compression));
 }
 
-bool ConnPool::open(const string &service, const server_vector_t &servers, int timeout) {
-        return openCommon(service,
-                    shared_ptr<scribeConn>(new scribeConn(service, servers, timeout)));
+bool ConnPool::open(const string &service, const server_vector_t &servers,
+                    int timeout, unsigned long numConns,
+                    const string& compression,
+                    const balance_config_t& balancing) {
+  return openCommon(service,
+                    scribeConnSet::forService(service, servers, timeout,
+                                              numConns, compression,
+                                              balancing));
+}
+
+bool ConnPool::replace(const string &service, const server_vector_t &servers,
+                       int timeout, unsigned long numConns,
+                       const string& compression,
+                       const balance_config_t& balancing) {
+  shared_ptr<scribeConnSet> conn_set =
+    scribeConnSet::forService(service, servers, timeout, numConns,
+                              compression, balancing);
+  // connect without the mapMutex, as in openCommon
+  if (!conn_set->open()) {
+    return false;
+  }
+
+  pthread_mutex_lock(&mapMutex);
+  shared_ptr<scribeConnSet> old_set;
+  conn_map_t::iterator iter = connMap.find(service);
+  if (iter != connMap.end()) {
+    old_set = (*iter).second;
+    conn_set->setRef(old_set->getRef());
+    connMap[service] = conn_set;
+    LOG_OPER("CONN_POOL: switching <%s> to <%lu> servers", service.c_str(),
+             (unsigned long) servers.size());
+  }
+  pthread_mutex_unlock(&mapMutex);
+
+  if (!old_set) {
+    conn_set->close();
+    return false;
+  }
+  // senders that got the old set from getSet() keep it alive until
+  // they are done with it
+  old_set->close();
+  return true;
 }
 
 void ConnPool::close(const string& hostname, unsigned long port) {
@@ -73,52 +514,98 @@ void ConnPool::close(const string &service) {
 }
 
 int ConnPool::send(const string& hostname, unsigned long port,
-                    shared_ptr<logentry_vector_t> messages) {
-  return sendCommon(makeKey(hostname, port), messages);
+                    shared_ptr<logentry_vector_t> messages,
+                    log_request_ptr_t request) {
+  return sendCommon(makeKey(hostname, port), messages, request);
 }
 
 int ConnPool::send(const string &service,
-                    shared_ptr<logentry_vector_t> messages) {
-  return sendCommon(service, messages);
+                    shared_ptr<logentry_vector_t> messages,
+                    log_request_ptr_t request) {
+  return sendCommon(service, messages, request);
+}
+
+int ConnPool::sendRequest(const string& hostname, unsigned long port,
+                          log_request_ptr_t request, int count) {
+  shared_ptr<scribeConnSet> conn_set = getSet(makeKey(hostname, port));
+  return conn_set ? conn_set->sendRequest(request, count) : CONN_FATAL;
+}
+
+int ConnPool::sendRequest(const string &service, log_request_ptr_t request,
+                          int count) {
+  shared_ptr<scribeConnSet> conn_set = getSet(service);
+  return conn_set ? conn_set->sendRequest(request, count) : CONN_FATAL;
 }
 
-bool ConnPool::openCommon(const string &key, shared_ptr<scribeConn> conn) {
+int ConnPool::sendFrame(const string& hostname, unsigned long port,
+                        const wire_frame_t& frame) {
+  shared_ptr<scribeConnSet> conn_set = getSet(makeKey(hostname, port));
+  return conn_set ? conn_set->sendFrame(frame) : CONN_FATAL;
+}
+
+int ConnPool::sendFrame(const string &service, const wire_frame_t& frame) {
+  shared_ptr<scribeConnSet> conn_set = getSet(service);
+  return conn_set ? conn_set->sendFrame(frame) : CONN_FATAL;
+}
+
+bool ConnPool::openCommon(const string &key,
+                          shared_ptr<scribeConnSet> conn_set) {
 
 #define RETURN(x) {pthread_mutex_unlock(&mapMutex); return(x);}
 
   // note on locking:
   // The mapMutex locks all reads and writes to the connMap.
   // The locks on each connection serialize writes and deletion.
-  // The lock on a connection doesn't protect its refcount, as refcounts
-  // are only accessed under the mapMutex.
-  // mapMutex MUST be held before attempting to lock particular connection
+  // The lock on a connection doesn't protect its refcount, which is only
+  // accessed under the mapMutex, or its busy count, which is protected by
+  // the setMutex of the scribeConnSet it belongs to.
+  // mapMutex MUST be held before attempting to lock particular connection,
+  // except in scribeConnSet::send, which pins the connection by marking
+  // it busy and locks it after releasing the setMutex.
+  // openCommon connects with the mapMutex released and checks again
+  // whether another caller opened the same key in the meantime.
 
   pthread_mutex_lock(&mapMutex);
   conn_map_t::iterator iter = connMap.find(key);
+  if (iter != connMap.end() && (*iter).second->isOpen()) {
+    (*iter).second->addRef();
+    RETURN(true);
+  }
+  pthread_mutex_unlock(&mapMutex);
+
+  // Connect without holding the mapMutex, so a slow or unreachable
+  // destination doesn't hold up senders to every other destination.
+  // No one else knows about the new conns yet, so they needn't be locked.
+  bool opened = conn_set->open();
+
+  pthread_mutex_lock(&mapMutex);
+  iter = connMap.find(key);
   if (iter != connMap.end()) {
-    shared_ptr<scribeConn> old_conn = (*iter).second;
-    if (old_conn->isOpen()) {
-      old_conn->addRef();
+    shared_ptr<scribeConnSet> old_set = (*iter).second;
+    if (old_set->isOpen()) {
+      // someone else connected while we were connecting
+      old_set->addRef();
+      if (opened) {
+        conn_set->close();
+      }
       RETURN(true);
     }
-    if (conn->open()) {
+    if (opened) {
       LOG_OPER("CONN_POOL: switching to a new connection <%s>", key.c_str());
-      conn->setRef(old_conn->getRef());
-      conn->addRef();
-      // old connection will be magically deleted by shared_ptr
-      connMap[key] = conn;
+      conn_set->setRef(old_set->getRef());
+      conn_set->addRef();
+      // old connections will be magically deleted by shared_ptr
+      connMap[key] = conn_set;
       RETURN(true);
     }
     RETURN(false);
   }
-  // don't need to lock the conn yet, because no one know about
-  // it until we release the mapMutex
-  if (conn->open()) {
+  if (opened) {
     // ref count starts at one, so don't addRef here
-    connMap[key] = conn;
+    connMap[key] = conn_set;
     RETURN(true);
   }
-  // conn object that failed to open is deleted
+  // conn objects that failed to open are deleted
   RETURN(false);
 #undef RETURN
 }
@@ -129,9 +616,7 @@ void ConnPool::closeCommon(const string &key) {
   if (iter != connMap.end()) {
     (*iter).second->releaseRef();
     if ((*iter).second->getRef() <= 0) {
-      (*iter).second->lock();
       (*iter).second->close();
-      (*iter).second->unlock();
       connMap.erase(iter);
     }
   } else {
@@ -142,37 +627,536 @@ void ConnPool::closeCommon(const string &key) {
 }
 
 int ConnPool::sendCommon(const string &key,
-                          shared_ptr<logentry_vector_t> messages) {
+                          shared_ptr<logentry_vector_t> messages,
+                          log_request_ptr_t request) {
+  shared_ptr<scribeConnSet> conn_set = getSet(key);
+  return conn_set ? conn_set->send(messages, request) : CONN_FATAL;
+}
+
+// Holding on to the set keeps it alive if it is replaced or closed
+// while we send, so it is safe to send without the mapMutex.
+shared_ptr<scribeConnSet> ConnPool::getSet(const string &key) {
+  shared_ptr<scribeConnSet> conn_set;
   pthread_mutex_lock(&mapMutex);
   conn_map_t::iterator iter = connMap.find(key);
   if (iter != connMap.end()) {
-    (*iter).second->lock();
-    pthread_mutex_unlock(&mapMutex);
-    int result = (*iter).second->send(messages);
-    (*iter).second->unlock();
-    return result;
+    conn_set = (*iter).second;
   } else {
     LOG_OPER("send failed. No connection pool entry for <%s>", key.c_str());
-    pthread_mutex_unlock(&mapMutex);
-    return (CONN_FATAL);
   }
+  pthread_mutex_unlock(&mapMutex);
+  return conn_set;
 }
 
-scribeConn::scribeConn(const string& hostname, unsigned long port, int timeout_)
+balance_config_t::balance_config_t()
+  : mode(BALANCE_NONE),
+    hedge(false),
+    hedgeMinMs(0) {
+}
+
+scribeConnSet::scribeConnSet(const conn_vector_t& conns_,
+                             const balance_config_t& balancing_,
+                             const vector<unsigned long>& weights)
+  : conns(conns_),
+  refCount(1),
+  balancing(balancing_),
+  stats(conns_.size()),
+  nextConn(0),
+  lastRebalance(scribe::clock::nowInMsec()),
+  latencySamples(HEDGE_SAMPLES, 0),
+  nextSample(0),
+  numSamples(0) {
+  for (unsigned i = 0; i < stats.size(); ++i) {
+    stats[i].weight = i < weights.size() ? max(weights[i], 1UL) : 1;
+    stats[i].outstandingBytes = 0;
+    stats[i].latencyMs = 0;
+  }
+  pthread_mutex_init(&setMutex, NULL);
+}
+
+scribeConnSet::~scribeConnSet() {
+  pthread_mutex_destroy(&setMutex);
+}
+
+shared_ptr<scribeConnSet>
+scribeConnSet::forHost(const string& host, unsigned long port, int timeout,
+                       unsigned long numConns, const string& compression) {
+  conn_vector_t conns;
+  for (unsigned long i = 0; i < max(numConns, 1UL); ++i) {
+    conns.push_back(shared_ptr<scribeConn>(
+                      new scribeConn(host, port, timeout, compression)));
+  }
+  return shared_ptr<scribeConnSet>(new scribeConnSet(conns));
+}
+
+shared_ptr<scribeConnSet>
+scribeConnSet::forService(const string& service,
+                          const server_vector_t& servers, int timeout,
+                          unsigned long numConns, const string& compression,
+                          const balance_config_t& balancing) {
+  conn_vector_t conns;
+  vector<unsigned long> conn_weights;
+  for (unsigned long i = 0; i < max(numConns, 1UL); ++i) {
+    if (balancing.mode == BALANCE_NONE) {
+      conns.push_back(shared_ptr<scribeConn>(
+                        new scribeConn(service, servers, timeout,
+                                       compression)));
+      continue;
+    }
+    for (server_vector_t::const_iterator iter = servers.begin();
+         iter != servers.end();
+         ++iter) {
+      conns.push_back(shared_ptr<scribeConn>(
+                        new scribeConn(iter->first, iter->second, timeout,
+                                       compression)));
+      weight_map_t::const_iterator weight = balancing.weights.find(
+        HostHealthTracker::makeKey(iter->first, iter->second));
+      conn_weights.push_back(weight == balancing.weights.end() ?
+                             1 : weight->second);
+    }
+  }
+  return shared_ptr<scribeConnSet>(
+    new scribeConnSet(conns, balancing, conn_weights));
+}
+
+bool scribeConnSet::parseBalance(const string& name,
+                                 balance_mode_t& _return) {
+  if (name == "none") {
+    _return = BALANCE_NONE;
+  } else if (name == "least_bytes") {
+    _return = BALANCE_LEAST_BYTES;
+  } else if (name == "ewma") {
+    _return = BALANCE_EWMA;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void scribeConnSet::addRef() {
+  ++refCount;
+}
+
+void scribeConnSet::releaseRef() {
+  --refCount;
+}
+
+unsigned scribeConnSet::getRef() {
+  return refCount;
+}
+
+void scribeConnSet::setRef(unsigned r) {
+  refCount = r;
+}
+
+bool scribeConnSet::isOpen() {
+  for (conn_vector_t::iterator iter = conns.begin();
+       iter != conns.end();
+       ++iter) {
+    if ((*iter)->isOpen()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Succeeds if at least one connection could be opened. Connections that
+// failed to open are retried by scribeConn::send when they are next used.
+bool scribeConnSet::open() {
+  bool success = false;
+  for (conn_vector_t::iterator iter = conns.begin();
+       iter != conns.end();
+       ++iter) {
+    if ((*iter)->open()) {
+      success = true;
+    } else if (!success && balancing.mode == BALANCE_NONE) {
+      // no point waiting for more timeouts if the first one failed,
+      // unless the connections go to different servers
+      break;
+    }
+  }
+  return success;
+}
+
+void scribeConnSet::close() {
+  for (conn_vector_t::iterator iter = conns.begin();
+       iter != conns.end();
+       ++iter) {
+    (*iter)->lock();
+    if ((*iter)->isOpen()) {
+      (*iter)->close();
+    }
+    (*iter)->unlock();
+  }
+}
+
+int scribeConnSet::send(shared_ptr<logentry_vector_t> messages,
+                        log_request_ptr_t request) {
+  return sendCommon(messages.get(), request, messages->size());
+}
+
+int scribeConnSet::sendRequest(log_request_ptr_t request, int count) {
+  return sendCommon(NULL, request, count);
+}
+
+int scribeConnSet::sendCommon(const logentry_vector_t* messages,
+                              log_request_ptr_t request, int count) {
+  unsigned long bytes = 0;
+  if (request) {
+    bytes = request->size();
+  } else {
+    for (logentry_vector_t::const_iterator iter = messages->begin();
+         iter != messages->end();
+         ++iter) {
+      bytes += (*iter)->category.size() + (*iter)->message.size();
+    }
+  }
+
+  int result;
+  if (balancing.hedge && balancing.mode != BALANCE_NONE && conns.size() > 1) {
+    result = sendHedged(messages, request, count, bytes);
+  } else {
+    pthread_mutex_lock(&setMutex);
+    unsigned idx = acquire(bytes);
+    shared_ptr<scribeConn> conn = conns[idx];
+    pthread_mutex_unlock(&setMutex);
+
+    // The busy count keeps other senders away from this connection while
+    // we wait for it, so it is safe to block without holding the setMutex.
+    unsigned long start_ms = scribe::clock::nowInMsec();
+    conn->lock();
+    result = conn->send(messages, request, count);
+    conn->unlock();
+
+    pthread_mutex_lock(&setMutex);
+    release(idx, bytes, scribe::clock::nowInMsec() - start_ms,
+            result == CONN_OK);
+    pthread_mutex_unlock(&setMutex);
+  }
+
+  // One server failing doesn't make the whole set unusable. The batch is
+  // retried and will most likely go to another server.
+  if (result == CONN_FATAL && balancing.mode != BALANCE_NONE && isOpen()) {
+    return CONN_TRANSIENT;
+  }
+  return result;
+}
+
+int scribeConnSet::sendFrame(const wire_frame_t& frame) {
+  pthread_mutex_lock(&setMutex);
+  unsigned idx = acquire(frame.length);
+  shared_ptr<scribeConn> conn = conns[idx];
+  pthread_mutex_unlock(&setMutex);
+
+  unsigned long start_ms = scribe::clock::nowInMsec();
+  conn->lock();
+  int result = conn->sendFrame(frame);
+  conn->unlock();
+
+  pthread_mutex_lock(&setMutex);
+  release(idx, frame.length, scribe::clock::nowInMsec() - start_ms,
+          result == CONN_OK);
+  pthread_mutex_unlock(&setMutex);
+
+  if (result == CONN_FATAL && balancing.mode != BALANCE_NONE && isOpen()) {
+    return CONN_TRANSIENT;
+  }
+  return result;
+}
+
+unsigned scribeConnSet::acquire(unsigned long bytes) {
+  unsigned best;
+  if (balancing.mode == BALANCE_NONE) {
+    // Pick the connection with the fewest senders, preferring connections
+    // that are already open. Start the search after the last connection
+    // picked so that idle connections are used in round robin order.
+    unsigned size = conns.size();
+    best = nextConn % size;
+    for (unsigned i = 0; i < size; ++i) {
+      unsigned idx = (nextConn + i) % size;
+      unsigned busy = conns[idx]->getBusy();
+      unsigned best_busy = conns[best]->getBusy();
+      if (busy < best_busy ||
+          (busy == best_busy && !conns[best]->isOpen() &&
+           conns[idx]->isOpen())) {
+        best = idx;
+      }
+    }
+    nextConn = best + 1;
+  } else {
+    best = pickBalanced("");
+  }
+  conns[best]->addBusy();
+  stats[best].outstandingBytes += bytes;
+  return best;
+}
+
+// Power of two choices: pick two connections at random, in proportion
+// to their weights, and use the one with the better score. This spreads
+// load almost as well as always picking the best connection, without
+// sending every batch to the same one between updates.
+unsigned scribeConnSet::pickBalanced(const string& avoid) {
+  unsigned long now = scribe::clock::nowInMsec();
+  if (now - lastRebalance >= BALANCE_REBALANCE_MS) {
+    lastRebalance = now;
+    rebalance();
+  }
+
+  // When picking a server to hedge to, only consider open connections
+  // to other servers. Returns conns.size() if there are none.
+  vector<unsigned long> weights(stats.size(), 0);
+  unsigned long total_weight = 0;
+  for (unsigned i = 0; i < stats.size(); ++i) {
+    if (avoid.empty() ||
+        (conns[i]->getDestination() != avoid && conns[i]->isOpen() &&
+         conns[i]->isAvailable())) {
+      weights[i] = stats[i].weight;
+      total_weight += weights[i];
+    }
+  }
+  if (total_weight == 0) {
+    return conns.size();
+  }
+
+  unsigned choices[2];
+  for (unsigned c = 0; c < 2; ++c) {
+    unsigned long r = rand() % total_weight;
+    unsigned idx = 0;
+    while (r >= weights[idx]) {
+      r -= weights[idx];
+      ++idx;
+    }
+    choices[c] = idx;
+  }
+  return score(choices[1]) < score(choices[0]) ? choices[1] : choices[0];
+}
+
+// Waits for a reply on either socket. Returns 0 or 1 for the socket that
+// became readable first, or -1 on timeout or error.
+static int waitForReply(int fd0, int fd1, unsigned long timeout_ms) {
+  struct pollfd pfds[2];
+  pfds[0].fd = fd0;
+  pfds[1].fd = fd1;
+  for (unsigned i = 0; i < 2; ++i) {
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
+  }
+  int nfds = fd1 < 0 ? 1 : 2;
+  int ret;
+  do {
+    ret = poll(pfds, nfds, timeout_ms);
+  } while (ret < 0 && errno == EINTR);
+  if (ret <= 0) {
+    return -1;
+  }
+  return pfds[0].revents != 0 ? 0 : 1;
+}
+
+// Should be called while holding setMutex
+unsigned long scribeConnSet::hedgeDelay() {
+  if (numSamples < HEDGE_MIN_SAMPLES) {
+    return 0; // don't know what slow is yet
+  }
+  vector<unsigned long> sorted(latencySamples.begin(),
+                               latencySamples.begin() + numSamples);
+  vector<unsigned long>::iterator p99 =
+    sorted.begin() + (sorted.size() * 99) / 100;
+  std::nth_element(sorted.begin(), p99, sorted.end());
+  return max(*p99, max(balancing.hedgeMinMs, 1UL));
+}
+
+/*
+ * Sends to one server and, if it hasn't replied by its p99 latency,
+ * sends the same batch to another server and uses the first good reply.
+ * The connection that loses is closed, since its reply is still on the
+ * way. The remote that lost may already have logged the batch, so
+ * every hedge can duplicate messages, see the "hedged messages" counter.
+ */
+int scribeConnSet::sendHedged(const logentry_vector_t* messages,
+                              log_request_ptr_t request, int size,
+                              unsigned long bytes) {
+
+  pthread_mutex_lock(&setMutex);
+  unsigned first = acquire(bytes);
+  unsigned long hedge_ms = hedgeDelay();
+  pthread_mutex_unlock(&setMutex);
+
+  shared_ptr<scribeConn> conn = conns[first];
+  unsigned long start_ms = scribe::clock::nowInMsec();
+  conn->lock();
+  int result = CONN_FATAL;
+  if (conn->isOpen() || conn->open()) {
+    result = conn->startSend(messages, request, size);
+  }
+  if (result != CONN_OK) {
+    conn->unlock();
+    pthread_mutex_lock(&setMutex);
+    release(first, bytes, scribe::clock::nowInMsec() - start_ms, false);
+    pthread_mutex_unlock(&setMutex);
+    return result;
+  }
+
+  if (hedge_ms == 0 || waitForReply(conn->getSocket(), -1, hedge_ms) == 0) {
+    result = conn->finishSend(size);
+    conn->unlock();
+    pthread_mutex_lock(&setMutex);
+    release(first, bytes, scribe::clock::nowInMsec() - start_ms,
+            result == CONN_OK);
+    pthread_mutex_unlock(&setMutex);
+    return result;
+  }
+
+  // The first server is slow, find another one to hedge to
+  pthread_mutex_lock(&setMutex);
+  unsigned second = pickBalanced(conn->getDestination());
+  if (second < conns.size()) {
+    conns[second]->addBusy();
+    stats[second].outstandingBytes += bytes;
+  }
+  pthread_mutex_unlock(&setMutex);
+
+  shared_ptr<scribeConn> backup;
+  unsigned long hedge_start_ms = scribe::clock::nowInMsec();
+  if (second < conns.size()) {
+    // Never wait for a second connection while holding the first one,
+    // another sender may be hedging the other way round.
+    if (conns[second]->tryLock()) {
+      if (conns[second]->isOpen() &&
+          conns[second]->startSend(messages, request, size) == CONN_OK) {
+        backup = conns[second];
+        g_Handler->incCounter("hedged sends");
+        g_Handler->incCounter("hedged messages", size);
+      } else {
+        conns[second]->unlock();
+      }
+    }
+    if (!backup) {
+      pthread_mutex_lock(&setMutex);
+      conns[second]->releaseBusy();
+      stats[second].outstandingBytes -= bytes;
+      pthread_mutex_unlock(&setMutex);
+    }
+  }
+
+  int first_result, second_result = CONN_FATAL;
+  bool backup_lost = false; // slower than the first server, not failed
+  if (!backup) {
+    first_result = conn->finishSend(size);
+  } else {
+    int ready = waitForReply(conn->getSocket(), backup->getSocket(),
+                             conn->getTimeout());
+    if (ready == 0) {
+      first_result = conn->finishSend(size);
+      if (first_result == CONN_OK) {
+        backup->abandonSend(false);
+        backup_lost = true;
+      } else {
+        second_result = backup->finishSend(size);
+      }
+    } else if (ready == 1) {
+      second_result = backup->finishSend(size);
+      if (second_result == CONN_OK) {
+        conn->abandonSend(false);
+        first_result = CONN_TRANSIENT;
+        g_Handler->incCounter("hedge wins");
+      } else {
+        first_result = conn->finishSend(size);
+      }
+    } else {
+      conn->abandonSend(true);
+      backup->abandonSend(true);
+      first_result = CONN_FATAL;
+    }
+    backup->unlock();
+  }
+  conn->unlock();
+
+  unsigned long end_ms = scribe::clock::nowInMsec();
+  pthread_mutex_lock(&setMutex);
+  release(first, bytes, end_ms - start_ms, first_result == CONN_OK);
+  if (backup) {
+    release(second, bytes, end_ms - hedge_start_ms,
+            second_result == CONN_OK || backup_lost);
+  }
+  pthread_mutex_unlock(&setMutex);
+
+  if (first_result == CONN_OK || second_result == CONN_OK) {
+    return CONN_OK;
+  }
+  return first_result;
+}
+
+double scribeConnSet::score(unsigned idx) {
+  double value;
+  if (balancing.mode == BALANCE_LEAST_BYTES) {
+    value = stats[idx].outstandingBytes + 1;
+  } else {
+    value = (stats[idx].latencyMs + 1) * (conns[idx]->getBusy() + 1);
+  }
+  value /= stats[idx].weight;
+  // avoid servers whose circuit breaker is open, unless all of them are
+  if (!conns[idx]->isAvailable()) {
+    value *= 1000000;
+  }
+  return value;
+}
+
+// Latencies are only measured on connections that get traffic, so a
+// server that was slow once could be avoided forever. Every so often
+// let all servers start again from the average.
+void scribeConnSet::rebalance() {
+  double sum = 0;
+  for (unsigned i = 0; i < stats.size(); ++i) {
+    sum += stats[i].latencyMs;
+  }
+  for (unsigned i = 0; i < stats.size(); ++i) {
+    stats[i].latencyMs = sum / stats.size();
+  }
+}
+
+void scribeConnSet::release(unsigned idx, unsigned long bytes,
+                            unsigned long latency_ms, bool success) {
+  conns[idx]->releaseBusy();
+  stats[idx].outstandingBytes -= bytes;
+
+  double sample = success ? latency_ms :
+    max(latency_ms, (unsigned long) BALANCE_FAILURE_LATENCY_MS);
+  stats[idx].latencyMs += BALANCE_EWMA_ALPHA * (sample - stats[idx].latencyMs);
+
+  if (success) {
+    latencySamples[nextSample] = latency_ms;
+    nextSample = (nextSample + 1) % HEDGE_SAMPLES;
+    numSamples = min(numSamples + 1, (unsigned) HEDGE_SAMPLES);
+  }
+}
+
+scribeConn::scribeConn(const string& hostname, unsigned long port,
+                       int timeout_, const string& compression_)
   : refCount(1),
+  busy(0),
   serviceBased(false),
   remoteHost(hostname),
   remotePort(port),
-  timeout(timeout_) {
+  timeout(timeout_),
+  compressionPrefs(compression_),
+  compression(COMPRESSION_NONE),
+  healthKey(HostHealthTracker::makeKey(hostname, port)),
+  sendStartMs(0) {
   pthread_mutex_init(&mutex, NULL);
 }
 
-scribeConn::scribeConn(const string& service, const server_vector_t &servers, int timeout_)
+scribeConn::scribeConn(const string& service, const server_vector_t &servers,
+                       int timeout_, const string& compression_)
   : refCount(1),
+  busy(0),
   serviceBased(true),
   serviceName(service),
   serverList(servers),
-  timeout(timeout_) {
+  timeout(timeout_),
+  compressionPrefs(compression_),
+  compression(COMPRESSION_NONE),
+  healthKey(service),
+  sendStartMs(0) {
   pthread_mutex_init(&mutex, NULL);
 }
 
@@ -196,6 +1180,18 @@ void scribeConn::setRef(unsigned r) {
   refCount = r;
 }
 
+void scribeConn::addBusy() {
+  ++busy;
+}
+
+void scribeConn::releaseBusy() {
+  --busy;
+}
+
+unsigned scribeConn::getBusy() {
+  return busy;
+}
+
 void scribeConn::lock() {
   pthread_mutex_lock(&mutex);
 }
@@ -204,16 +1200,40 @@ void scribeConn::unlock() {
   pthread_mutex_unlock(&mutex);
 }
 
+bool scribeConn::tryLock() {
+  return pthread_mutex_trylock(&mutex) == 0;
+}
+
 bool scribeConn::isOpen() {
-  return framedTransport->isOpen();
+  return framedTransport && framedTransport->isOpen();
+}
+
+bool scribeConn::isAvailable() {
+  return g_hostHealth.isAvailable(healthKey);
 }
 
 bool scribeConn::open() {
+  if (!g_hostHealth.isAvailable(healthKey)) {
+    LOG_OPER("not connecting to remote scribe server %s, circuit breaker "
+             "is open", connectionString().c_str());
+    return false;
+  }
+
+  unsigned long start_ms = scribe::clock::nowInMsec();
   try {
 
-    socket = serviceBased ?
-      shared_ptr<TSocket>(new TSocketPool(serverList)) :
-      shared_ptr<TSocket>(new TSocket(remoteHost, remotePort));
+    if (serviceBased && serverList.size() > 1) {
+      int fd = connectFirst(serverList, timeout);
+      if (fd < 0) {
+        throw std::runtime_error("Failed to connect to any server");
+      }
+      // TSocket takes ownership of the connected socket
+      socket = shared_ptr<TSocket>(new TSocket(fd));
+    } else {
+      socket = serviceBased ?
+        shared_ptr<TSocket>(new TSocketPool(serverList)) :
+        shared_ptr<TSocket>(new TSocket(remoteHost, remotePort));
+    }
 
     if (!socket) {
       throw std::runtime_error("Failed to create socket");
@@ -252,13 +1272,16 @@ bool scribeConn::open() {
     if (serviceBased) {
       remoteHost = socket->getPeerHost();
     }
+    negotiateCompression();
   } catch (const TTransportException& ttx) {
     LOG_OPER("failed to open connection to remote scribe server %s thrift error <%s>",
              connectionString().c_str(), ttx.what());
+    recordHealth(false, start_ms);
     return false;
   } catch (const std::exception& stx) {
     LOG_OPER("failed to open connection to remote scribe server %s std error <%s>",
              connectionString().c_str(), stx.what());
+    recordHealth(false, start_ms);
     return false;
   }
   LOG_OPER("Opened connection to remote scribe server %s",
@@ -276,48 +1299,83 @@ void scribeConn::close() {
 }
 
 int
-scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
-  bool fatal;
-  int size = messages->size();
+scribeConn::send(const logentry_vector_t* messages, log_request_ptr_t request,
+                 int count) {
   if (!isOpen()) {
     if (!open()) {
       return (CONN_FATAL);
     }
   }
 
-  // Copy the vector of pointers to a vector of objects
-  // This is because thrift doesn't support vectors of pointers,
-  // but we need to use them internally to avoid even more copies.
-  std::vector<LogEntry> msgs;
-  msgs.reserve(size);
-  for (logentry_vector_t::iterator iter = messages->begin();
-       iter != messages->end();
-       ++iter) {
-    msgs.push_back(**iter);
+  int result = startSend(messages, request, count);
+  if (result == CONN_OK) {
+    result = finishSend(count);
+  }
+  return result;
+}
+
+int scribeConn::sendFrame(const wire_frame_t& frame) {
+  if (!isOpen()) {
+    if (!open()) {
+      return (CONN_FATAL);
+    }
   }
-  ResultCode result = TRY_LATER;
+
+  sendStartMs = scribe::clock::nowInMsec();
+  if (!sendFileRange(frame)) {
+    LOG_OPER("Failed to send <%u> buffered messages to remote scribe server "
+        "%s error <%s>", frame.count, connectionString().c_str(),
+        strerror(errno));
+    return sendFailed(true);
+  }
+  return finishSend(frame.count);
+}
+
+// Writes a Log() request without waiting for the reply.
+// Returns CONN_OK, or the error send() should return.
+int scribeConn::startSend(const logentry_vector_t* messages,
+                          log_request_ptr_t request, int size) {
+  sendStartMs = scribe::clock::nowInMsec();
   try {
-    result = resendClient->Log(msgs);
+    sendLogRequest(messages, request);
+    return (CONN_OK);
+  } catch (const TTransportException& ttx) {
+    LOG_OPER("Failed to send <%d> messages to remote scribe server %s "
+        "error <%s>", size, connectionString().c_str(), ttx.what());
+  } catch (...) {
+    LOG_OPER("Unknown exception sending <%d> messages to remote scribe "
+        "server %s", size, connectionString().c_str());
+  }
+  return sendFailed(true);
+}
 
+// Reads the reply to the request written by startSend()
+int scribeConn::finishSend(int size) {
+  try {
+    ResultCode result = resendClient->recv_Log();
     if (result == OK) {
+      recordHealth(true, sendStartMs);
       g_Handler->incCounter("sent", size);
       LOG_OPER("Successfully sent <%d> messages to remote scribe server %s",
           size, connectionString().c_str());
       return (CONN_OK);
     }
-    fatal = false;
     LOG_OPER("Failed to send <%d> messages, remote scribe server %s "
         "returned error code <%d>", size, connectionString().c_str(),
         (int) result);
+    return sendFailed(false);
   } catch (const TTransportException& ttx) {
-    fatal = true;
     LOG_OPER("Failed to send <%d> messages to remote scribe server %s "
         "error <%s>", size, connectionString().c_str(), ttx.what());
   } catch (...) {
-    fatal = true;
     LOG_OPER("Unknown exception sending <%d> messages to remote scribe "
         "server %s", size, connectionString().c_str());
   }
+  return sendFailed(true);
+}
+
+int scribeConn::sendFailed(bool fatal) {
+  recordHealth(false, sendStartMs);
   /*
    * If this is a serviceBased connection then close it. We might
    * be lucky and get another service when we reopen this connection.
@@ -331,6 +1389,116 @@ scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
   return (CONN_TRANSIENT);
 }
 
+// Drops a request written by startSend() whose reply we no longer want.
+// The reply would be read as the reply to the next request, so the
+// connection has to go.
+void scribeConn::abandonSend(bool failed) {
+  if (failed) {
+    recordHealth(false, sendStartMs);
+  }
+  close();
+}
+
+int scribeConn::getSocket() {
+  return isOpen() ? socket->getSocketFD() : -1;
+}
+
+int scribeConn::getTimeout() {
+  return timeout;
+}
+
+const string& scribeConn::getDestination() {
+  return healthKey;
+}
+
+// Tells the shared circuit breaker how a connect or send went
+void scribeConn::recordHealth(bool success, unsigned long start_ms) {
+  unsigned long latency_ms = scribe::clock::nowInMsec() - start_ms;
+  if (success) {
+    g_hostHealth.recordSuccess(healthKey, latency_ms);
+  } else {
+    g_hostHealth.recordFailure(healthKey, latency_ms);
+  }
+}
+
+// Agree on a codec with the remote server, see compression.h
+void scribeConn::negotiateCompression() {
+  compression = COMPRESSION_NONE;
+  if (compressionPrefs.empty()) {
+    return;
+  }
+  string remote_codecs;
+  resendClient->getOption(remote_codecs, WIRE_COMPRESSION_OPTION);
+  compression = WireCompression::negotiate(compressionPrefs, remote_codecs);
+  LOG_OPER("Using <%s> compression to remote scribe server %s",
+           WireCompression::name(compression), connectionString().c_str());
+}
+
+/*
+ * Writes a Log() call to the remote server. If the request was already
+ * serialized by the LogRequestCache the bytes are sent as they are.
+ */
+void scribeConn::sendLogRequest(const logentry_vector_t* messages,
+                                log_request_ptr_t request) {
+  if (compression != COMPRESSION_NONE) {
+    if (!request) {
+      request = LogRequestCache::serialize(*messages);
+    }
+    if (request->size() >= WIRE_COMPRESSION_MIN_SIZE) {
+      unsigned long start_usec = WireCompression::threadCpuUsec();
+      string compressed;
+      bool success = WireCompression::compressFrame(compression,
+        (const uint8_t*) request->data(), request->size(), compressed);
+      g_Handler->incCounter("wire compress usec",
+                            WireCompression::threadCpuUsec() - start_usec);
+      if (success) {
+        g_Handler->incCounter("wire bytes uncompressed", request->size());
+        g_Handler->incCounter("wire bytes compressed", compressed.size());
+        framedTransport->write((const uint8_t*) compressed.data(),
+                               compressed.size());
+        framedTransport->writeEnd();
+        framedTransport->flush();
+        return;
+      }
+    }
+  }
+
+  if (request) {
+    framedTransport->write((const uint8_t*) request->data(),
+                           request->size());
+  } else {
+    LogRequestCache::writeRequest(protocol.get(), *messages);
+  }
+  framedTransport->writeEnd();
+  framedTransport->flush();
+}
+
+/*
+ * Writes a stored frame straight from the page cache to the socket.
+ * The frame is already complete, so it bypasses the framed transport,
+ * whose write buffer is empty between requests.
+ */
+bool scribeConn::sendFileRange(const wire_frame_t& frame) {
+  int sock = socket->getSocketFD();
+  off_t offset = frame.offset;
+  size_t remaining = frame.length;
+  while (remaining > 0) {
+    ssize_t sent = sendfile(sock, frame.fd, &offset, remaining);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      // 0 means the file was truncated, EAGAIN that the send timed out
+      if (sent == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    remaining -= sent;
+  }
+  return true;
+}
+
 std::string scribeConn::connectionString() {
         if (serviceBased) {
                 return "<" + remoteHost + " Service: " + serviceName + ">";
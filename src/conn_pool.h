@@ -23,17 +23,120 @@
 #define SCRIBE_CONN_POOL_H
 
 #include "common.h"
+#include "compression.h"
+#include "host_health.h"
 
 /* return codes for ScribeConn and ConnPool */
 #define CONN_FATAL        (-1) /* fatal error. close everything */
 #define CONN_OK           (0)  /* success */
 #define CONN_TRANSIENT    (1)  /* transient error */
 
+// A Log() request serialized with TBinaryProtocol, ready to be framed
+typedef boost::shared_ptr<std::string> log_request_ptr_t;
+
+// A framed Log() request stored in a buffer file, see FileStore
+struct wire_frame_t {
+  int fd;
+  off_t offset;
+  uint32_t length; // including the 4 byte frame size
+  uint32_t count;  // messages in the request
+};
+
+// Caches the serialized Log() request of a batch of messages so that
+// retries of the same batch, and other network stores sending the same
+// batch (e.g. inside a multi store), don't serialize it again.
+// Entries are keyed by the batch itself and only live as long as it does.
+// A cached request is dropped as soon as the batch no longer matches it,
+// e.g. after it was trimmed down to the messages that failed.
+// see the global g_logRequestCache in store.cpp
+class LogRequestCache {
+ public:
+  LogRequestCache();
+  virtual ~LogRequestCache();
+
+  log_request_ptr_t get(boost::shared_ptr<logentry_vector_t> messages);
+  void invalidate(boost::shared_ptr<logentry_vector_t> messages);
+
+  static log_request_ptr_t serialize(const logentry_vector_t& messages);
+  // Leaves out everything up to the first key_delimiter of each message,
+  // see remove_key in BucketStore
+  static log_request_ptr_t serializeWithoutKeys(
+    const logentry_vector_t& messages, char key_delimiter);
+  static void writeRequest(apache::thrift::protocol::TProtocol* prot,
+                           const logentry_vector_t& messages);
+
+ protected:
+  struct CacheEntry {
+    boost::weak_ptr<logentry_vector_t> batch;
+    // what the batch looked like when it was serialized
+    size_t count;
+    const scribe::thrift::LogEntry* first;
+    const scribe::thrift::LogEntry* last;
+    log_request_ptr_t request;
+  };
+  typedef std::map<const logentry_vector_t*, CacheEntry> request_map_t;
+
+  bool matches(const CacheEntry& entry,
+               const boost::shared_ptr<logentry_vector_t>& messages);
+  void removeExpired();
+
+  pthread_mutex_t cacheMutex;
+  request_map_t requests;
+};
+
+/*
+ * Combines the batches that many network stores send to the same
+ * destination at about the same time into a single Log() call.
+ * The first store to join a destination's pending batch leads it: it
+ * waits up to maxMs for other stores to add their messages, or until
+ * maxBytes have been added, then sends the combined batch and calls
+ * finish(). The other stores wait for finish() and get the same result,
+ * since a Log() call succeeds or fails as a whole.
+ * see the global g_logCoalescer in store.cpp
+ */
+class LogCoalescer {
+ public:
+  struct Batch {
+    Batch();
+    ~Batch();
+
+    boost::shared_ptr<logentry_vector_t> messages;
+    unsigned long bytes;
+    unsigned senders;
+    bool sealed; // no more messages can be added
+    bool done;
+    int result;
+    pthread_cond_t cond;
+  };
+  typedef boost::shared_ptr<Batch> batch_ptr_t;
+
+  LogCoalescer();
+  virtual ~LogCoalescer();
+
+  // Returns the batch to send if the caller leads it, otherwise waits
+  // for the leader and returns null with the send's result in *result.
+  batch_ptr_t join(const std::string& key,
+                   boost::shared_ptr<logentry_vector_t> messages,
+                   unsigned long maxBytes, unsigned long maxMs, int* result);
+  void finish(batch_ptr_t batch, int result);
+
+ protected:
+  typedef std::map<std::string, batch_ptr_t> batch_map_t;
+
+  // Should be called while holding coalesceMutex
+  void seal(const std::string& key, batch_ptr_t batch);
+
+  pthread_mutex_t coalesceMutex;
+  batch_map_t pending;
+};
+
 // Basic scribe class to manage network connections. Used by network store
 class scribeConn {
  public:
-  scribeConn(const std::string& host, unsigned long port, int timeout);
-  scribeConn(const std::string &service, const server_vector_t &servers, int timeout);
+  scribeConn(const std::string& host, unsigned long port, int timeout,
+             const std::string& compression = "");
+  scribeConn(const std::string &service, const server_vector_t &servers,
+             int timeout, const std::string& compression = "");
   virtual ~scribeConn();
 
   void addRef();
@@ -41,16 +144,43 @@ class scribeConn {
   unsigned getRef();
   void setRef(unsigned);
 
+  void addBusy();
+  void releaseBusy();
+  unsigned getBusy();
+
   void lock();
   void unlock();
+  bool tryLock();
 
   bool isOpen();
   bool open();
   void close();
-  int send(boost::shared_ptr<logentry_vector_t> messages);
+  // Sends count messages. messages is only read if request is NULL.
+  int send(const logentry_vector_t* messages, log_request_ptr_t request,
+           int count);
+  // Same as send(), but the request is copied from a file by the kernel
+  int sendFrame(const wire_frame_t& frame);
+
+  // false while this destination's circuit breaker is open
+  bool isAvailable();
+
+  // send() in two halves, so a caller can wait on several connections
+  int startSend(const logentry_vector_t* messages, log_request_ptr_t request,
+                int size);
+  int finishSend(int size);
+  void abandonSend(bool failed);
+  int getSocket(); // to poll for the reply, -1 if not open
+  int getTimeout();
+  const std::string& getDestination(); // host:port or service
 
  private:
   std::string connectionString();
+  void negotiateCompression();
+  void recordHealth(bool success, unsigned long start_ms);
+  int sendFailed(bool fatal);
+  void sendLogRequest(const logentry_vector_t* messages,
+                      log_request_ptr_t request);
+  bool sendFileRange(const wire_frame_t& frame);
 
  protected:
   boost::shared_ptr<apache::thrift::transport::TSocket> socket;
@@ -59,6 +189,7 @@ class scribeConn {
   boost::shared_ptr<scribe::thrift::scribeClient> resendClient;
 
   unsigned refCount;
+  unsigned busy; // number of senders using or waiting for this connection
 
   bool serviceBased;
   std::string serviceName;
@@ -66,38 +197,166 @@ class scribeConn {
   std::string remoteHost;
   unsigned long remotePort;
   int timeout; // connection, send, and recv timeout
+  std::string compressionPrefs; // codecs we'd like to use, in order
+  compression_type_t compression; // codec agreed on with the remote server
+  std::string healthKey; // destination in g_hostHealth
+  unsigned long sendStartMs; // when the request in flight was written
   pthread_mutex_t mutex;
 };
 
+typedef std::vector<boost::shared_ptr<scribeConn> > conn_vector_t;
+
+// How a set of connections to a service spreads batches over its servers
+enum balance_mode_t {
+  BALANCE_NONE,        // one connection per slot, server picked at connect
+  BALANCE_LEAST_BYTES, // fewest bytes waiting for a reply, per unit of weight
+  BALANCE_EWMA         // lowest recent latency times senders, per weight
+};
+
+// relative share of the traffic for each host:port of a service
+typedef std::map<std::string, unsigned long> weight_map_t;
+
+struct balance_config_t {
+  balance_config_t();
+
+  balance_mode_t mode;
+  weight_map_t weights;
+  // Resend a batch to a second server if the first hasn't replied
+  // within its recent p99 latency, and use whichever replies first
+  bool hedge;
+  unsigned long hedgeMinMs; // never hedge sooner than this
+};
+
+// A fixed size set of connections to the same host,port or service.
+// All users of the set share one reference count, so open and close
+// behave as if the set were a single connection.
+class scribeConnSet {
+ public:
+  scribeConnSet(const conn_vector_t& conns,
+                const balance_config_t& balancing = balance_config_t(),
+                const std::vector<unsigned long>& weights =
+                  std::vector<unsigned long>());
+  virtual ~scribeConnSet();
+
+  static boost::shared_ptr<scribeConnSet>
+    forHost(const std::string& host, unsigned long port, int timeout,
+            unsigned long numConns, const std::string& compression);
+  // Without balancing every connection may go to any server of the
+  // service. With balancing there are numConns connections to each server.
+  static boost::shared_ptr<scribeConnSet>
+    forService(const std::string& service, const server_vector_t& servers,
+               int timeout, unsigned long numConns,
+               const std::string& compression,
+               const balance_config_t& balancing = balance_config_t());
+  static bool parseBalance(const std::string& name, balance_mode_t& _return);
+
+  void addRef();
+  void releaseRef();
+  unsigned getRef();
+  void setRef(unsigned);
+
+  bool isOpen();
+  bool open();
+  void close();
+
+  // Sends on the best connection for the current balance mode
+  int send(boost::shared_ptr<logentry_vector_t> messages,
+           log_request_ptr_t request = log_request_ptr_t());
+  // Same as send() for a request of count messages serialized elsewhere
+  int sendRequest(log_request_ptr_t request, int count);
+  int sendFrame(const wire_frame_t& frame); // never hedged
+
+  conn_vector_t conns;
+
+ protected:
+  struct conn_stats_t {
+    unsigned long weight;
+    unsigned long outstandingBytes; // sent, waiting for a reply
+    double latencyMs;               // moving average of send time
+  };
+
+  int sendCommon(const logentry_vector_t* messages, log_request_ptr_t request,
+                 int count);
+  int sendHedged(const logentry_vector_t* messages, log_request_ptr_t request,
+                 int size, unsigned long bytes);
+
+  // Should be called while holding setMutex
+  unsigned acquire(unsigned long bytes);
+  unsigned pickBalanced(const std::string& avoid);
+  unsigned long hedgeDelay();
+  double score(unsigned idx);
+  void rebalance();
+
+  void release(unsigned idx, unsigned long bytes, unsigned long latency_ms,
+               bool success);
+
+  unsigned refCount;
+  balance_config_t balancing;
+  std::vector<conn_stats_t> stats; // one per connection
+
+  pthread_mutex_t setMutex; // protects busy counts, stats, and nextConn
+  unsigned nextConn; // where to start looking for an idle connection
+  unsigned long lastRebalance; // in msec
+  std::vector<unsigned long> latencySamples; // ring of recent send times
+  unsigned nextSample;
+  unsigned numSamples;
+};
+
 // key is hostname:port or the service
-typedef std::map<std::string, boost::shared_ptr<scribeConn> > conn_map_t;
+typedef std::map<std::string, boost::shared_ptr<scribeConnSet> > conn_map_t;
 
 // Scribe class to manage connection pooling
-// Maintains a map of (<host,port> or service) to scribeConn class.
-// used to ensure that there is only one connection from one particular
-// scribe server to any host,port or service.
+// Maintains a map of (<host,port> or service) to a set of scribeConns.
+// used to ensure that there are at most numConns connections from one
+// particular scribe server to any host,port or service. Concurrent senders
+// are spread over the connections in the set, so one slow batch does not
+// hold up every other category sending to the same destination.
 // see the global g_connPool in store.cpp
 class ConnPool {
  public:
   ConnPool();
   virtual ~ConnPool();
 
-  bool open(const std::string& host, unsigned long port, int timeout);
-  bool open(const std::string &service, const server_vector_t &servers, int timeout);
+  bool open(const std::string& host, unsigned long port, int timeout,
+            unsigned long numConns = 1, const std::string& compression = "");
+  bool open(const std::string &service, const server_vector_t &servers,
+            int timeout, unsigned long numConns = 1,
+            const std::string& compression = "",
+            const balance_config_t& balancing = balance_config_t());
+
+  // Moves an open service over to new servers for everyone using it.
+  // Returns false, leaving the old connections in place, if the new
+  // ones can't be opened or the service isn't open.
+  bool replace(const std::string &service, const server_vector_t &servers,
+               int timeout, unsigned long numConns = 1,
+               const std::string& compression = "",
+               const balance_config_t& balancing = balance_config_t());
 
   void close(const std::string& host, unsigned long port);
   void close(const std::string &service);
 
   int send(const std::string& host, unsigned long port,
-            boost::shared_ptr<logentry_vector_t> messages);
+            boost::shared_ptr<logentry_vector_t> messages,
+            log_request_ptr_t request = log_request_ptr_t());
   int send(const std::string &service,
-            boost::shared_ptr<logentry_vector_t> messages);
+            boost::shared_ptr<logentry_vector_t> messages,
+            log_request_ptr_t request = log_request_ptr_t());
+  int sendRequest(const std::string& host, unsigned long port,
+                  log_request_ptr_t request, int count);
+  int sendRequest(const std::string &service, log_request_ptr_t request,
+                  int count);
+  int sendFrame(const std::string& host, unsigned long port,
+                const wire_frame_t& frame);
+  int sendFrame(const std::string &service, const wire_frame_t& frame);
 
  private:
-  bool openCommon(const std::string &key, boost::shared_ptr<scribeConn> conn);
+  bool openCommon(const std::string &key,
+                  boost::shared_ptr<scribeConnSet> conn_set);
   void closeCommon(const std::string &key);
   int sendCommon(const std::string &key,
-                  boost::shared_ptr<logentry_vector_t> messages);
+                  boost::shared_ptr<logentry_vector_t> messages,
+                  log_request_ptr_t request);
+  boost::shared_ptr<scribeConnSet> getSet(const std::string &key);
 
  protected:
   std::string makeKey(const std::string& name, unsigned long port);
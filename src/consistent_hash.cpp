@@ -0,0 +1,83 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <algorithm>
+#include "consistent_hash.h"
+
+using namespace std;
+
+#define FNV64_OFFSET_BASIS 14695981039346656037ULL
+#define FNV64_PRIME        1099511628211ULL
+
+uint64_t scribe::consistenthash::hash64(const char* data, size_t len) {
+  uint64_t hash = FNV64_OFFSET_BASIS;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char) data[i];
+    hash *= FNV64_PRIME;
+  }
+  return hash;
+}
+
+uint32_t scribe::consistenthash::jump(uint64_t key, uint32_t num_buckets) {
+  int64_t b = -1;
+  int64_t j = 0;
+  while (j < (int64_t) num_buckets) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (int64_t) ((b + 1) * ((double) (1LL << 31) /
+                              (double) ((key >> 33) + 1)));
+  }
+  return b < 0 ? 0 : (uint32_t) b;
+}
+
+scribe::HashRing::HashRing() {
+}
+
+void scribe::HashRing::build(uint32_t num_buckets, uint32_t vnodes) {
+  points.clear();
+  points.reserve((size_t) num_buckets * vnodes);
+  for (uint32_t bucket = 0; bucket < num_buckets; ++bucket) {
+    for (uint32_t vnode = 0; vnode < vnodes; ++vnode) {
+      // little endian so every host builds the same ring
+      char id[8];
+      for (int i = 0; i < 4; ++i) {
+        id[i] = (char) (bucket >> (8 * i));
+        id[4 + i] = (char) (vnode >> (8 * i));
+      }
+      uint64_t hash = consistenthash::hash64(id, sizeof(id));
+      points.push_back(make_pair(pointHash(hash), bucket));
+    }
+  }
+  sort(points.begin(), points.end());
+}
+
+uint32_t scribe::HashRing::lookup(uint64_t key) const {
+  if (points.empty()) {
+    return 0;
+  }
+  // first point at or after the key, wrapping around the ring
+  vector<pair<uint32_t, uint32_t> >::const_iterator iter =
+    lower_bound(points.begin(), points.end(), make_pair(pointHash(key), 0U));
+  if (iter == points.end()) {
+    iter = points.begin();
+  }
+  return iter->second;
+}
+
+uint32_t scribe::HashRing::pointHash(uint64_t hash) {
+  return (uint32_t) (hash ^ (hash >> 32));
+}
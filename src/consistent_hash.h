@@ -0,0 +1,67 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_CONSISTENT_HASH_H
+#define SCRIBE_CONSISTENT_HASH_H
+
+// No thrift or boost here, so the benchmarks in test/ can build it alone
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace scribe {
+
+/*
+ * Bucketizing that only moves about 1/N of the keys when a bucket is
+ * added, unlike hash % num_buckets which moves almost all of them.
+ * see the key_jump and key_ring bucket types of BucketStore
+ */
+class consistenthash {
+ public:
+  // 64 bit FNV-1a, spreads keys well enough for jump()
+  static uint64_t hash64(const char* data, size_t len);
+
+  // Jump consistent hash (Lamping and Veach, 2014).
+  // Returns a bucket in [0, num_buckets), 0 if num_buckets is 0.
+  static uint32_t jump(uint64_t key, uint32_t num_buckets);
+};
+
+/*
+ * Ring of virtual nodes, vnodes points per bucket. Slower than jump() and
+ * needs memory for the points, but a bucket's points only depend on its
+ * number, so the same ring can be rebuilt anywhere.
+ */
+class HashRing {
+ public:
+  HashRing();
+
+  void build(uint32_t num_buckets, uint32_t vnodes);
+  // Returns a bucket in [0, num_buckets), 0 if the ring is empty
+  uint32_t lookup(uint64_t key) const;
+  bool empty() const { return points.empty(); }
+
+ protected:
+  static uint32_t pointHash(uint64_t hash);
+
+  // (position on the ring, bucket), sorted by position
+  std::vector<std::pair<uint32_t, uint32_t> > points;
+};
+
+} // !namespace scribe
+
+#endif // SCRIBE_CONSISTENT_HASH_H
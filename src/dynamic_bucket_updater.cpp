@@ -14,6 +14,15 @@ using boost::shared_ptr;
 extern shared_ptr<scribeHandler> g_Handler;
 
 DynamicBucketUpdater* DynamicBucketUpdater::instance_ = NULL;
+
+// how often the refresh thread looks for mappings to refresh
+#define REFRESH_CHECK_SEC      1
+// refresh a mapping once this much of its ttl has passed
+#define REFRESH_AHEAD_PERCENT  80
+// how often to retry a failed refresh
+#define REFRESH_RETRY_SEC      5
+// entries that haven't been looked up for this many ttls are dropped
+#define UNUSED_TTLS            3
 Mutex DynamicBucketUpdater::instanceLock_;
 
 // bucket updater connection error
@@ -132,14 +141,14 @@ bool DynamicBucketUpdater::getHost(facebook::fb303::FacebookBase *fbBase,
                       uint32_t recvTimeout) {
   DynamicBucketUpdater *instance = DynamicBucketUpdater::getInstance(fbBase);
 
-  instance->lock_.lock();
-
-  bool ret = instance->getHostInternal(category, ttl, bid,
-                                       host, port, updateHost,
-                                       updatePort, connTimeout,
-                                       sendTimeout, recvTimeout);
-  instance->lock_.unlock();
-  return ret;
+  UpdateSource source;
+  source.ttl_ = ttl;
+  source.host_ = updateHost;
+  source.port_ = updatePort;
+  source.connTimeout_ = connTimeout;
+  source.sendTimeout_ = sendTimeout;
+  source.recvTimeout_ = recvTimeout;
+  return instance->getHostInternal(category, bid, host, port, source);
 }
 
 /**
@@ -169,29 +178,17 @@ bool DynamicBucketUpdater::getHost(facebook::fb303::FacebookBase *fbBase,
                       uint32_t connTimeout,
                       uint32_t sendTimeout,
                       uint32_t recvTimeout) {
-    server_vector_t servers;
-    bool success = scribe::network_config::getService(serviceName,
-                                                      serviceOptions,
-                                                      servers);
-
-    // Cannot open if we couldn't find any servers
-    if (!success || servers.empty()) {
-      LOG_OPER("[%s] Failed to get servers from Service [%s] "
-               "for dynamic bucket updater",
-               category.c_str(), serviceName.c_str());
-
-      return false;
-    }
+  DynamicBucketUpdater *instance = DynamicBucketUpdater::getInstance(fbBase);
 
-    // randomly pick one from the service
-    int which = rand() % servers.size();
-    string updateHost = servers[which].first;
-    uint32_t updatePort = servers[which].second;
-    return DynamicBucketUpdater::getHost(fbBase, category, ttl, bid,
-                                         host, port,
-                                         updateHost, updatePort,
-                                         connTimeout, sendTimeout,
-                                         recvTimeout);
+  // the service is only looked up when the mapping is fetched
+  UpdateSource source;
+  source.ttl_ = ttl;
+  source.service_ = serviceName;
+  source.serviceOptions_ = serviceOptions;
+  source.connTimeout_ = connTimeout;
+  source.sendTimeout_ = sendTimeout;
+  source.recvTimeout_ = recvTimeout;
+  return instance->getHostInternal(category, bid, host, port, source);
 }
 
 /**
@@ -199,46 +196,51 @@ bool DynamicBucketUpdater::getHost(facebook::fb303::FacebookBase *fbBase,
   *
   * @param category the category name, or any identifier that uniquely
   *        identifies a bucket store.
-  * @param ttl ttl in seconds
   * @param bid bucket id
   * @param host the output parameter that receives the host output.
   *        If no mapping is found, this variable is not modified.
   * @param port the output parameter that receives the host output.
   *        If no mapping is found, this variable is not modified.
+  * @param source where to fetch the mapping from
   */
 bool DynamicBucketUpdater::getHostInternal(const string &category,
-                                           uint32_t ttl,
                                            uint64_t bid,
                                            string &host,
                                            uint32_t &port,
-                                           string updateHost,
-                                           uint32_t updatePort,
-                                           uint32_t connTimeout,
-                                           uint32_t sendTimeout,
-                                           uint32_t recvTimeout) {
+                                           const UpdateSource &source) {
+  shared_ptr<const CategoryEntry> catEnt = getEntry(category);
   time_t now = time(NULL);
 
-  // periodic check whether we need to fetch the mapping, or need to
-  // update
-  CatBidToHostMap::const_iterator iter = catMap_.find(category);
-  if (iter == catMap_.end() || iter->second.lastUpdated_ + ttl < now) {
-    periodicCheck(category,
-                  ttl,
-                  updateHost,
-                  updatePort,
-                  connTimeout, sendTimeout, recvTimeout);
-    iter = catMap_.find(category);
-    // check again.
-    if (iter == catMap_.end()) {
+  if (!catEnt) {
+    // The first lookup has nothing to fall back on, so it fetches the
+    // mapping itself. After that the refresh thread keeps it current.
+    if (canAttempt(category, now)) {
+      refresh(category, source);
+      catEnt = getEntry(category);
+    }
+    if (!catEnt) {
       return false;
     }
+  } else if (!(catEnt->source_ == source)) {
+    // The source changed, for example after a reinitialize. Try it once
+    // now, but if that fails keep serving the old mapping and leave the
+    // retries to the refresh thread.
+    {
+      Guard g(lock_);
+      wantedSource_[category] = source;
+    }
+    if (canAttempt(category, now) && refresh(category, source)) {
+      catEnt = getEntry(category);
+    }
+  }
+  if (catEnt->lastUsed_ != now) {
+    catEnt->lastUsed_ = now;
   }
 
-  const CategoryEntry &catEnt = iter->second;
-  map<uint64_t, HostEntry>::const_iterator bidIter = catEnt.bidMap_.find(bid);
+  map<uint64_t, HostEntry>::const_iterator bidIter = catEnt->bidMap_.find(bid);
 
   bool ret = false;
-  if (bidIter != catEnt.bidMap_.end()) {
+  if (bidIter != catEnt->bidMap_.end()) {
     const HostEntry &entry = bidIter->second;
     host = entry.host_;
     port = entry.port_;
@@ -246,7 +248,8 @@ bool DynamicBucketUpdater::getHostInternal(const string &category,
   } else {
     ostringstream oss;
     oss << "Missing mapping for category " << category << ", bid: " << bid
-        << ", updateHost: " << updateHost << ", updatePort: " << updatePort;
+        << ", updateHost: " << source.host_ << ", updatePort: "
+        << source.port_ << ", service: " << source.service_;
     LOG_OPER(oss.str());
     addStatValue(DynamicBucketUpdater::FB303_ERR_NOMAPPING, 1);
   }
@@ -254,6 +257,150 @@ bool DynamicBucketUpdater::getHostInternal(const string &category,
   return ret;
 }
 
+shared_ptr<const DynamicBucketUpdater::CategoryEntry>
+DynamicBucketUpdater::getEntry(const string &category) {
+  shared_ptr<const CatBidToHostMap> snapshot;
+  {
+    Guard g(snapshotLock_);
+    snapshot = catMap_;
+  }
+  CatBidToHostMap::const_iterator iter = snapshot->find(category);
+  if (iter == snapshot->end()) {
+    return shared_ptr<const CategoryEntry>();
+  }
+  return iter->second;
+}
+
+// Copies the category map with the new entry and swaps it in. Lookups
+// holding the old map keep using it until they are done.
+void DynamicBucketUpdater::publish(shared_ptr<const CategoryEntry> entry) {
+  Guard g(snapshotLock_);
+  shared_ptr<CatBidToHostMap> next(new CatBidToHostMap(*catMap_));
+  CatBidToHostMap::iterator old_iter = next->find(entry->category_);
+  entry->lastUsed_ = (old_iter != next->end()) ?
+    old_iter->second->lastUsed_ : time(NULL);
+  (*next)[entry->category_] = entry;
+  catMap_ = next;
+}
+
+void DynamicBucketUpdater::unpublish(const string &category) {
+  Guard g(snapshotLock_);
+  shared_ptr<CatBidToHostMap> next(new CatBidToHostMap(*catMap_));
+  next->erase(category);
+  catMap_ = next;
+}
+
+bool DynamicBucketUpdater::canAttempt(const string &category, time_t now) {
+  Guard g(lock_);
+  map<string, time_t>::iterator attempt = lastAttempt_.find(category);
+  return attempt == lastAttempt_.end() ||
+         now - attempt->second >= REFRESH_RETRY_SEC;
+}
+
+bool DynamicBucketUpdater::refresh(const string &category,
+                                   const UpdateSource &source) {
+  Guard g(lock_);
+  lastAttempt_[category] = time(NULL);
+
+  string updateHost = source.host_;
+  uint32_t updatePort = source.port_;
+  if (!source.service_.empty()) {
+    server_vector_t servers;
+    bool success = scribe::network_config::getService(source.service_,
+                                                      source.serviceOptions_,
+                                                      servers);
+
+    // Cannot open if we couldn't find any servers
+    if (!success || servers.empty()) {
+      LOG_OPER("[%s] Failed to get servers from Service [%s] "
+               "for dynamic bucket updater",
+               category.c_str(), source.service_.c_str());
+
+      return false;
+    }
+
+    // randomly pick one from the service
+    int which = rand() % servers.size();
+    updateHost = servers[which].first;
+    updatePort = servers[which].second;
+  }
+  bool success = periodicCheck(category, source, updateHost, updatePort);
+  map<string, UpdateSource>::iterator wanted = wantedSource_.find(category);
+  if (success && wanted != wantedSource_.end() && wanted->second == source) {
+    wantedSource_.erase(wanted);
+  }
+  return success;
+}
+
+/**
+  * Refreshes every mapping once REFRESH_AHEAD_PERCENT of its ttl has
+  * passed, so a new mapping is usually in place before the old one
+  * expires. Failed refreshes are retried every REFRESH_RETRY_SEC.
+  */
+void DynamicBucketUpdater::refreshLoop() {
+  while (true) {
+    sleep(REFRESH_CHECK_SEC);
+
+    shared_ptr<const CatBidToHostMap> snapshot;
+    {
+      Guard g(snapshotLock_);
+      snapshot = catMap_;
+    }
+
+    time_t now = time(NULL);
+    for (CatBidToHostMap::const_iterator iter = snapshot->begin();
+         iter != snapshot->end(); ++iter) {
+      const CategoryEntry &catEnt = *iter->second;
+
+      // Stop refreshing categories whose stores are gone
+      time_t ttl = max((time_t) catEnt.ttl_, (time_t) REFRESH_CHECK_SEC);
+      if (now - catEnt.lastUsed_ > UNUSED_TTLS * ttl) {
+        LOG_OPER("[%s] bucket mapping not used for <%lu> seconds, dropping it",
+                 catEnt.category_.c_str(),
+                 (unsigned long) (now - catEnt.lastUsed_));
+        unpublish(catEnt.category_);
+        Guard g(lock_);
+        lastAttempt_.erase(catEnt.category_);
+        wantedSource_.erase(catEnt.category_);
+        continue;
+      }
+
+      // A source asked for by a lookup is fetched right away
+      UpdateSource source = catEnt.source_;
+      bool wanted = false;
+      {
+        Guard g(lock_);
+        map<string, UpdateSource>::iterator wanted_iter =
+          wantedSource_.find(catEnt.category_);
+        if (wanted_iter != wantedSource_.end()) {
+          source = wanted_iter->second;
+          wanted = true;
+        }
+      }
+
+      time_t refreshAt = catEnt.lastUpdated_ +
+                         catEnt.ttl_ * REFRESH_AHEAD_PERCENT / 100;
+      if (!wanted && now < refreshAt) {
+        continue;
+      }
+      if (!canAttempt(catEnt.category_, now)) {
+        continue;
+      }
+      if (!refresh(catEnt.category_, source) &&
+          now > catEnt.lastUpdated_ + (time_t) catEnt.ttl_) {
+        LOG_OPER("[%s] bucket mapping is past its ttl, still using it",
+                 catEnt.category_.c_str());
+      }
+    }
+  }
+}
+
+void* DynamicBucketUpdater::refreshThreadStatic(void* arg) {
+  DynamicBucketUpdater* updater = (DynamicBucketUpdater*) arg;
+  updater->refreshLoop();
+  return NULL;
+}
+
 /**
   * Given a category name, remote host:port, current time, and category
   * mapping time to live (ttl), check whether we need to update the
@@ -261,35 +408,26 @@ bool DynamicBucketUpdater::getHostInternal(const string &category,
   * using bucketupdater thrift interface and update internal category,
   * bucket id to host mappings.
   *
-  * This function takes care of try/catch and locking.  The bulk of the
+  * This function takes care of try/catch.  The bulk of the
   * update logic is delegated to updateInternal.
   *
   * @param category category or key that uniquely identifies this updater.
-  * @param ttl ttl in seconds
+  * @param source ttl and timeouts to use
   * @param host remote host that will be used to retrieve bucket mapping
   * @param port remote port that will be used to retrieve bucket mapping
-  * @param connTimeout connection timeout
-  * @param sendTimeout send time out
-  * @param recvTimeout receive time out
   *
   * @return true if successful. false otherwise.
   */
 bool DynamicBucketUpdater::periodicCheck(string category,
-                                         uint32_t ttl,
+                                         const UpdateSource &source,
                                          string host,
-                                         uint32_t port,
-                                         uint32_t connTimeout,
-                                         uint32_t sendTimeout,
-                                         uint32_t recvTimeout) {
+                                         uint32_t port) {
+  uint32_t connTimeout = source.connTimeout_;
+  uint32_t sendTimeout = source.sendTimeout_;
+  uint32_t recvTimeout = source.recvTimeout_;
   bool ret = false;
   try {
-    ret = updateInternal(category,
-                         ttl,
-                         host,
-                         port,
-                         connTimeout,
-                         sendTimeout,
-                         recvTimeout);
+    ret = updateInternal(category, source, host, port);
   } catch (const TTransportException& ttx) {
     LOG_OPER("periodicCheck(%s, %s, %u, %d, %d, %d) TTransportException: %s",
             category.c_str(), host.c_str(), port,
@@ -316,31 +454,19 @@ bool DynamicBucketUpdater::periodicCheck(string category,
   * bucket id to host mappings.
   *
   * @param category category or other uniquely identifiable key
-  * @param ttl ttl in seconds
+  * @param source ttl and timeouts to use
   * @param remoteHost remote host that will be used to retrieve bucket mapping
   * @param remotePort remote port that will be used to retrieve bucket mapping
-  * @param connTimeout connection timeout
-  * @param sendTimeout send time out
-  * @param recvTimeout receive time out
   *
   * @return true if successful. false otherwise.
   */
 bool DynamicBucketUpdater::updateInternal(
                            string category,
-                           uint32_t ttl,
+                           const UpdateSource &source,
                            string remoteHost,
-                           uint32_t remotePort,
-                           uint32_t connTimeout,
-                           uint32_t sendTimeout,
-                           uint32_t recvTimeout) {
+                           uint32_t remotePort) {
   addStatValue(DynamicBucketUpdater::FB303_REMOTEUPDATE, 1);
 
-  // remove the current mapping
-  CatBidToHostMap::iterator catIter = catMap_.find(category);
-  if (catIter != catMap_.end()) {
-    catMap_.erase(catIter);
-  }
-
   shared_ptr<TSocket> socket = shared_ptr<TSocket>(
                                 new TSocket(remoteHost, remotePort));
 
@@ -358,9 +484,9 @@ bool DynamicBucketUpdater::updateInternal(
     return false;
   }
 
-  socket->setConnTimeout(connTimeout);
-  socket->setRecvTimeout(recvTimeout);
-  socket->setSendTimeout(sendTimeout);
+  socket->setConnTimeout(source.connTimeout_);
+  socket->setRecvTimeout(source.recvTimeout_);
+  socket->setSendTimeout(source.sendTimeout_);
 
   shared_ptr<TFramedTransport> framedTransport = shared_ptr<TFramedTransport>(
                 new TFramedTransport(socket));
@@ -380,8 +506,9 @@ bool DynamicBucketUpdater::updateInternal(
     return false;
   }
 
-  CategoryEntry catEntry(category, ttl);
-  catEntry.lastUpdated_ = time(NULL);
+  shared_ptr<CategoryEntry> catEntry(new CategoryEntry(category, source.ttl_));
+  catEntry->lastUpdated_ = time(NULL);
+  catEntry->source_ = source;
   // update bucket id host mappings
   for (map<int32_t, HostPort>::const_iterator iter = mapping.begin();
       iter != mapping.end(); ++iter) {
@@ -390,9 +517,9 @@ bool DynamicBucketUpdater::updateInternal(
     HostEntry hentry;
     hentry.host_ = hp.host;
     hentry.port_ = hp.port;
-    catEntry.bidMap_[bid] = hentry;
+    catEntry->bidMap_[bid] = hentry;
   }
-  catMap_[category] = catEntry;
+  publish(catEntry);
 
   // increment the counter for number of buckets updated
   addStatValue(DynamicBucketUpdater::FB303_BUCKETSUPDATED, mapping.size());
@@ -400,6 +527,14 @@ bool DynamicBucketUpdater::updateInternal(
   return true;
 }
 
+DynamicBucketUpdater::DynamicBucketUpdater(FacebookBase *fbBase)
+    : fbBase_(fbBase),
+      catMap_(new CatBidToHostMap) {
+  initFb303Counters();
+  pthread_create(&refreshThread_, NULL, refreshThreadStatic, (void*) this);
+  pthread_detach(refreshThread_);
+}
+
 DynamicBucketUpdater* DynamicBucketUpdater::getInstance(
                                         FacebookBase *fbBase) {
   if (DynamicBucketUpdater::instance_) {
@@ -29,6 +29,12 @@ using std::map;
 /**
   * DynamicBucketUpdater updates a bucket store's bucket id to host:port
   * mapping periodically using the bucketupdater.thrift interface.
+  *
+  * Each category's mapping is an immutable snapshot. A background thread
+  * fetches a new one before the ttl runs out and swaps it in, so lookups
+  * only copy a pointer and never wait for the remote updater. Only the
+  * first lookup of a category fetches its mapping inline. If a refresh
+  * fails the old mapping is kept until a later refresh succeeds.
   */
 class DynamicBucketUpdater {
  public:
@@ -115,28 +121,52 @@ class DynamicBucketUpdater {
                       uint32_t recvTimeout = 150);
 
  protected:
+  struct UpdateSource {
+    UpdateSource() : ttl_(0), port_(0), connTimeout_(0), sendTimeout_(0),
+                     recvTimeout_(0) {}
+
+    bool operator==(const UpdateSource& other) const {
+      return ttl_ == other.ttl_ && port_ == other.port_ &&
+             host_ == other.host_ && service_ == other.service_ &&
+             serviceOptions_ == other.serviceOptions_;
+    }
+
+    uint32_t  ttl_;
+    string    host_;           // updater host:port, if no service
+    uint32_t  port_;
+    string    service_;        // resolved again on every refresh
+    string    serviceOptions_;
+    uint32_t  connTimeout_;
+    uint32_t  sendTimeout_;
+    uint32_t  recvTimeout_;
+  };
+
   /**
     * actual implementation of getHost.
     *
     * @param category the category name, or any identifier that uniquely
     *        identifies a bucket store.
-    * @param ttl ttl in seconds
     * @param bid bucket id
     * @param host the output parameter that receives the host output.
     *        If no mapping is found, this variable is not modified.
     * @param port the output parameter that receives the host output.
     *        If no mapping is found, this variable is not modified.
+    * @param source where to fetch the mapping from
     */
   bool getHostInternal(const string &category,
-                      uint32_t ttl,
-                      uint64_t bid,
-                      string &host,
-                      uint32_t &port,
-                      string updateHost,
-                      uint32_t updatePort,
-                      uint32_t connTimeout,
-                      uint32_t sendTimeout,
-                      uint32_t recvTimeout);
+                       uint64_t bid,
+                       string &host,
+                       uint32_t &port,
+                       const UpdateSource &source);
+  /**
+    * Fetches a new mapping for category from source and publishes it.
+    * Only one refresh runs at a time.
+    */
+  bool refresh(const string &category, const UpdateSource &source);
+  // Returns true if category wasn't fetched in the last REFRESH_RETRY_SEC
+  bool canAttempt(const string &category, time_t now);
+  void refreshLoop();
+  static void* refreshThreadStatic(void* arg);
   /**
     * Given a category name, remote host:port, current time, and category
     * mapping, performs a periodic update.  The current mapping will be
@@ -146,42 +176,45 @@ class DynamicBucketUpdater {
     * update logic is delegated to updateInternal.
     *
     * @param category category or key that uniquely identifies this updater.
-    * @param ttl ttl in seconds
+    * @param source ttl and timeouts to use
     * @param host remote host that will be used to retrieve bucket mapping
     * @param port remote port that will be used to retrieve bucket mapping
-    * @param connTimeout connection timeout
-    * @param sendTimeout send time out
-    * @param recvTimeout receive time out
     *
     * @return true if successful. false otherwise.
     */
   bool periodicCheck(string category,
-                     uint32_t ttl,
+                     const UpdateSource &source,
                      string host,
-                     uint32_t port,
-                     uint32_t connTimeout = 150,
-                     uint32_t sendTimeout = 150,
-                     uint32_t recvTimeout = 150);
+                     uint32_t port);
 
   struct HostEntry {
     string     host_;
     uint32_t   port_;
   };
 
+  // Never modified once published
   struct CategoryEntry {
     CategoryEntry() {}
     CategoryEntry(string category, uint32_t ttl) : category_(category), ttl_(ttl),
-                                                   lastUpdated_(0) {
+                                                   lastUpdated_(0),
+                                                   lastUsed_(0) {
     }
 
     string    category_;
     uint32_t  ttl_;
     time_t    lastUpdated_;
+    // Set by lookups without a lock, only read to drop unused entries
+    mutable volatile time_t lastUsed_;
+    UpdateSource source_;
     map<uint64_t, HostEntry> bidMap_;
   };
 
   // category and bid to HostEntry map
-  typedef map<string, CategoryEntry> CatBidToHostMap;
+  typedef map<string, boost::shared_ptr<const CategoryEntry> > CatBidToHostMap;
+
+  boost::shared_ptr<const CategoryEntry> getEntry(const string &category);
+  void publish(boost::shared_ptr<const CategoryEntry> entry);
+  void unpublish(const string &category);
 
   /**
     * Given a category name, remote host and port, query bucket mapping
@@ -189,22 +222,16 @@ class DynamicBucketUpdater {
     * bucket id to host mappings.
     *
     * @param category category or other uniquely identifiable key
-    * @param ttl ttl in seconds
+    * @param source ttl and timeouts to use
     * @param remoteHost remote host that will be used to retrieve bucket mapping
     * @param remotePort remote port that will be used to retrieve bucket mapping
-    * @param connTimeout connection timeout
-    * @param sendTimeout send time out
-    * @param recvTimeout receive time out
     *
     * @return true if successful. false otherwise.
     */
   bool updateInternal(string category,
-                      uint32_t ttl,
+                      const UpdateSource &source,
                       string remoteHost,
-                      uint32_t remotePort,
-                      uint32_t connTimeout,
-                      uint32_t sendTimeout,
-                      uint32_t recvTimeout);
+                      uint32_t remotePort);
 
   static DynamicBucketUpdater *getInstance(facebook::fb303::FacebookBase *fbBase);
 
@@ -216,8 +243,16 @@ class DynamicBucketUpdater {
   static DynamicBucketUpdater *instance_;
   static apache::thrift::concurrency::Mutex instanceLock_;
   facebook::fb303::FacebookBase *fbBase_;
+  // held while fetching a mapping, lookups never take it
   apache::thrift::concurrency::Mutex lock_;
-  CatBidToHostMap catMap_;
+  // only held to read or swap catMap_
+  apache::thrift::concurrency::Mutex snapshotLock_;
+  boost::shared_ptr<const CatBidToHostMap> catMap_;
+  map<string, time_t> lastAttempt_; // protected by lock_
+  // source a lookup asked for that differs from its entry's, until a
+  // refresh from it succeeds. protected by lock_
+  map<string, UpdateSource> wantedSource_;
+  pthread_t refreshThread_;
 
   void addStatValue(string name, uint64_t value) {
 #ifdef FACEBOOK
@@ -228,10 +263,7 @@ class DynamicBucketUpdater {
   }
 
   // make singleton
-  DynamicBucketUpdater(facebook::fb303::FacebookBase *fbBase)
-      : fbBase_(fbBase) {
-    initFb303Counters();
-  }
+  DynamicBucketUpdater(facebook::fb303::FacebookBase *fbBase);
 
   DynamicBucketUpdater(const DynamicBucketUpdater& other) {}
 };
@@ -23,6 +23,8 @@
 
 #include "common.h"
 #include "scribe_server.h"
+#include "compression.h"
+#include "relay.h"
 
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -98,6 +100,19 @@ uint32_t scribe::strhash::hash32(const char *s) {
 // note: this function uses global g_Handler.
 void scribe::startServer() {
   boost::shared_ptr<TProcessor> processor(new scribeProcessor(g_Handler));
+  if (g_Handler->getRelayMode()) {
+#ifdef USE_SCRIBE_RELAY
+    if (g_Handler->getWireCompression()) {
+      LOG_OPER("relay_mode is ignored when wire_compression is enabled");
+    } else {
+      processor = boost::shared_ptr<TProcessor>(new RelayProcessor(processor));
+      LOG_OPER("Relaying Log requests to network stores");
+    }
+#else
+    LOG_OPER("relay_mode is ignored, scribe was built with a Thrift older "
+             "than 0.6.0");
+#endif
+  }
   /* This factory is for binary compatibility. */
   boost::shared_ptr<TProtocolFactory> protocol_factory(
     new TBinaryProtocolFactory(0, 0, false, false)
@@ -115,12 +130,33 @@ void scribe::startServer() {
     thread_manager->start();
   }
 
-  shared_ptr<TNonblockingServer> server(new TNonblockingServer(
-                                          processor,
-                                          protocol_factory,
-                                          g_Handler->port,
-                                          thread_manager
-                                        ));
+  shared_ptr<TNonblockingServer> server;
+  if (g_Handler->getWireCompression()) {
+    // accept both compressed and plain requests and tell clients about it
+    shared_ptr<TTransportFactory> input_factory(
+      new CompressedFrameTransportFactory());
+    shared_ptr<TTransportFactory> output_factory(new TTransportFactory());
+    server = shared_ptr<TNonblockingServer>(new TNonblockingServer(
+                                              processor,
+                                              input_factory,
+                                              output_factory,
+                                              protocol_factory,
+                                              protocol_factory,
+                                              g_Handler->port,
+                                              thread_manager
+                                            ));
+    g_Handler->setOption(WIRE_COMPRESSION_OPTION,
+                         WireCompression::supported());
+    LOG_OPER("Accepting compressed requests: %s",
+             WireCompression::supported().c_str());
+  } else {
+    server = shared_ptr<TNonblockingServer>(new TNonblockingServer(
+                                              processor,
+                                              protocol_factory,
+                                              g_Handler->port,
+                                              thread_manager
+                                            ));
+  }
   g_Handler->setServer(server);
 
   LOG_OPER("Starting scribe server on port %lu", g_Handler->port);
@@ -0,0 +1,222 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "scribe_server.h"
+#include "host_health.h"
+
+using namespace std;
+
+#define DEFAULT_HEALTH_FAILURE_THRESHOLD  3
+#define DEFAULT_HEALTH_MAX_ERROR_RATE     50
+#define DEFAULT_HEALTH_MIN_SENDS          10
+#define DEFAULT_HEALTH_SLOW_SEND_MS       0
+#define DEFAULT_HEALTH_OPEN_TIME_MS       5000
+
+health_policy_t::health_policy_t()
+  : enabled(false),
+    failureThreshold(DEFAULT_HEALTH_FAILURE_THRESHOLD),
+    maxErrorRate(DEFAULT_HEALTH_MAX_ERROR_RATE),
+    minSends(DEFAULT_HEALTH_MIN_SENDS),
+    slowSendMs(DEFAULT_HEALTH_SLOW_SEND_MS),
+    openTimeMs(DEFAULT_HEALTH_OPEN_TIME_MS) {
+}
+
+HostHealthTracker::HostEntry::HostEntry()
+  : state(CLOSED),
+    consecutiveFailures(0),
+    sends(0),
+    errorRate(0),
+    openedAt(0),
+    probeSentAt(0) {
+}
+
+HostHealthTracker::HostHealthTracker() {
+  pthread_mutex_init(&healthMutex, NULL);
+}
+
+HostHealthTracker::~HostHealthTracker() {
+  pthread_mutex_destroy(&healthMutex);
+}
+
+// Same format as the ConnPool keys
+string HostHealthTracker::makeKey(const string& host, unsigned long port) {
+  ostringstream oss;
+  oss << host << ":" << port;
+  return oss.str();
+}
+
+const char* HostHealthTracker::stateAsString(health_state_t state) {
+  switch (state) {
+  case CLOSED:
+    return "CLOSED";
+  case OPEN:
+    return "OPEN";
+  case HALF_OPEN:
+    return "HALF_OPEN";
+  default:
+    return "unknown state";
+  }
+}
+
+void HostHealthTracker::setPolicy(const string& key,
+                                  const health_policy_t& policy) {
+  pthread_mutex_lock(&healthMutex);
+  hosts[key].policy = policy;
+  pthread_mutex_unlock(&healthMutex);
+}
+
+bool HostHealthTracker::isAvailable(const string& key) {
+  bool available = true;
+  unsigned long now = scribe::clock::nowInMsec();
+
+  pthread_mutex_lock(&healthMutex);
+  host_map_t::iterator iter = hosts.find(key);
+  if (iter != hosts.end() && iter->second.policy.enabled &&
+      iter->second.state == OPEN &&
+      now - iter->second.openedAt < iter->second.policy.openTimeMs) {
+    available = false;
+  }
+  pthread_mutex_unlock(&healthMutex);
+  return available;
+}
+
+bool HostHealthTracker::allowSend(const string& key, bool* probe) {
+  bool allowed = true;
+  unsigned long now = scribe::clock::nowInMsec();
+  *probe = false;
+
+  pthread_mutex_lock(&healthMutex);
+  host_map_t::iterator iter = hosts.find(key);
+  if (iter != hosts.end() && iter->second.policy.enabled) {
+    HostEntry& entry = iter->second;
+    if (entry.state == OPEN) {
+      if (now - entry.openedAt < entry.policy.openTimeMs) {
+        allowed = false;
+      } else {
+        changeState(key, entry, HALF_OPEN, now);
+      }
+    }
+    if (entry.state == HALF_OPEN) {
+      // Only one probe at a time. If its result never comes back
+      // let another caller try after the open time.
+      if (entry.probeSentAt != 0 &&
+          now - entry.probeSentAt < entry.policy.openTimeMs) {
+        allowed = false;
+      } else {
+        entry.probeSentAt = now;
+        *probe = true;
+      }
+    }
+  }
+  pthread_mutex_unlock(&healthMutex);
+  return allowed;
+}
+
+void HostHealthTracker::recordSuccess(const string& key,
+                                      unsigned long latency_ms) {
+  record(key, true, latency_ms);
+}
+
+void HostHealthTracker::recordFailure(const string& key,
+                                      unsigned long latency_ms) {
+  record(key, false, latency_ms);
+}
+
+HostHealthTracker::health_state_t
+HostHealthTracker::getState(const string& key) {
+  health_state_t state = CLOSED;
+  pthread_mutex_lock(&healthMutex);
+  host_map_t::iterator iter = hosts.find(key);
+  if (iter != hosts.end() && iter->second.policy.enabled) {
+    state = iter->second.state;
+  }
+  pthread_mutex_unlock(&healthMutex);
+  return state;
+}
+
+void HostHealthTracker::record(const string& key, bool success,
+                               unsigned long latency_ms) {
+  unsigned long now = scribe::clock::nowInMsec();
+
+  pthread_mutex_lock(&healthMutex);
+  HostEntry& entry = hosts[key];
+  const health_policy_t& policy = entry.policy;
+  if (!policy.enabled) {
+    pthread_mutex_unlock(&healthMutex);
+    return;
+  }
+
+  bool failed = !success ||
+    (policy.slowSendMs != 0 && latency_ms > policy.slowSendMs);
+  if (failed) {
+    ++entry.consecutiveFailures;
+  } else {
+    entry.consecutiveFailures = 0;
+  }
+
+  // moving average over roughly the last minSends sends
+  double alpha = 2.0 / (max(policy.minSends, 1UL) + 1);
+  entry.errorRate += alpha * ((failed ? 100.0 : 0.0) - entry.errorRate);
+  if (entry.sends < policy.minSends) {
+    ++entry.sends;
+  }
+
+  switch (entry.state) {
+  case CLOSED:
+    if (failed &&
+        (entry.consecutiveFailures >= policy.failureThreshold ||
+         (entry.sends >= policy.minSends &&
+          entry.errorRate >= policy.maxErrorRate))) {
+      changeState(key, entry, OPEN, now);
+    }
+    break;
+  case HALF_OPEN:
+    changeState(key, entry, failed ? OPEN : CLOSED, now);
+    break;
+  case OPEN:
+    // results of sends started before the circuit opened
+    break;
+  }
+  pthread_mutex_unlock(&healthMutex);
+}
+
+void HostHealthTracker::changeState(const string& key, HostEntry& entry,
+                                    health_state_t new_state,
+                                    unsigned long now) {
+  LOG_OPER("circuit breaker for <%s> changed from %s to %s "
+           "(consecutive failures <%lu>, error rate <%.0f%%>)",
+           key.c_str(), stateAsString(entry.state), stateAsString(new_state),
+           entry.consecutiveFailures, entry.errorRate);
+
+  entry.state = new_state;
+  entry.probeSentAt = 0;
+  switch (new_state) {
+  case OPEN:
+    entry.openedAt = now;
+    g_Handler->incCounter("circuit breaker opened");
+    break;
+  case CLOSED:
+    entry.consecutiveFailures = 0;
+    entry.sends = 0;
+    entry.errorRate = 0;
+    g_Handler->incCounter("circuit breaker closed");
+    break;
+  case HALF_OPEN:
+    break;
+  }
+}
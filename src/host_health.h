@@ -0,0 +1,108 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_HOST_HEALTH_H
+#define SCRIBE_HOST_HEALTH_H
+
+#include "common.h"
+
+// Thresholds for one destination's circuit breaker
+struct health_policy_t {
+  health_policy_t();
+
+  bool enabled;                   // off unless a store asks for it
+  unsigned long failureThreshold; // consecutive failures that open the circuit
+  unsigned long maxErrorRate;     // percent of recent sends that may fail
+  unsigned long minSends;         // sends needed before the rate is used
+  unsigned long slowSendMs;       // slower sends count as failures, 0 = never
+  unsigned long openTimeMs;       // how long to skip the host before probing
+};
+
+/*
+ * Circuit breaker shared by every connection to the same host:port or
+ * service, so all categories sending there agree on whether it is healthy.
+ *
+ * CLOSED:    the destination is healthy and sends go through.
+ * OPEN:      too many recent sends failed or were too slow. Connects and
+ *            sends are refused without touching the network until
+ *            openTimeMs has passed.
+ * HALF_OPEN: the open time is over. One caller at a time is allowed to
+ *            send a cheap probe, and its result closes or reopens the
+ *            circuit.
+ *
+ * A destination whose policy isn't enabled is always CLOSED.
+ *
+ * see the global g_hostHealth in store.cpp
+ */
+class HostHealthTracker {
+ public:
+  enum health_state_t {
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+  };
+
+  HostHealthTracker();
+  virtual ~HostHealthTracker();
+
+  static std::string makeKey(const std::string& host, unsigned long port);
+  static const char* stateAsString(health_state_t state);
+
+  void setPolicy(const std::string& key, const health_policy_t& policy);
+
+  // Returns false if the destination should be skipped right now.
+  // Doesn't use up the half open probe, so it is safe to call before
+  // connecting.
+  bool isAvailable(const std::string& key);
+
+  // Returns false if a send to the destination should fail right away.
+  // If true is returned and *probe is set the caller must send a cheap
+  // probe request first and report its result.
+  bool allowSend(const std::string& key, bool* probe);
+
+  void recordSuccess(const std::string& key, unsigned long latency_ms);
+  void recordFailure(const std::string& key, unsigned long latency_ms);
+
+  health_state_t getState(const std::string& key);
+
+ protected:
+  struct HostEntry {
+    HostEntry();
+
+    health_policy_t policy;
+    health_state_t state;
+    unsigned long consecutiveFailures;
+    unsigned long sends;       // sends seen, capped at policy.minSends
+    double errorRate;          // moving average of failures, 0 to 100
+    unsigned long openedAt;    // in msec
+    unsigned long probeSentAt; // in msec, 0 if no probe is outstanding
+  };
+  typedef std::map<std::string, HostEntry> host_map_t;
+
+  // Should be called while holding healthMutex
+  void changeState(const std::string& key, HostEntry& entry,
+                   health_state_t new_state, unsigned long now);
+  void record(const std::string& key, bool success,
+              unsigned long latency_ms);
+
+  pthread_mutex_t healthMutex;
+  host_map_t hosts;
+};
+
+extern HostHealthTracker g_hostHealth;
+
+#endif // !defined SCRIBE_HOST_HEALTH_H
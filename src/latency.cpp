@@ -0,0 +1,188 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+
+#include "common.h"
+#include "latency.h"
+
+using namespace std;
+
+// Sub-buckets per power of two, and the values below which every value
+// gets a bucket of its own
+#define LATENCY_SUB_BITS       3
+#define LATENCY_SUB_BUCKETS    (1 << LATENCY_SUB_BITS)
+#define LATENCY_EXACT_LIMIT    (2 * LATENCY_SUB_BUCKETS)
+#define LATENCY_MAX_BITS       32
+#define LATENCY_NUM_BUCKETS    (LATENCY_EXACT_LIMIT + \
+  (LATENCY_MAX_BITS - LATENCY_SUB_BITS - 1) * LATENCY_SUB_BUCKETS)
+#define DEFAULT_LATENCY_WINDOW 60000
+
+static const char* latencyNames[LatencyTracker::NUM_LATENCY_TYPES] = {
+  "ingest to handle",
+  "ingest to ack"
+};
+
+static const struct {
+  const char* name;
+  double fraction;
+} latencyPercentiles[] = {
+  { "p50",  0.5 },
+  { "p99",  0.99 },
+  { "p999", 0.999 }
+};
+
+LatencyHistogram::LatencyHistogram()
+  : buckets(LATENCY_NUM_BUCKETS, 0),
+    total(0) {
+}
+
+unsigned LatencyHistogram::bucketOf(unsigned long value) {
+  if (value < LATENCY_EXACT_LIMIT) {
+    return value;
+  }
+  if (value > 0xFFFFFFFFUL) {
+    value = 0xFFFFFFFFUL;
+  }
+
+  unsigned msb = 0;
+  while (value >> (msb + 1)) {
+    ++msb;
+  }
+  unsigned shift = msb - LATENCY_SUB_BITS;
+  return LATENCY_EXACT_LIMIT +
+    (msb - LATENCY_SUB_BITS - 1) * LATENCY_SUB_BUCKETS +
+    ((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+unsigned long LatencyHistogram::bucketTop(unsigned bucket) {
+  if (bucket < LATENCY_EXACT_LIMIT) {
+    return bucket;
+  }
+  unsigned index = bucket - LATENCY_EXACT_LIMIT;
+  unsigned shift = index / LATENCY_SUB_BUCKETS + 1;
+  unsigned long sub = LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::add(unsigned long value) {
+  ++buckets[bucketOf(value)];
+  ++total;
+}
+
+void LatencyHistogram::clear() {
+  fill(buckets.begin(), buckets.end(), 0);
+  total = 0;
+}
+
+unsigned long LatencyHistogram::percentile(double fraction) const {
+  if (total == 0) {
+    return 0;
+  }
+
+  unsigned long target = (unsigned long)(fraction * total + 0.999999);
+  if (target == 0) {
+    target = 1;
+  }
+  unsigned long seen = 0;
+  for (unsigned bucket = 0; bucket < buckets.size(); ++bucket) {
+    seen += buckets[bucket];
+    if (seen >= target) {
+      return bucketTop(bucket);
+    }
+  }
+  return bucketTop(buckets.size() - 1);
+}
+
+LatencyTracker::CategoryLatency::CategoryLatency()
+  : windowStart(0) {
+}
+
+LatencyTracker::LatencyTracker()
+  : windowMs(DEFAULT_LATENCY_WINDOW) {
+  pthread_mutex_init(&latencyMutex, NULL);
+}
+
+LatencyTracker::~LatencyTracker() {
+  pthread_mutex_destroy(&latencyMutex);
+}
+
+void LatencyTracker::setWindow(unsigned long window_ms) {
+  pthread_mutex_lock(&latencyMutex);
+  windowMs = window_ms ? window_ms : DEFAULT_LATENCY_WINDOW;
+  pthread_mutex_unlock(&latencyMutex);
+}
+
+void LatencyTracker::rotate(CategoryLatency& latency, unsigned long now) {
+  if (latency.windowStart == 0) {
+    latency.windowStart = now;
+  } else if (now - latency.windowStart >= windowMs) {
+    // nothing was recorded in the window before this one if more than
+    // a window has passed since this one ended
+    bool skipped = (now - latency.windowStart >= 2 * windowMs);
+    for (int type = 0; type < NUM_LATENCY_TYPES; ++type) {
+      if (skipped) {
+        latency.last[type].clear();
+      } else {
+        latency.last[type] = latency.current[type];
+      }
+      latency.current[type].clear();
+    }
+    latency.windowStart = now;
+  }
+}
+
+void LatencyTracker::record(const string& category, unsigned long handle_ms,
+                            unsigned long ack_ms) {
+  unsigned long now = scribe::clock::nowInMsec();
+
+  pthread_mutex_lock(&latencyMutex);
+  CategoryLatency& latency = categories[category];
+  rotate(latency, now);
+  latency.current[HANDLE].add(handle_ms);
+  latency.current[ACK].add(ack_ms);
+  pthread_mutex_unlock(&latencyMutex);
+}
+
+void LatencyTracker::getCounters(map<string, int64_t>& _return) {
+  unsigned long now = scribe::clock::nowInMsec();
+
+  pthread_mutex_lock(&latencyMutex);
+  for (category_latency_map_t::iterator iter = categories.begin();
+       iter != categories.end();
+       ++iter) {
+    CategoryLatency& latency = iter->second;
+    rotate(latency, now);
+
+    for (int type = 0; type < NUM_LATENCY_TYPES; ++type) {
+      // until a window is complete, report the one in progress
+      const LatencyHistogram& histogram = latency.last[type].count() ?
+        latency.last[type] : latency.current[type];
+      if (histogram.count() == 0) {
+        continue;
+      }
+
+      for (size_t i = 0;
+           i < sizeof(latencyPercentiles) / sizeof(latencyPercentiles[0]);
+           ++i) {
+        string name = iter->first + ":" + latencyNames[type] + " " +
+                      latencyPercentiles[i].name;
+        _return[name] = histogram.percentile(latencyPercentiles[i].fraction);
+      }
+    }
+  }
+  pthread_mutex_unlock(&latencyMutex);
+}
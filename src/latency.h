@@ -0,0 +1,94 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+
+#ifndef SCRIBE_LATENCY_H
+#define SCRIBE_LATENCY_H
+
+#include "common.h"
+
+/*
+ * Histogram of latencies in msec. Values under 16 get a bucket each,
+ * larger ones share a bucket with values within 1/8 of them, so a few
+ * hundred buckets cover up to 49 days.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void add(unsigned long value);
+  void clear();
+  unsigned long count() const { return total; }
+
+  // Smallest value that fraction of the added values are at or under,
+  // rounded up to the top of its bucket. 0 if nothing was added.
+  unsigned long percentile(double fraction) const;
+
+ protected:
+  static unsigned bucketOf(unsigned long value);
+  static unsigned long bucketTop(unsigned bucket);
+
+  std::vector<unsigned long> buckets;
+  unsigned long total;
+};
+
+/*
+ * End to end latency of sampled messages, per category and over all of
+ * them. scribeHandler::Log() stamps one message in latency_sample_rate
+ * with the time it arrived, and the StoreQueue that handles it reports
+ * how long it took until its store was handed the message and until the
+ * store had handled and flushed it.
+ *
+ * Percentiles are of the last complete window of latency_window seconds,
+ * and are exported through fb303 counters like
+ * "<category>:ingest to ack p99".
+ */
+class LatencyTracker {
+ public:
+  enum latency_type_t {
+    HANDLE, // ingest to handleMessages()
+    ACK,    // ingest to handled and flushed
+    NUM_LATENCY_TYPES
+  };
+
+  LatencyTracker();
+  virtual ~LatencyTracker();
+
+  void setWindow(unsigned long window_ms);
+  void record(const std::string& category, unsigned long handle_ms,
+              unsigned long ack_ms);
+  void getCounters(std::map<std::string, int64_t>& _return);
+
+ protected:
+  struct CategoryLatency {
+    CategoryLatency();
+
+    LatencyHistogram current[NUM_LATENCY_TYPES];
+    LatencyHistogram last[NUM_LATENCY_TYPES]; // the previous window
+    unsigned long windowStart;                // in msec
+  };
+  typedef std::map<std::string, CategoryLatency> category_latency_map_t;
+
+  // Should be called while holding latencyMutex
+  void rotate(CategoryLatency& latency, unsigned long now);
+
+  pthread_mutex_t latencyMutex;
+  category_latency_map_t categories;
+  unsigned long windowMs;
+};
+
+#endif // !defined SCRIBE_LATENCY_H
@@ -0,0 +1,361 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "common.h"
+#include "scribe_server.h"
+#include "relay.h"
+
+using namespace std;
+using boost::shared_ptr;
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::transport;
+using namespace scribe::thrift;
+
+// deepest nesting of unknown fields we are willing to skip over
+#define RELAY_MAX_DEPTH 32
+
+RelayBatch::RelayBatch()
+  : bytes(0) {
+}
+
+void RelayBatch::append(const RelayBatch& other) {
+  entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+  bytes += other.bytes;
+}
+
+/*
+ * Same wire format as LogRequestCache::writeRequest(), but the list
+ * elements are copied from the received frames instead of being written
+ * field by field.
+ */
+log_request_ptr_t RelayBatch::serialize() const {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TBinaryProtocol prot(buffer);
+  prot.setStrict(false, false);
+  prot.writeMessageBegin("Log", T_CALL, 0);
+  prot.writeStructBegin("scribe_Log_pargs");
+  prot.writeFieldBegin("messages", T_LIST, 1);
+  prot.writeListBegin(T_STRUCT, entries.size());
+
+  log_request_ptr_t request(new string());
+  request->reserve(buffer->available_read() + bytes + 1);
+  request->append(buffer->getBufferAsString());
+  for (vector<relay_entry_t>::const_iterator iter = entries.begin();
+       iter != entries.end();
+       ++iter) {
+    request->append(*iter->frame, iter->offset, iter->length);
+  }
+
+  buffer->resetBuffer();
+  prot.writeListEnd();
+  prot.writeFieldEnd();
+  prot.writeFieldStop();
+  prot.writeStructEnd();
+  prot.writeMessageEnd();
+  request->append(buffer->getBufferAsString());
+  return request;
+}
+
+shared_ptr<logentry_vector_t> RelayBatch::toLogEntries() const {
+  shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+  messages->reserve(entries.size());
+  for (vector<relay_entry_t>::const_iterator iter = entries.begin();
+       iter != entries.end();
+       ++iter) {
+    uint8_t* data = (uint8_t*) iter->frame->data() + iter->offset;
+    shared_ptr<TMemoryBuffer> buffer(
+      new TMemoryBuffer(data, iter->length, TMemoryBuffer::OBSERVE));
+    TBinaryProtocol prot(buffer);
+    logentry_ptr_t entry(new LogEntry);
+    entry->read(&prot);
+    messages->push_back(entry);
+  }
+  return messages;
+}
+
+RelayParser::RelayParser(const uint8_t* data_, uint32_t len_)
+  : data(data_),
+    len(len_),
+    pos(0) {
+}
+
+bool RelayParser::parseLogCall(shared_ptr<const string> frame,
+                               int32_t& seqid, relay_map_t& _return) {
+  RelayParser parser((const uint8_t*) frame->data(), frame->size());
+
+  // message header, either strict or not
+  int32_t header;
+  const uint8_t* name;
+  uint32_t name_len;
+  if (!parser.readI32(header)) {
+    return false;
+  }
+  if (header < 0) {
+    if ((header & 0xffff0000) != (int32_t) 0x80010000 ||
+        (header & 0xff) != T_CALL ||
+        !parser.readString(name, name_len)) {
+      return false;
+    }
+  } else {
+    name_len = header;
+    if (name_len > parser.len - parser.pos) {
+      return false;
+    }
+    name = parser.data + parser.pos;
+    parser.pos += name_len;
+    if (parser.pos >= parser.len || parser.data[parser.pos++] != T_CALL) {
+      return false;
+    }
+  }
+  if (name_len != 3 || memcmp(name, "Log", 3) != 0 ||
+      !parser.readI32(seqid)) {
+    return false;
+  }
+
+  // scribe_Log_args
+  while (true) {
+    if (parser.pos + 1 > parser.len) {
+      return false;
+    }
+    int8_t field_type = parser.data[parser.pos++];
+    if (field_type == T_STOP) {
+      break;
+    }
+    if (parser.pos + 2 > parser.len) {
+      return false;
+    }
+    int16_t field_id = (parser.data[parser.pos] << 8) |
+                       parser.data[parser.pos + 1];
+    parser.pos += 2;
+
+    if (field_id != 1 || field_type != T_LIST) {
+      if (!parser.skip(field_type, 0)) {
+        return false;
+      }
+      continue;
+    }
+
+    int32_t size;
+    if (parser.pos + 1 > parser.len ||
+        parser.data[parser.pos++] != T_STRUCT ||
+        !parser.readI32(size) || size < 0) {
+      return false;
+    }
+    string category;
+    for (int32_t i = 0; i < size; ++i) {
+      relay_entry_t entry;
+      entry.frame = frame;
+      entry.offset = parser.pos;
+      if (!parser.readLogEntry(category)) {
+        return false;
+      }
+      entry.length = parser.pos - entry.offset;
+
+      shared_ptr<RelayBatch>& batch = _return[category];
+      if (!batch) {
+        batch = shared_ptr<RelayBatch>(new RelayBatch());
+      }
+      batch->entries.push_back(entry);
+      batch->bytes += entry.length;
+    }
+  }
+  return true;
+}
+
+bool RelayParser::readI32(int32_t& _return) {
+  if (len - pos < 4) {
+    return false;
+  }
+  uint32_t net;
+  memcpy(&net, data + pos, 4);
+  _return = (int32_t) ntohl(net);
+  pos += 4;
+  return true;
+}
+
+bool RelayParser::readString(const uint8_t*& str, uint32_t& str_len) {
+  int32_t size;
+  if (!readI32(size) || size < 0 || (uint32_t) size > len - pos) {
+    return false;
+  }
+  str = data + pos;
+  str_len = size;
+  pos += size;
+  return true;
+}
+
+// Reads one LogEntry struct, only looking at the category
+bool RelayParser::readLogEntry(string& category) {
+  category.clear();
+  while (true) {
+    if (len - pos < 1) {
+      return false;
+    }
+    int8_t field_type = data[pos++];
+    if (field_type == T_STOP) {
+      return true;
+    }
+    if (len - pos < 2) {
+      return false;
+    }
+    int16_t field_id = (data[pos] << 8) | data[pos + 1];
+    pos += 2;
+
+    if (field_id == 1 && field_type == T_STRING) {
+      const uint8_t* str;
+      uint32_t str_len;
+      if (!readString(str, str_len)) {
+        return false;
+      }
+      category.assign((const char*) str, str_len);
+    } else if (!skip(field_type, 1)) {
+      return false;
+    }
+  }
+}
+
+bool RelayParser::skip(int8_t type, unsigned depth) {
+  if (depth > RELAY_MAX_DEPTH) {
+    return false;
+  }
+
+  uint32_t size = 0;
+  switch (type) {
+  case T_BOOL:
+  case T_BYTE:
+    size = 1;
+    break;
+  case T_I16:
+    size = 2;
+    break;
+  case T_I32:
+    size = 4;
+    break;
+  case T_I64:
+  case T_DOUBLE:
+    size = 8;
+    break;
+  case T_STRING: {
+    const uint8_t* str;
+    return readString(str, size);
+  }
+  case T_STRUCT:
+    while (true) {
+      if (len - pos < 1) {
+        return false;
+      }
+      int8_t field_type = data[pos++];
+      if (field_type == T_STOP) {
+        return true;
+      }
+      if (len - pos < 2) {
+        return false;
+      }
+      pos += 2;
+      if (!skip(field_type, depth + 1)) {
+        return false;
+      }
+    }
+  case T_MAP: {
+    int32_t count;
+    if (len - pos < 2) {
+      return false;
+    }
+    int8_t key_type = data[pos++];
+    int8_t value_type = data[pos++];
+    if (!readI32(count) || count < 0) {
+      return false;
+    }
+    for (int32_t i = 0; i < count; ++i) {
+      if (!skip(key_type, depth + 1) || !skip(value_type, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case T_SET:
+  case T_LIST: {
+    int32_t count;
+    if (len - pos < 1) {
+      return false;
+    }
+    int8_t elem_type = data[pos++];
+    if (!readI32(count) || count < 0) {
+      return false;
+    }
+    for (int32_t i = 0; i < count; ++i) {
+      if (!skip(elem_type, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+
+  if (len - pos < size) {
+    return false;
+  }
+  pos += size;
+  return true;
+}
+
+#ifdef USE_SCRIBE_RELAY
+RelayProcessor::RelayProcessor(shared_ptr<TProcessor> processor_)
+  : processor(processor_) {
+}
+
+bool RelayProcessor::process(shared_ptr<TProtocol> in,
+                             shared_ptr<TProtocol> out,
+                             void* connectionContext) {
+  shared_ptr<TMemoryBuffer> buffer =
+    boost::dynamic_pointer_cast<TMemoryBuffer>(in->getTransport());
+  uint32_t len = buffer ? buffer->available_read() : 0;
+  const uint8_t* data = len ? buffer->borrow(NULL, &len) : NULL;
+  if (data) {
+    // The server reuses its buffer for the next request, so the frame
+    // has to be copied, but only once for all the messages in it
+    shared_ptr<const string> frame(new string((const char*) data, len));
+    int32_t seqid;
+    relay_map_t batches;
+    ResultCode result;
+    if (RelayParser::parseLogCall(frame, seqid, batches) &&
+        g_Handler->relayLog(batches, result)) {
+      buffer->consume(len);
+      in->getTransport()->readEnd();
+
+      // same reply the generated scribeProcessor would send
+      out->writeMessageBegin("Log", T_REPLY, seqid);
+      out->writeStructBegin("scribe_Log_result");
+      out->writeFieldBegin("success", T_I32, 0);
+      out->writeI32((int32_t) result);
+      out->writeFieldEnd();
+      out->writeFieldStop();
+      out->writeStructEnd();
+      out->writeMessageEnd();
+      out->getTransport()->writeEnd();
+      out->getTransport()->flush();
+      return true;
+    }
+  }
+  return processor->process(in, out, connectionContext);
+}
+#endif // USE_SCRIBE_RELAY
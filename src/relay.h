@@ -0,0 +1,102 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_RELAY_H
+#define SCRIBE_RELAY_H
+
+#include "common.h"
+#include "conn_pool.h"
+#include "thrift/TProcessor.h"
+
+/*
+ * Relay mode, for scribe servers that only forward messages.
+ *
+ * A Log() request whose categories all go to a single network store is
+ * not deserialized. Its frame is copied once, the byte range of each
+ * LogEntry in it is found without building LogEntry objects, and those
+ * bytes are queued and later written as they are into the Log() request
+ * sent upstream. Messages are only turned into LogEntry objects if the
+ * upstream send fails and they have to be retried or buffered.
+ */
+
+// The serialized bytes of one LogEntry inside a received frame
+struct relay_entry_t {
+  boost::shared_ptr<const std::string> frame;
+  uint32_t offset;
+  uint32_t length;
+};
+
+// Serialized messages for one category
+class RelayBatch {
+ public:
+  RelayBatch();
+
+  void append(const RelayBatch& other);
+
+  // Builds a Log() request around the entries, see LogRequestCache
+  log_request_ptr_t serialize() const;
+  boost::shared_ptr<logentry_vector_t> toLogEntries() const;
+
+  std::vector<relay_entry_t> entries;
+  unsigned long bytes; // serialized size of the entries
+};
+
+typedef std::map<std::string, boost::shared_ptr<RelayBatch> > relay_map_t;
+
+// Finds the LogEntry structs in a serialized Log() call
+class RelayParser {
+ public:
+  // Returns false if the frame isn't a well formed Log() call.
+  // On success _return has a batch for each category in the call.
+  static bool parseLogCall(boost::shared_ptr<const std::string> frame,
+                           int32_t& seqid, relay_map_t& _return);
+
+ protected:
+  RelayParser(const uint8_t* data, uint32_t len);
+
+  bool readI32(int32_t& _return);
+  bool readString(const uint8_t*& str, uint32_t& len);
+  bool skip(int8_t type, unsigned depth);
+  bool readLogEntry(std::string& category);
+
+  const uint8_t* data;
+  uint32_t len;
+  uint32_t pos;
+};
+
+#ifdef USE_SCRIBE_RELAY
+/*
+ * Handles Log() calls that can be relayed and passes everything else
+ * to the scribe processor. Needs the frame in a TMemoryBuffer, so it
+ * can't relay requests that arrive compressed. Overrides the
+ * process() that takes a connection context, added in Thrift 0.6.0,
+ * so configure only enables it with a new enough Thrift.
+ */
+class RelayProcessor : public apache::thrift::TProcessor {
+ public:
+  RelayProcessor(boost::shared_ptr<apache::thrift::TProcessor> processor);
+
+  bool process(boost::shared_ptr<apache::thrift::protocol::TProtocol> in,
+               boost::shared_ptr<apache::thrift::protocol::TProtocol> out,
+               void* connectionContext);
+
+ protected:
+  boost::shared_ptr<apache::thrift::TProcessor> processor;
+};
+#endif // USE_SCRIBE_RELAY
+
+#endif // !defined SCRIBE_RELAY_H
@@ -21,8 +21,10 @@
 // @author Avinash Lakshman
 // @author Anthony Giardullo
 
+#include <signal.h>
 #include "common.h"
 #include "scribe_server.h"
+#include "spool.h"
 
 using namespace apache::thrift::concurrency;
 
@@ -41,6 +43,8 @@ shared_ptr<scribeHandler> g_Handler;
 #define DEFAULT_MAX_QUEUE_SIZE     5000000LL
 #define DEFAULT_SERVER_THREADS     3
 #define DEFAULT_MAX_CONN           0
+#define DEFAULT_DRAIN_TIMEOUT      0
+#define DEFAULT_LATENCY_SAMPLE_RATE 0
 
 static string overall_category = "scribe_overall";
 static string log_separator = ":";
@@ -58,6 +62,23 @@ void scribeHandler::incCounter(string category, string counter, long amount) {
   incrementCounter(overall_category + log_separator + counter, amount);
 }
 
+void scribeHandler::incCategoryCounter(const string& category,
+                                       const string& counter, long amount) {
+  incrementCounter(category + log_separator + counter, amount);
+}
+
+void scribeHandler::getCounters(map<string, int64_t>& _return) {
+  FacebookBase::getCounters(_return);
+  latency.getCounters(_return);
+}
+
+void scribeHandler::recordLatency(const string& category,
+                                  unsigned long handle_ms,
+                                  unsigned long ack_ms) {
+  latency.record(category, handle_ms, ack_ms);
+  latency.record(overall_category, handle_ms, ack_ms);
+}
+
 void scribeHandler::incCounter(string counter) {
   incCounter(counter, 1);
 }
@@ -66,6 +87,23 @@ void scribeHandler::incCounter(string counter, long amount) {
   incrementCounter(overall_category + log_separator + counter, amount);
 }
 
+// Gets SIGTERM, which every other thread blocks, and stops scribe by
+// spooling what's queued instead of losing it
+static void* signalThread(void* stop_signals) {
+  int sig;
+  while (0 != sigwait((sigset_t*)stop_signals, &sig)) {
+  }
+  LOG_OPER("received signal <%d>, stopping", sig);
+
+  // A second SIGTERM kills scribe as it used to, in case stopping hangs.
+  // Only this thread has it unblocked, so the kernel delivers it here.
+  signal(SIGTERM, SIG_DFL);
+  pthread_sigmask(SIG_UNBLOCK, (sigset_t*)stop_signals, NULL);
+
+  g_Handler->snapshot();
+  return NULL;
+}
+
 int main(int argc, char **argv) {
 
   try {
@@ -75,6 +113,12 @@ int main(int argc, char **argv) {
       LOG_OPER("setrlimit error (setting max fd size)");
     }
 
+    // Blocked before any thread is started, so that all of them inherit it
+    static sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
     int next_option;
     const char* const short_options = "hp:c:";
     const struct option long_options[] = {
@@ -111,6 +155,11 @@ int main(int argc, char **argv) {
 
     g_Handler = shared_ptr<scribeHandler>(new scribeHandler(port, config_file));
     g_Handler->initialize();
+    g_Handler->replaySpool();
+
+    // A SIGTERM that came during startup is handled now
+    pthread_t signal_thread;
+    pthread_create(&signal_thread, NULL, signalThread, &stop_signals);
 
     scribe::startServer(); // never returns
 
@@ -134,7 +183,12 @@ scribeHandler::scribeHandler(unsigned long int server_port, const std::string& c
     maxMsgPerSecond(DEFAULT_MAX_MSG_PER_SECOND),
     maxConn(DEFAULT_MAX_CONN),
     maxQueueSize(DEFAULT_MAX_QUEUE_SIZE),
-    newThreadPerCategory(true) {
+    drainTimeout(DEFAULT_DRAIN_TIMEOUT),
+    latencySampleRate(DEFAULT_LATENCY_SAMPLE_RATE),
+    latencySampleCount(0),
+    newThreadPerCategory(true),
+    wireCompression(false),
+    relayMode(false) {
   time(&lastMsgTime);
   scribeHandlerLock = scribe::concurrency::createReadWriteMutex();
 }
@@ -273,9 +327,9 @@ bool scribeHandler::createCategoryFromModel(
 
 
 // Check if we need to deny this request due to throttling
-bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
+bool scribeHandler::throttleRequest(int num_messages) {
   // Check if we need to rate limit
-  if (throttleDeny(messages.size())) {
+  if (throttleDeny(num_messages)) {
     incCounter("denied for rate");
     return true;
   }
@@ -362,16 +416,26 @@ shared_ptr<store_list_t> scribeHandler::createNewCategory(
     }
   }
 
+  if (store_list != NULL) {
+    dynamicCategories.insert(category);
+  }
   return store_list;
 }
 
 // Add this message to every store in list
 void scribeHandler::addMessage(
   const LogEntry& entry,
-  const shared_ptr<store_list_t>& store_list) {
+  const shared_ptr<store_list_t>& store_list,
+  unsigned long ingest_ms) {
 
   int numstores = 0;
 
+  // only a sample of the messages is traced, see latency.h
+  if (ingest_ms &&
+      __sync_fetch_and_add(&latencySampleCount, 1) % latencySampleRate) {
+    ingest_ms = 0;
+  }
+
   // Add message to store_list
   for (store_list_t::iterator store_iter = store_list->begin();
        store_iter != store_list->end();
@@ -381,7 +445,7 @@ void scribeHandler::addMessage(
     ptr->category = entry.category;
     ptr->message = entry.message;
 
-    (*store_iter)->addMessage(ptr);
+    (*store_iter)->addMessage(ptr, ingest_ms);
   }
 
   if (numstores) {
@@ -394,6 +458,7 @@ void scribeHandler::addMessage(
 
 ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
   ResultCode result = TRY_LATER;
+  unsigned long ingest_ms = 0;
 
   scribeHandlerLock->acquireRead();
   if(status == STOPPING) {
@@ -401,11 +466,14 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
     goto end;
   }
 
-  if (throttleRequest(messages)) {
+  if (throttleRequest(messages.size())) {
     result = TRY_LATER;
     goto end;
   }
 
+  // one clock read per request, only when tracing latency
+  ingest_ms = latencySampleRate ? scribe::clock::nowInMsec() : 0;
+
   for (vector<LogEntry>::const_iterator msg_iter = messages.begin();
        msg_iter != messages.end();
        ++msg_iter) {
@@ -454,7 +522,7 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
     }
 
     // Log this message
-    addMessage(*msg_iter, store_list);
+    addMessage(*msg_iter, store_list, ingest_ms);
   }
 
   result = OK;
@@ -464,6 +532,58 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
   return result;
 }
 
+// Only categories that already exist and go straight to a single network
+// store are relayed, everything else needs the LogEntry objects.
+// Should be called while holding a read lock on scribeHandlerLock.
+bool scribeHandler::isRelayable(const string& category) {
+  if (category.empty()) {
+    return false;
+  }
+  category_map_t::iterator cat_iter = categories.find(category);
+  if (cat_iter == categories.end()) {
+    return false;
+  }
+  shared_ptr<store_list_t> store_list = cat_iter->second;
+  return store_list && store_list->size() == 1 &&
+         store_list->front()->getBaseType() == "network";
+}
+
+bool scribeHandler::relayLog(const relay_map_t& batches, ResultCode& _return) {
+  bool relayed = true;
+  unsigned long num_messages = 0;
+  relay_map_t::const_iterator iter;
+
+  scribeHandlerLock->acquireRead();
+  if (status == STOPPING) {
+    _return = TRY_LATER;
+    goto end;
+  }
+
+  for (iter = batches.begin(); iter != batches.end(); ++iter) {
+    if (!isRelayable(iter->first)) {
+      relayed = false;
+      goto end;
+    }
+    num_messages += iter->second->entries.size();
+  }
+
+  if (throttleRequest(num_messages)) {
+    _return = TRY_LATER;
+    goto end;
+  }
+
+  for (iter = batches.begin(); iter != batches.end(); ++iter) {
+    categories[iter->first]->front()->addRelayBatch(iter->second);
+    incCounter(iter->first, "received good", iter->second->entries.size());
+  }
+  incCounter("relayed requests");
+  _return = OK;
+
+ end:
+  scribeHandlerLock->release();
+  return relayed;
+}
+
 // Returns true if overloaded.
 // Allows a fixed number of messages per second.
 bool scribeHandler::throttleDeny(int num_messages) {
@@ -496,7 +616,10 @@ bool scribeHandler::throttleDeny(int num_messages) {
 
 void scribeHandler::stopStores() {
   setStatus(STOPPING);
-  shared_ptr<store_list_t> store_list;
+  deleteAllStores();
+}
+
+void scribeHandler::deleteAllStores() {
   for (store_list_t::iterator store_iter = defaultStores.begin();
       store_iter != defaultStores.end(); ++store_iter) {
     if (!(*store_iter)->isModelStore()) {
@@ -506,25 +629,328 @@ void scribeHandler::stopStores() {
   defaultStores.clear();
   deleteCategoryMap(categories);
   deleteCategoryMap(category_prefixes);
+  confStores.clear();
+  dynamicCategories.clear();
+}
+
+// Settings of the top level config that only the handler uses. Everything
+// else can be inherited by stores, see StoreConf::getString()
+static const char* const handlerOnlySettings[] = {
+  "port",
+  "max_msg_per_second",
+  "max_queue_size",
+  "max_conn",
+  "num_thrift_server_threads",
+  "wire_compression",
+  "relay_mode",
+  "drain_timeout",
+  "spool_dir",
+  "latency_sample_rate",
+  "latency_window",
+  NULL
+};
+
+// Returns true if the stores that didn't change between the configs can
+// keep running, which is the case unless a global setting changed
+bool scribeHandler::canKeepStores(const StoreConf& old_config,
+                                  const StoreConf& new_config) {
+  if (confStores.empty()) {
+    return false;
+  }
+
+  string_map_t old_values, new_values;
+  old_config.getAllValues(old_values);
+  new_config.getAllValues(new_values);
+  for (int i = 0; handlerOnlySettings[i] != NULL; ++i) {
+    old_values.erase(handlerOnlySettings[i]);
+    new_values.erase(handlerOnlySettings[i]);
+  }
+  return old_values == new_values;
+}
+
+// Returns the categories named in a store config
+static void getConfCategories(pStoreConf store_conf,
+                              vector<string>& _return) {
+  string category;
+  if (store_conf->getString("category", category)) {
+    _return.push_back(category);
+  }
+  string categories;
+  if (store_conf->getString("categories", categories)) {
+    stringstream ss(categories);
+    while (ss >> category) {
+      _return.push_back(category);
+    }
+  }
+}
 
+// Returns true if the store config is used as a model for categories
+// that aren't in the config file
+static bool isModelConf(pStoreConf store_conf) {
+  vector<string> category_list;
+  getConfCategories(store_conf, category_list);
+  for (vector<string>::iterator iter = category_list.begin();
+       iter != category_list.end(); ++iter) {
+    if (*iter == "default" ||
+        (!iter->empty() && (*iter)[iter->size() - 1] == '*')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Stops the StoreQueues created for a store config and removes them
+// from the category maps
+void scribeHandler::removeConfStores(const conf_stores_t& conf_stores) {
+  for (store_list_t::const_iterator queue_iter = conf_stores.queues.begin();
+       queue_iter != conf_stores.queues.end();
+       ++queue_iter) {
+    shared_ptr<StoreQueue> pstore = *queue_iter;
+
+    defaultStores.erase(remove(defaultStores.begin(), defaultStores.end(),
+                               pstore),
+                        defaultStores.end());
+
+    category_map_t* maps[] = { &categories, &category_prefixes };
+    for (int i = 0; i < 2; ++i) {
+      category_map_t::iterator cat_iter = maps[i]->begin();
+      while (cat_iter != maps[i]->end()) {
+        store_list_t& pstores = *cat_iter->second;
+        pstores.erase(remove(pstores.begin(), pstores.end(), pstore),
+                      pstores.end());
+        if (pstores.empty()) {
+          dynamicCategories.erase(cat_iter->first);
+          maps[i]->erase(cat_iter++);
+        } else {
+          ++cat_iter;
+        }
+      }
+    }
+
+    if (!pstore->isModelStore()) {
+      pstore->stop();
+    }
+  }
+}
+
+// Removes a category created from a model. It will be created again from
+// the current models the next time a message for it arrives.
+void scribeHandler::removeDynamicCategory(const string& category) {
+  category_map_t::iterator cat_iter = categories.find(category);
+  if (cat_iter != categories.end()) {
+    // Without a thread per category the list holds the models themselves,
+    // which are stopped along with their config
+    if (newThreadPerCategory) {
+      for (store_list_t::iterator store_iter = cat_iter->second->begin();
+           store_iter != cat_iter->second->end();
+           ++store_iter) {
+        if (!(*store_iter)->isModelStore()) {
+          (*store_iter)->stop();
+        }
+      }
+    }
+    categories.erase(cat_iter);
+  }
+  dynamicCategories.erase(category);
+}
+
+// Locked because a SIGTERM can make shutdownServer() read it at any time
+void scribeHandler::setServer(
+    shared_ptr<apache::thrift::server::TNonblockingServer>& server) {
+  RWGuard monitor(*scribeHandlerLock, true);
+  this->server = server;
 }
 
 void scribeHandler::shutdown() {
+  shutdownServer(false);
+}
+
+void scribeHandler::snapshot() {
+  if (spoolDir.empty()) {
+    LOG_OPER("no spool_dir to take a snapshot in, draining instead");
+  }
+  shutdownServer(!spoolDir.empty());
+}
+
+void scribeHandler::shutdownServer(bool snapshot) {
+  {
+    RWGuard monitor(*scribeHandlerLock, true);
+    if (status == STOPPING) {
+      LOG_OPER("already shutting down");
+      return;
+    }
+    setStatus(STOPPING);
+  }
+
+  // Log() turns everything away from now on, so the queues only shrink.
+  // Holding just a read lock lets it tell clients to try later instead
+  // of blocking them for the whole drain.
+  {
+    RWGuard monitor(*scribeHandlerLock);
+    drainStores(snapshot);
+  }
+
   RWGuard monitor(*scribeHandlerLock, true);
   stopStores();
-  // calling stop to allow thrift to clean up client states and exit
-  server->stop();
+  // calling stop to allow thrift to clean up client states and exit.
+  // There is no server yet if this happens during startup.
+  if (server) {
+    server->stop();
+  }
   scribe::stopServer();
 }
 
+// Gives every StoreQueue up to drain_timeout seconds to handle what it has
+// queued, and spools the rest if spool_dir is set. A snapshot spools
+// everything right away.
+// Should be called while holding a lock on scribeHandlerLock.
+void scribeHandler::drainStores(bool snapshot) {
+  // a queue can be in several lists, and models have no thread
+  store_list_t queues;
+  store_list_t all_queues(defaultStores);
+  category_map_t* maps[] = { &categories, &category_prefixes };
+  for (int i = 0; i < 2; ++i) {
+    for (category_map_t::iterator cat_iter = maps[i]->begin();
+         cat_iter != maps[i]->end();
+         ++cat_iter) {
+      all_queues.insert(all_queues.end(), cat_iter->second->begin(),
+                        cat_iter->second->end());
+    }
+  }
+  sort(all_queues.begin(), all_queues.end());
+  all_queues.erase(unique(all_queues.begin(), all_queues.end()),
+                   all_queues.end());
+  for (store_list_t::iterator iter = all_queues.begin();
+       iter != all_queues.end(); ++iter) {
+    if (!(*iter)->isModelStore()) {
+      queues.push_back(*iter);
+    }
+  }
+
+  time_t start = time(NULL);
+  if (snapshot) {
+    LOG_OPER("spooling <%lu> store queues to <%s>",
+             (unsigned long)queues.size(), spoolDir.c_str());
+  } else {
+    LOG_OPER("draining <%lu> store queues for up to <%lu> seconds",
+             (unsigned long)queues.size(), drainTimeout);
+  }
+
+  // all queues drain at the same time, then wait for each of them
+  for (store_list_t::iterator iter = queues.begin();
+       iter != queues.end(); ++iter) {
+    if (snapshot) {
+      (*iter)->snapshot(spoolDir);
+    } else {
+      (*iter)->drain(start + drainTimeout, spoolDir);
+    }
+  }
+  for (store_list_t::iterator iter = queues.begin();
+       iter != queues.end(); ++iter) {
+    (*iter)->stop();
+  }
+
+  LOG_OPER("drained store queues in <%lu> seconds",
+           (unsigned long)(time(NULL) - start));
+}
+
+void scribeHandler::replaySpool() {
+  RWGuard monitor(*scribeHandlerLock, true);
+
+  if (spoolDir.empty()) {
+    return;
+  }
+
+  time_t start = time(NULL);
+  unsigned long num_messages = 0;
+  vector<string> files;
+  MessageSpool::list(spoolDir, files);
+  for (vector<string>::iterator file_iter = files.begin();
+       file_iter != files.end();
+       ++file_iter) {
+    logentry_vector_t messages;
+    if (!MessageSpool::read(*file_iter, messages)) {
+      // leave it for someone to look at
+      incCounter("spool files bad");
+      continue;
+    }
+    // Remove the file before queueing anything, so a crash can't make
+    // the next start replay these messages a second time
+    boost::filesystem::remove(*file_iter);
+
+    // Spool files usually hold a single category, so this hands each
+    // StoreQueue a few big batches
+    map<string, logentry_vector_t> batches;
+    for (logentry_vector_t::iterator msg_iter = messages.begin();
+         msg_iter != messages.end();
+         ++msg_iter) {
+      batches[(*msg_iter)->category].push_back(*msg_iter);
+    }
+
+    for (map<string, logentry_vector_t>::iterator batch_iter =
+           batches.begin();
+         batch_iter != batches.end();
+         ++batch_iter) {
+      const string& category = batch_iter->first;
+      shared_ptr<store_list_t> store_list;
+      category_map_t::iterator cat_iter = categories.find(category);
+      if (cat_iter != categories.end()) {
+        store_list = cat_iter->second;
+      } else if (!category.empty()) {
+        store_list = createNewCategory(category);
+      }
+
+      if (store_list == NULL || store_list->empty()) {
+        LOG_OPER("spooled log entries have invalid category <%s>",
+                 category.c_str());
+        incCounter(category, "received bad", batch_iter->second.size());
+        continue;
+      }
+
+      for (store_list_t::iterator store_iter = store_list->begin();
+           store_iter != store_list->end();
+           ++store_iter) {
+        if (store_iter == store_list->begin()) {
+          (*store_iter)->addMessages(batch_iter->second);
+        } else {
+          // every store gets its own copy, as in addMessage()
+          logentry_vector_t copies;
+          for (logentry_vector_t::iterator msg_iter =
+                 batch_iter->second.begin();
+               msg_iter != batch_iter->second.end();
+               ++msg_iter) {
+            copies.push_back(logentry_ptr_t(new LogEntry(**msg_iter)));
+          }
+          (*store_iter)->addMessages(copies);
+        }
+      }
+      incCounter(category, "spool replayed", batch_iter->second.size());
+    }
+
+    LOG_OPER("replayed <%lu> messages from spool file <%s>",
+             (unsigned long)messages.size(), file_iter->c_str());
+    num_messages += messages.size();
+  }
+
+  if (num_messages) {
+    LOG_OPER("replayed <%lu> spooled messages in <%lu> seconds",
+             num_messages, (unsigned long)(time(NULL) - start));
+  }
+}
+
 void scribeHandler::reinitialize() {
   RWGuard monitor(*scribeHandlerLock, true);
 
+  if (status == STOPPING) {
+    LOG_OPER("not reinitializing while shutting down");
+    return;
+  }
+
   // reinitialize() will re-read the config file and re-configure the stores.
   // This is done without shutting down the Thrift server, so this will not
   // reconfigure any server settings such as port number.
+  // Stores whose config didn't change keep running, see initialize().
   LOG_OPER("reinitializing");
-  stopStores();
   initialize();
 }
 
@@ -554,6 +980,16 @@ void scribeHandler::initialize() {
       config_file = configFilename;
     }
     localconfig.parseConfig(config_file);
+
+    // Unless a global setting changed, only the stores whose config changed
+    // get restarted, the others keep running
+    conf_stores_map_t old_confs;
+    if (canKeepStores(config, localconfig)) {
+      old_confs.swap(confStores);
+    } else {
+      deleteAllStores();
+    }
+
     // overwrite the current StoreConf
     config = localconfig;
 
@@ -566,6 +1002,19 @@ void scribeHandler::initialize() {
     }
     config.getUnsigned("max_conn", maxConn);
 
+    // Only used by shutdown() and replaySpool()
+    drainTimeout = DEFAULT_DRAIN_TIMEOUT;
+    config.getUnsigned("drain_timeout", drainTimeout);
+    spoolDir.clear();
+    config.getString("spool_dir", spoolDir);
+
+    // Only used to trace latency, see latency.h
+    latencySampleRate = DEFAULT_LATENCY_SAMPLE_RATE;
+    config.getUnsigned("latency_sample_rate", latencySampleRate);
+    unsigned long latency_window = 0;
+    config.getUnsigned("latency_window", latency_window);
+    latency.setWindow(latency_window * 1000);
+
     // If new_thread_per_category, then we will create a new thread/StoreQueue
     // for every unique message category seen.  Otherwise, we will just create
     // one thread for each top-level store defined in the config file.
@@ -577,6 +1026,13 @@ void scribeHandler::initialize() {
       newThreadPerCategory = true;
     }
 
+    // Like the port, this only takes effect when the server is started
+    config.getString("wire_compression", temp);
+    wireCompression = (0 == temp.compare("yes"));
+    temp.clear();
+    config.getString("relay_mode", temp);
+    relayMode = (0 == temp.compare("yes"));
+
     unsigned long int old_port = port;
     config.getUnsigned("port", port);
     if (old_port != 0 && port != old_port) {
@@ -599,21 +1055,85 @@ void scribeHandler::initialize() {
     }
 
 
-    // Build a new map of stores, and move stores from the old map as
-    // we find them in the config file. Any stores left in the old map
-    // at the end will be deleted.
+    // Keep the stores whose config is in the new file unchanged, and
+    // collect the others to be configured once the stale ones are stopped.
     std::vector<pStoreConf> store_confs;
+    std::vector<pStoreConf> new_confs;
+    std::vector<string> new_texts;
+    bool models_changed = false;
     config.getAllStores(store_confs);
     for (std::vector<pStoreConf>::iterator iter = store_confs.begin();
          iter != store_confs.end();
          ++iter) {
-        pStoreConf store_conf = (*iter);
+      ostringstream conf_text;
+      conf_text << **iter;
+
+      conf_stores_map_t::iterator old_iter = old_confs.find(conf_text.str());
+      if (old_iter != old_confs.end()) {
+        numstores += old_iter->second.numStores;
+        confStores.insert(*old_iter);
+        old_confs.erase(old_iter);
+      } else {
+        new_confs.push_back(*iter);
+        new_texts.push_back(conf_text.str());
+        models_changed = models_changed || isModelConf(*iter);
+      }
+    }
+
+    if (!confStores.empty()) {
+      LOG_OPER("keeping <%lu> unchanged stores, removing <%lu>, adding <%lu>",
+               (unsigned long)confStores.size(),
+               (unsigned long)old_confs.size(),
+               (unsigned long)new_confs.size());
+    }
 
-        bool success = configureStore(store_conf, &numstores);
+    // Stop the stores that changed or are gone before their replacements
+    // open the same files or connections
+    for (conf_stores_map_t::iterator old_iter = old_confs.begin();
+         old_iter != old_confs.end();
+         ++old_iter) {
+      removeConfStores(old_iter->second);
+      models_changed = models_changed || old_iter->second.isModel;
+    }
+    // We don't know which of the categories created from a model might
+    // now match a different one, so recreate all of them
+    if (models_changed) {
+      set<string> dynamic_categories(dynamicCategories);
+      for (set<string>::iterator cat_iter = dynamic_categories.begin();
+           cat_iter != dynamic_categories.end();
+           ++cat_iter) {
+        removeDynamicCategory(*cat_iter);
+      }
+    }
 
-        if (!success) {
-          perfect_config = false;
+    for (size_t i = 0; i < new_confs.size(); ++i) {
+      pStoreConf store_conf = new_confs[i];
+
+      // A category that is now in the config file no longer comes
+      // from a model
+      vector<string> category_list;
+      getConfCategories(store_conf, category_list);
+      for (vector<string>::iterator cat_iter = category_list.begin();
+           cat_iter != category_list.end();
+           ++cat_iter) {
+        if (dynamicCategories.count(*cat_iter)) {
+          removeDynamicCategory(*cat_iter);
         }
+      }
+
+      conf_stores_t conf_stores;
+      conf_stores.isModel = isModelConf(store_conf);
+      conf_stores.numStores = numstores;
+      bool success = configureStore(store_conf, &numstores,
+                                    &conf_stores.queues);
+      conf_stores.numStores = numstores - conf_stores.numStores;
+
+      if (!success) {
+        perfect_config = false;
+        // no config text matches this, so it is retried next time
+        new_texts[i].clear();
+      }
+      confStores.insert(make_pair(new_texts[i], conf_stores));
     }
   } catch(const std::exception& e) {
     string errormsg("Bad config - exception: ");
@@ -634,8 +1154,7 @@ void scribeHandler::initialize() {
   if (!enough_config_to_run) {
     // If the new configuration failed we'll run with
     // nothing configured and status set to WARNING
-    deleteCategoryMap(categories);
-    deleteCategoryMap(category_prefixes);
+    deleteAllStores();
   }
 
 
@@ -650,7 +1169,9 @@ void scribeHandler::initialize() {
 
 
 // Configures the store specified by the store configuration. Returns false if failed.
-bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
+// If queues is given, every StoreQueue created is added to it.
+bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores,
+                                   store_list_t* queues) {
   string category;
   shared_ptr<StoreQueue> pstore;
   vector<string> category_list;
@@ -691,6 +1212,9 @@ bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
     if (result == NULL) {
       return false;
     }
+    if (queues) {
+      queues->push_back(result);
+    }
 
     (*numstores)++;
   } else {
@@ -714,6 +1238,9 @@ bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
       setStatusDetails(errormsg);
       return false;
     }
+    if (queues) {
+      queues->push_back(model);
+    }
 
     // create a store for each category
     vector<string>::iterator iter;
@@ -724,6 +1251,9 @@ bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
       if (!result) {
         return false;
       }
+      if (queues && result != model) {
+        queues->push_back(result);
+      }
 
       (*numstores)++;
     }
@@ -26,10 +26,23 @@
 
 #include "store.h"
 #include "store_queue.h"
+#include "relay.h"
+#include "latency.h"
 
 typedef std::vector<boost::shared_ptr<StoreQueue> > store_list_t;
 typedef std::map<std::string, boost::shared_ptr<store_list_t> > category_map_t;
 
+// What one top level store in the config file was configured into.
+// reinitialize() keeps these running if the store's config didn't change.
+struct conf_stores_t {
+  int numStores;       // as counted by configureStore()
+  bool isModel;        // default or prefix store, see createNewCategory()
+  store_list_t queues; // every StoreQueue created for it, models included
+};
+// keyed by the text of the store's config, which doesn't depend on its
+// position in the file
+typedef std::multimap<std::string, conf_stores_t> conf_stores_map_t;
+
 class scribeHandler : virtual public scribe::thrift::scribeIf,
                               public facebook::fb303::FacebookBase {
 
@@ -38,11 +51,23 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   ~scribeHandler();
 
   void shutdown();
+  // Like shutdown(), but spools everything queued instead of draining it,
+  // so it takes seconds whatever the backlog. Used on SIGTERM.
+  void snapshot();
   void initialize();
   void reinitialize();
+  // Queues the messages spooled by the last shutdown(). Call this after
+  // initialize() and before the server starts taking requests.
+  void replaySpool();
 
   scribe::thrift::ResultCode Log(const std::vector<scribe::thrift::LogEntry>& messages);
 
+  // Queues messages found by the RelayProcessor without deserializing them.
+  // Returns false if any of the categories can't be relayed, in which case
+  // the request has to go through Log().
+  bool relayLog(const relay_map_t& batches,
+                scribe::thrift::ResultCode& _return);
+
   void getVersion(std::string& _return) {_return = scribeversion;}
   facebook::fb303::fb_status getStatus();
   void getStatusDetails(std::string& _return);
@@ -67,14 +92,28 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   void incCounter(std::string category, std::string counter, long amount);
   void incCounter(std::string counter);
   void incCounter(std::string counter, long amount);
-
-  inline void setServer(
-      boost::shared_ptr<apache::thrift::server::TNonblockingServer> & server) {
-    this->server = server;
-  }
+  // Only counts toward the category, for counters that make no sense
+  // summed over all categories, like the per bucket ones of BucketStore
+  void incCategoryCounter(const std::string& category,
+                          const std::string& counter, long amount);
+
+  // fb303 counters plus the latency percentiles, see latency.h
+  void getCounters(std::map<std::string, int64_t>& _return);
+  // Called by StoreQueue for messages Log() stamped with an ingest time
+  void recordLatency(const std::string& category, unsigned long handle_ms,
+                     unsigned long ack_ms);
+
+  void setServer(
+      boost::shared_ptr<apache::thrift::server::TNonblockingServer> & server);
   unsigned long getMaxConn() {
     return maxConn;
   }
+  bool getWireCompression() {
+    return wireCompression;
+  }
+  bool getRelayMode() {
+    return relayMode;
+  }
  private:
   boost::shared_ptr<apache::thrift::server::TNonblockingServer> server;
 
@@ -89,6 +128,11 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   // the default stores
   store_list_t defaultStores;
 
+  // the top level stores of the current config and what they created
+  conf_stores_map_t confStores;
+  // categories created on the fly from a default or prefix model
+  std::set<std::string> dynamicCategories;
+
   std::string configFilename;
   facebook::fb303::fb_status status;
   std::string statusDetails;
@@ -98,8 +142,15 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   unsigned long maxMsgPerSecond;
   unsigned long maxConn;
   unsigned long long maxQueueSize;
+  unsigned long drainTimeout; // seconds shutdown() waits for the queues
+  std::string spoolDir;       // where shutdown() leaves what wasn't drained
+  unsigned long latencySampleRate; // stamp one message in this many, 0 = none
+  unsigned long latencySampleCount;
+  LatencyTracker latency;
   StoreConf config;
   bool newThreadPerCategory;
+  bool wireCompression; // accept compressed Log requests, see compression.h
+  bool relayMode; // forward Log requests without deserializing, see relay.h
 
   /* mutex to syncronize access to scribeHandler.
    * A single mutex is fine since it only needs to be locked in write mode
@@ -124,13 +175,23 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
                            const std::string &category,
                            const boost::shared_ptr<StoreQueue> &model,
                            bool category_list=false);
-  bool configureStore(pStoreConf store_conf, int* num_stores);
+  bool configureStore(pStoreConf store_conf, int* num_stores,
+                      store_list_t* queues = NULL);
   void stopStores();
-  bool throttleRequest(const std::vector<scribe::thrift::LogEntry>&  messages);
+  void shutdownServer(bool snapshot);
+  void drainStores(bool snapshot);
+  void deleteAllStores();
+  bool canKeepStores(const StoreConf& old_config,
+                     const StoreConf& new_config);
+  void removeConfStores(const conf_stores_t& conf_stores);
+  void removeDynamicCategory(const std::string& category);
+  bool throttleRequest(int num_messages);
+  bool isRelayable(const std::string& category);
   boost::shared_ptr<store_list_t>
     createNewCategory(const std::string& category);
   void addMessage(const scribe::thrift::LogEntry& entry,
-                  const boost::shared_ptr<store_list_t>& store_list);
+                  const boost::shared_ptr<store_list_t>& store_list,
+                  unsigned long ingest_ms = 0);
 };
 extern boost::shared_ptr<scribeHandler> g_Handler;
 #endif // SCRIBE_SERVER_H
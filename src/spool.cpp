@@ -0,0 +1,209 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+
+#include "common.h"
+#include "file.h"
+#include "bucket_key.h"
+#include "spool.h"
+
+using namespace std;
+using boost::shared_ptr;
+using namespace scribe::thrift;
+
+/*
+ * A spool file is a framed std file. The first byte of each frame says
+ * what it is:
+ *   'H' header: followed by the format version
+ *   'M' message: a crc32c of the rest of the frame, the length of the
+ *       category, the category, and then the message
+ *   'E' end: the number of messages in the file
+ * Numbers are 4 little endian bytes. A file is only read if all of it is
+ * there and every checksum matches.
+ */
+#define SPOOL_VERSION     1
+#define SPOOL_HEADER      'H'
+#define SPOOL_MESSAGE     'M'
+#define SPOOL_END         'E'
+#define SPOOL_UINT_SIZE   4
+
+const string MessageSpool::tmpSuffix = ".tmp";
+
+static void appendUInt(string& buffer, uint32_t value) {
+  for (int i = 0; i < SPOOL_UINT_SIZE; ++i) {
+    buffer += (char)((value >> (8 * i)) & 0xFF);
+  }
+}
+
+static uint32_t readUInt(const string& buffer, size_t pos) {
+  uint32_t value = 0;
+  for (int i = 0; i < SPOOL_UINT_SIZE; ++i) {
+    value |= (uint32_t)(unsigned char)buffer[pos + i] << (8 * i);
+  }
+  return value;
+}
+
+static bool writeFrame(shared_ptr<FileInterface> file, const string& frame) {
+  return file->write(file->getFrame(frame.size())) && file->write(frame);
+}
+
+bool MessageSpool::write(const string& dir, const string& name,
+                         const logentry_vector_t& messages) {
+  static unsigned long sequence = 0;
+
+  // categories may contain slashes
+  string file_name = name;
+  replace(file_name.begin(), file_name.end(), '/', '_');
+  ostringstream suffix;
+  suffix << '.' << getpid() << '.' << __sync_fetch_and_add(&sequence, 1);
+  string filename = dir + "/" + file_name + suffix.str();
+  string tmp_filename = filename + tmpSuffix;
+
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface("std", tmp_filename, true);
+  if (!file || !file->createDirectory(dir) || !file->openTruncate()) {
+    LOG_OPER("Failed to open spool file <%s>", tmp_filename.c_str());
+    return false;
+  }
+
+  string frame(1, SPOOL_HEADER);
+  frame += (char)SPOOL_VERSION;
+  bool success = writeFrame(file, frame);
+
+  string record;
+  for (logentry_vector_t::const_iterator iter = messages.begin();
+       success && iter != messages.end();
+       ++iter) {
+    const string& category = (*iter)->category;
+    const string& message = (*iter)->message;
+
+    record.clear();
+    appendUInt(record, category.size());
+    record += category;
+    record += message;
+
+    frame.assign(1, SPOOL_MESSAGE);
+    appendUInt(frame, scribe::buckethash::crc32c(record.data(),
+                                                 record.size()));
+    frame += record;
+    success = writeFrame(file, frame);
+  }
+
+  if (success) {
+    frame.assign(1, SPOOL_END);
+    appendUInt(frame, messages.size());
+    success = writeFrame(file, frame);
+  }
+  file->flush();
+  file->close();
+
+  if (success) {
+    try {
+      boost::filesystem::rename(tmp_filename, filename);
+    } catch (const std::exception& e) {
+      LOG_OPER("Failed to rename spool file <%s>: %s",
+               tmp_filename.c_str(), e.what());
+      success = false;
+    }
+  }
+  if (!success) {
+    LOG_OPER("Failed to write spool file <%s>", tmp_filename.c_str());
+    file->deleteFile();
+  }
+  return success;
+}
+
+bool MessageSpool::read(const string& filename, logentry_vector_t& _return) {
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface("std", filename, true);
+  if (!file || !file->openRead()) {
+    LOG_OPER("Failed to open spool file <%s>", filename.c_str());
+    return false;
+  }
+
+  const char* problem = NULL;
+  bool header = false;
+  bool end = false;
+  unsigned long num_messages = 0;
+  string frame;
+  long size;
+  while (!problem && (size = file->readNext(frame)) > 0) {
+    if (end) {
+      problem = "data after the end";
+    } else if (frame[0] == SPOOL_HEADER) {
+      if (header || frame.size() != 2 || frame[1] != SPOOL_VERSION) {
+        problem = "bad header";
+      }
+      header = true;
+    } else if (!header) {
+      problem = "no header";
+    } else if (frame[0] == SPOOL_END) {
+      if (frame.size() != 1 + SPOOL_UINT_SIZE ||
+          readUInt(frame, 1) != num_messages) {
+        problem = "wrong number of messages";
+      }
+      end = true;
+    } else if (frame[0] != SPOOL_MESSAGE ||
+               frame.size() < 1 + 2 * SPOOL_UINT_SIZE) {
+      problem = "bad frame";
+    } else {
+      const char* record = frame.data() + 1 + SPOOL_UINT_SIZE;
+      size_t record_len = frame.size() - 1 - SPOOL_UINT_SIZE;
+      uint32_t category_len = readUInt(frame, 1 + SPOOL_UINT_SIZE);
+      if (readUInt(frame, 1) !=
+          scribe::buckethash::crc32c(record, record_len)) {
+        problem = "bad checksum";
+      } else if (category_len > record_len - SPOOL_UINT_SIZE) {
+        problem = "bad category length";
+      } else {
+        logentry_ptr_t entry(new LogEntry);
+        entry->category.assign(record + SPOOL_UINT_SIZE, category_len);
+        entry->message.assign(record + SPOOL_UINT_SIZE + category_len,
+                              record_len - SPOOL_UINT_SIZE - category_len);
+        _return.push_back(entry);
+        ++num_messages;
+      }
+    }
+  }
+  file->close();
+
+  if (!problem && size < 0) {
+    problem = "truncated frame";
+  } else if (!problem && !end) {
+    problem = "no end";
+  }
+  if (problem) {
+    LOG_OPER("Spool file <%s> is corrupt after <%lu> messages: %s",
+             filename.c_str(), num_messages, problem);
+    return false;
+  }
+  return true;
+}
+
+void MessageSpool::list(const string& dir, vector<string>& _return) {
+  vector<string> files = FileInterface::list(dir, "std");
+  for (vector<string>::iterator iter = files.begin();
+       iter != files.end();
+       ++iter) {
+    if (iter->size() >= tmpSuffix.size() &&
+        0 == iter->compare(iter->size() - tmpSuffix.size(),
+                           tmpSuffix.size(), tmpSuffix)) {
+      continue;
+    }
+    _return.push_back(dir + "/" + *iter);
+  }
+}
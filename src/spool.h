@@ -0,0 +1,49 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+
+#ifndef SCRIBE_SPOOL_H
+#define SCRIBE_SPOOL_H
+
+#include "common.h"
+
+/*
+ * Recovery spool for messages that were still queued when scribe stopped,
+ * see scribeHandler::shutdown(). Each file holds what one StoreQueue had
+ * left. A file only gets its final name once it has been written
+ * completely, so a scribe that dies while spooling leaves no half
+ * written file behind for the next one to replay. Every message has a
+ * checksum, and a file with a bad one isn't read at all.
+ */
+class MessageSpool {
+ public:
+  // Writes the messages to a new file in dir. Returns false on failure.
+  static bool write(const std::string& dir, const std::string& name,
+                    const logentry_vector_t& messages);
+
+  // Reads a spool file. Returns false if it can't be read completely,
+  // in which case _return has whatever could be read.
+  static bool read(const std::string& filename, logentry_vector_t& _return);
+
+  // Full paths of the complete spool files in dir
+  static void list(const std::string& dir, std::vector<std::string>& _return);
+
+ private:
+  static const std::string tmpSuffix;
+};
+
+#endif // !defined SCRIBE_SPOOL_H
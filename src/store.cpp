@@ -25,9 +25,14 @@
 // @author John Song
 
 #include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
 #include "common.h"
 #include "scribe_server.h"
 #include "network_dynamic_config.h"
+#include "relay.h"
 #include <boost/algorithm/string.hpp>
 
 using namespace std;
@@ -47,12 +52,16 @@ using namespace scribe::thrift;
 #define DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL    300
 #define DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE  60
 #define DEFAULT_BUCKETSTORE_DELIMITER             ':'
+#define DEFAULT_BUCKETSTORE_RING_VNODES           160
+#define DEFAULT_BUCKETSTORE_BUFFER_RETRY_INTERVAL 30
+#define DEFAULT_BUCKETSTORE_STATS_INTERVAL        60
+#define DEFAULT_BUCKETSTORE_SKEW_FACTOR           2.0
 #define DEFAULT_NETWORKSTORE_CACHE_TIMEOUT        300
+#define DEFAULT_NETWORKSTORE_CONN_POOL_SIZE       1
+#define DEFAULT_NETWORKSTORE_COALESCE_MAX_BYTES   262144
+#define DEFAULT_NETWORKSTORE_COALESCE_MAX_MS      10
 #define DEFAULT_BUFFERSTORE_BYPASS_MAXQSIZE_RATIO 0.75
 
-// magic threshold
-#define DEFAULT_NETWORKSTORE_DUMMY_THRESHOLD      4096
-
 // Parameters for adaptive_backoff
 #define DEFAULT_MIN_RETRY                         5
 #define DEFAULT_MAX_RETRY                         100
@@ -62,21 +71,20 @@ const double MULT_INC_FACTOR =                    1.414; //sqrt(2)
 #define CONT_SUCCESS_THRESHOLD                    1
 
 ConnPool g_connPool;
+LogRequestCache g_logRequestCache;
+HostHealthTracker g_hostHealth;
+LogCoalescer g_logCoalescer;
 
 const string meta_logfile_prefix = "scribe_meta<new_logfile>: ";
 
-// Checks if we should try sending a dummy Log in the n/w store
-bool shouldSendDummy(boost::shared_ptr<logentry_vector_t> messages) {
-  size_t size = 0;
-  for (logentry_vector_t::iterator iter = messages->begin();
-      iter != messages->end(); ++iter) {
-    size += (**iter).message.size();
-    if (size > DEFAULT_NETWORKSTORE_DUMMY_THRESHOLD) {
-      return true;
-    }
-  }
-  return false;
-}
+// First record of a wire format buffer file, see FileStore
+#define WIRE_FILE_MAGIC "\0scribe_wire_frames<1>\n"
+const string wire_file_magic(WIRE_FILE_MAGIC, sizeof(WIRE_FILE_MAGIC) - 1);
+
+// Bytes at the start of a wire format record that scanWireFrames() needs:
+// the record size, the frame size, and the Log() call up to the number
+// of messages, as written by LogRequestCache::writeRequest()
+#define WIRE_RECORD_PEEK_SIZE 28
 
 
 boost::shared_ptr<Store>
@@ -148,6 +156,43 @@ std::string Store::getStatus() {
   return return_status;
 }
 
+bool Store::handleRelay(boost::shared_ptr<RelayBatch> batch,
+                        boost::shared_ptr<logentry_vector_t>& unhandled) {
+  unhandled = batch->toLogEntries();
+  return handleMessages(unhandled);
+}
+
+bool Store::handleMessagesWithoutKey(shared_ptr<logentry_vector_t> messages,
+                                     char key_delimiter) {
+  shared_ptr<logentry_vector_t> key_removed(new logentry_vector_t);
+  key_removed->reserve(messages->size());
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end();
+       ++iter) {
+    const string& message = (*iter)->message;
+    logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+    entry->category = (*iter)->category;
+    entry->message = message.substr(
+      scribe::bucketkey::payloadOffset(message.data(), message.size(),
+                                       key_delimiter));
+    key_removed->push_back(entry);
+  }
+  return handleMessages(key_removed);
+}
+
+bool Store::handleFrames(const vector<wire_frame_t>& frames,
+                         size_t& num_sent) {
+  LOG_OPER("[%s] ERROR: attempting to send frames to a store that can't",
+           categoryHandled.c_str());
+  num_sent = 0;
+  return false;
+}
+
+Store::replay_result_t Store::replayOldest(shared_ptr<Store> destination,
+                                           struct tm* now) {
+  return REPLAY_UNSUPPORTED;
+}
+
 bool Store::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
                        struct tm* now) {
   LOG_OPER("[%s] ERROR: attempting to read from a write-only store",
@@ -594,6 +639,7 @@ FileStore::FileStore(StoreQueue* storeq,
   : FileStoreBase(storeq, category, "file", multi_category),
     isBufferFile(is_buffer_file),
     addNewlines(false),
+    wireFormat(false),
     lostBytes_(0) {
 }
 
@@ -630,6 +676,20 @@ void FileStore::configure(pStoreConf configuration, pStoreConf parent) {
   unsigned long inttemp = 0;
   configuration->getUnsigned("add_newlines", inttemp);
   addNewlines = inttemp ? true : false;
+
+  string tmp;
+  if (configuration->getString("wire_format", tmp)) {
+    if (0 == tmp.compare("yes")) {
+      if (isBufferFile) {
+        wireFormat = true;
+      } else {
+        LOG_OPER("[%s] wire_format is only used by buffer files",
+                 categoryHandled.c_str());
+      }
+    } else {
+      wireFormat = false;
+    }
+  }
 }
 
 bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
@@ -735,6 +795,17 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
       currentFilename = file;
       eventsWritten = 0;
       setStatus("");
+
+      if (isBufferFile && currentSize == 0) {
+        if (wireFormat) {
+          success = writeWireHeader(writeFile);
+        }
+      } else if (isBufferFile && isWireFile(file) != wireFormat) {
+        // wire_format was changed, don't mix formats in one file
+        LOG_OPER("[%s] file <%s> has a different format, starting a new one",
+                 categoryHandled.c_str(), file.c_str());
+        return openInternal(true, current_time);
+      }
     }
 
   } catch(const std::exception& e) {
@@ -770,6 +841,7 @@ shared_ptr<Store> FileStore::copy(const std::string &category) {
   shared_ptr<Store> copied = shared_ptr<Store>(store);
 
   store->addNewlines = addNewlines;
+  store->wireFormat = wireFormat;
   store->copyCommon(this);
   return copied;
 }
@@ -788,9 +860,29 @@ bool FileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   return writeMessages(messages);
 }
 
+bool FileStore::handleMessagesWithoutKey(
+  boost::shared_ptr<logentry_vector_t> messages, char key_delimiter) {
+  if (wireFormat) {
+    // serialized requests are written from whole messages
+    return Store::handleMessagesWithoutKey(messages, key_delimiter);
+  }
+
+  if (!isOpen()) {
+    if (!open()) {
+      LOG_OPER("[%s] File failed to open FileStore::handleMessagesWithoutKey()",
+               categoryHandled.c_str());
+      return false;
+    }
+  }
+
+  return writeMessages(messages, boost::shared_ptr<FileInterface>(), true,
+                       key_delimiter);
+}
+
 // writes messages to either the specified file or the the current writeFile
 bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
-                              boost::shared_ptr<FileInterface> file) {
+                              boost::shared_ptr<FileInterface> file,
+                              bool remove_key, char key_delimiter) {
   // Data is written to a buffer first, then sent to disk in one call to write.
   // This costs an extra copy of the data, but dramatically improves latency with
   // network based files. (nfs, etc)
@@ -809,6 +901,10 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
     write_file = writeFile;
   }
 
+  if (wireFormat) {
+    return writeWireMessages(messages, file);
+  }
+
   try {
     for (logentry_vector_t::iterator iter = messages->begin();
          iter != messages->end();
@@ -817,7 +913,11 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       // have to be careful with the length here. getFrame wants the length without
       // the frame, then bytesToPad wants the length of the frame and the message.
       unsigned long length = 0;
-      unsigned long message_length = (*iter)->message.length();
+      const string& message = (*iter)->message;
+      size_t offset = remove_key ?
+        scribe::bucketkey::payloadOffset(message.data(), message.size(),
+                                         key_delimiter) : 0;
+      unsigned long message_length = message.length() - offset;
       string frame, category_frame;
 
       if (addNewlines) {
@@ -855,7 +955,7 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       }
 
       write_buffer += frame;
-      write_buffer += (*iter)->message;
+      write_buffer.append(message, offset, string::npos);
 
       if (addNewlines) {
         write_buffer += "\n";
@@ -908,6 +1008,273 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
   return success;
 }
 
+/*
+ * Writes messages as framed Log() requests of at most max_write_size
+ * bytes of messages each. Every request is one record of the underlying
+ * file, so a record holds exactly the bytes a TFramedTransport would send.
+ */
+bool FileStore::writeWireMessages(boost::shared_ptr<logentry_vector_t> messages,
+                                  boost::shared_ptr<FileInterface> file) {
+  bool success = true;
+  size_t num_written = 0;
+  size_t num_messages = messages->size();
+  unsigned long max_write_size = min(maxSize, maxWriteSize);
+  boost::shared_ptr<FileInterface> write_file = file ? file : writeFile;
+
+  try {
+    while (num_written < num_messages) {
+      size_t end = num_written;
+      unsigned long bytes = 0;
+      do {
+        bytes += (*messages)[end]->category.size() +
+                 (*messages)[end]->message.size();
+        ++end;
+      } while (end < num_messages &&
+               (maxSize == 0 || bytes < max_write_size));
+
+      logentry_vector_t chunk(messages->begin() + num_written,
+                              messages->begin() + end);
+      log_request_ptr_t request = LogRequestCache::serialize(chunk);
+      uint32_t frame_size = htonl(request->size());
+
+      string record = write_file->getFrame(request->size() + 4);
+      record.reserve(record.size() + request->size() + 4);
+      record.append((const char*) &frame_size, 4);
+      record.append(*request);
+
+      if (!write_file->write(record)) {
+        LOG_OPER("[%s] File store failed to write (%lu) messages to file",
+                 categoryHandled.c_str(), messages->size());
+        setStatus("File write error");
+        success = false;
+        break;
+      }
+      num_written = end;
+      currentSize += record.size();
+
+      // rotate file if large enough and not writing to a separate file
+      if ((currentSize > maxSize && maxSize != 0) && !file) {
+        rotateFile();
+        write_file = writeFile;
+      }
+    }
+  } catch (const std::exception& e) {
+    LOG_OPER("[%s] File store failed to write. Exception: %s",
+             categoryHandled.c_str(), e.what());
+    success = false;
+  }
+
+  eventsWritten += num_written;
+
+  if (!success) {
+    close();
+    if (num_written > 0) {
+      messages->erase(messages->begin(), messages->begin() + num_written);
+    }
+  }
+  return success;
+}
+
+bool FileStore::writeWireHeader(boost::shared_ptr<FileInterface> write_file) {
+  string header = write_file->getFrame(wire_file_magic.size());
+  header += wire_file_magic;
+  if (!write_file->write(header)) {
+    LOG_OPER("[%s] File store failed to write wire format header",
+             categoryHandled.c_str());
+    setStatus("File write error");
+    return false;
+  }
+  currentSize += header.size();
+  return true;
+}
+
+bool FileStore::isWireFile(const string& filename) {
+  shared_ptr<FileInterface> infile =
+    FileInterface::createFileInterface(fsType, filename, isBufferFile);
+  string record;
+  bool wire = infile && infile->openRead() &&
+              infile->readNext(record) > 0 && record == wire_file_magic;
+  if (infile) {
+    infile->close();
+  }
+  return wire;
+}
+
+// Size of a StdFile record, which is stored little endian
+static uint32_t unserializeRecordSize(const char* buffer) {
+  const unsigned char* data = (const unsigned char*) buffer;
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+         ((uint32_t) data[3] << 24);
+}
+
+// Adds the messages in one record of a wire format file
+bool FileStore::readWireRecord(const string& record,
+                               boost::shared_ptr<logentry_vector_t> messages) {
+  if (record.size() < 4) {
+    return false;
+  }
+  try {
+    shared_ptr<TMemoryBuffer> buffer(
+      new TMemoryBuffer((uint8_t*) record.data() + 4, record.size() - 4,
+                        TMemoryBuffer::OBSERVE));
+    TBinaryProtocol prot(buffer);
+    string name;
+    TMessageType type;
+    int32_t seqid;
+    scribe_Log_args args;
+    prot.readMessageBegin(name, type, seqid);
+    args.read(&prot);
+    prot.readMessageEnd();
+
+    for (vector<LogEntry>::iterator iter = args.messages.begin();
+         iter != args.messages.end();
+         ++iter) {
+      messages->push_back(logentry_ptr_t(new LogEntry(*iter)));
+    }
+  } catch (const std::exception& e) {
+    LOG_OPER("[%s] Failed to read Log request from buffer file: %s",
+             categoryHandled.c_str(), e.what());
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Finds the frames in a wire format file without reading them.
+ * Returns false if the file isn't in wire format. Stops at the first
+ * record that doesn't look right, and counts the rest of the file as lost.
+ */
+bool FileStore::scanWireFrames(int fd, vector<wire_frame_t>& frames) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+
+  char header[4 + sizeof(WIRE_FILE_MAGIC) - 1];
+  if (pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+      unserializeRecordSize(header) != wire_file_magic.size() ||
+      wire_file_magic.compare(0, string::npos, header + 4,
+                              wire_file_magic.size()) != 0) {
+    return false;
+  }
+
+  off_t pos = sizeof(header);
+  while (pos + 4 <= st.st_size) {
+    unsigned char peek[WIRE_RECORD_PEEK_SIZE];
+    ssize_t got = pread(fd, peek, sizeof(peek), pos);
+    uint32_t record_size =
+      got >= 4 ? unserializeRecordSize((const char*) peek) : 0;
+    if (got >= 4 && record_size == 0) {
+      // a zero size ends a framed file, see StdFile::readNext()
+      break;
+    }
+
+    uint32_t frame_size, name_size, count;
+    memcpy(&frame_size, peek + 4, 4);
+    memcpy(&name_size, peek + 8, 4);
+    memcpy(&count, peek + 24, 4);
+    if (got != (ssize_t) sizeof(peek) ||
+        record_size != ntohl(frame_size) + 4 ||
+        pos + 4 + record_size > st.st_size ||
+        ntohl(name_size) != 3 || memcmp(peek + 12, "Log", 3) != 0) {
+      LOG_OPER("[%s] corrupt record at offset <%ld> of wire format file",
+               categoryHandled.c_str(), (long) pos);
+      lostBytes_ = st.st_size - pos;
+      break;
+    }
+
+    wire_frame_t frame;
+    frame.fd = fd;
+    frame.offset = pos + 4;
+    frame.length = record_size;
+    frame.count = ntohl(count);
+    frames.push_back(frame);
+    pos += 4 + record_size;
+  }
+  return true;
+}
+
+// Rewrites a wire format file without the frames before offset
+bool FileStore::dropSentFrames(const string& filename, int fd, off_t offset) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || offset > st.st_size) {
+    return false;
+  }
+  string rest(st.st_size - offset, 0);
+  if (!rest.empty() &&
+      pread(fd, &rest[0], rest.size(), offset) != (ssize_t) rest.size()) {
+    return false;
+  }
+
+  // Need to close and reopen store in case we already have this file open
+  close();
+  shared_ptr<FileInterface> outfile =
+    FileInterface::createFileInterface(fsType, filename, isBufferFile);
+  bool success = outfile->openTruncate();
+  if (success) {
+    string header = outfile->getFrame(wire_file_magic.size());
+    header += wire_file_magic;
+    success = outfile->write(header) && outfile->write(rest);
+  }
+  outfile->close();
+  open();
+  return success;
+}
+
+Store::replay_result_t
+FileStore::replayOldest(shared_ptr<Store> destination, struct tm* now) {
+  if (fsType != "std" || !destination->canHandleFrames()) {
+    return REPLAY_UNSUPPORTED;
+  }
+  int index = findOldestFile(makeBaseFilename(now));
+  if (index < 0) {
+    return REPLAY_UNSUPPORTED;
+  }
+  string filename = makeFullFilename(index, now);
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return REPLAY_UNSUPPORTED;
+  }
+  vector<wire_frame_t> frames;
+  lostBytes_ = 0;
+  if (!scanWireFrames(fd, frames)) {
+    // written before wire_format was turned on
+    ::close(fd);
+    return REPLAY_UNSUPPORTED;
+  }
+
+  unsigned long count = 0;
+  for (vector<wire_frame_t>::iterator iter = frames.begin();
+       iter != frames.end();
+       ++iter) {
+    count += iter->count;
+  }
+  LOG_OPER("[%s] sending <%lu> frames with <%lu> entries from file <%s>",
+           categoryHandled.c_str(), (unsigned long) frames.size(), count,
+           filename.c_str());
+
+  replay_result_t result = REPLAY_OK;
+  size_t num_sent = 0;
+  if (destination->handleFrames(frames, num_sent)) {
+    deleteOldest(now);
+  } else {
+    result = REPLAY_FAILED;
+    if (num_sent > 0) {
+      LOG_OPER("[%s] sent <%lu> of <%lu> frames from file <%s>",
+               categoryHandled.c_str(), (unsigned long) num_sent,
+               (unsigned long) frames.size(), filename.c_str());
+      if (!dropSentFrames(filename, fd, frames[num_sent].offset - 4)) {
+        LOG_OPER("[%s] failed to remove sent frames from file <%s>, "
+                 "they will be sent again", categoryHandled.c_str(),
+                 filename.c_str());
+      }
+    }
+  }
+  ::close(fd);
+  return result;
+}
+
 // Deletes the oldest file
 // currently gets invoked from within a bufferstore
 void FileStore::deleteOldest(struct tm* now) {
@@ -946,7 +1313,8 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
   // overwrite the old contents of the file
   bool success;
   if (infile->openTruncate()) {
-    success = writeMessages(messages, infile);
+    success = (!wireFormat || writeWireHeader(infile)) &&
+              writeMessages(messages, infile);
 
   } else {
     LOG_OPER("[%s] Failed to open file <%s> for writing and truncate",
@@ -985,8 +1353,30 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
 
   uint32_t bsize = 0;
   std::string message;
+  bool wire_file = false;
+  // offset of the next record, each one is framed by a 4 byte size
+  unsigned long offset = 0;
   while ((loss = infile->readNext(message)) > 0) {
-    if (!message.empty()) {
+    unsigned long record_offset = offset;
+    offset += 4 + loss;
+    if (wire_file) {
+      size_t old_size = messages->size();
+      if (!readWireRecord(message, messages)) {
+        // like scanWireFrames(), the rest of the file is lost
+        LOG_OPER("[%s] corrupt record at offset <%lu> of wire format file <%s>",
+                 categoryHandled.c_str(), record_offset, filename.c_str());
+        unsigned long file_size = infile->fileSize();
+        loss = file_size > record_offset ?
+          -(long) (file_size - record_offset) : -(long) (4 + message.size());
+        break;
+      }
+      for (size_t i = old_size; i < messages->size(); ++i) {
+        bsize += (*messages)[i]->category.size();
+        bsize += (*messages)[i]->message.size();
+      }
+    } else if (messages->empty() && message == wire_file_magic) {
+      wire_file = true;
+    } else if (!message.empty()) {
       logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
 
       // check whether a category is stored with the message
@@ -1000,6 +1390,7 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
               categoryHandled.c_str(), entry->category.c_str());
           break;
         }
+        offset += 4 + loss;
       } else {
         entry->category = categoryHandled;
       }
@@ -1068,6 +1459,16 @@ shared_ptr<Store> ThriftFileStore::copy(const std::string &category) {
 }
 
 bool ThriftFileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
+  return writeMessages(messages, false, 0);
+}
+
+bool ThriftFileStore::handleMessagesWithoutKey(
+  boost::shared_ptr<logentry_vector_t> messages, char key_delimiter) {
+  return writeMessages(messages, true, key_delimiter);
+}
+
+bool ThriftFileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
+                                    bool remove_key, char key_delimiter) {
   if (!isOpen()) {
     if (!open()) {
       return false;
@@ -1081,10 +1482,14 @@ bool ThriftFileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messag
 
     // This length is an estimate -- what the ThriftLogFile actually writes is
     // a black box to us
-    uint32_t length = (*iter)->message.size();
+    const string& message = (*iter)->message;
+    size_t offset = remove_key ?
+      scribe::bucketkey::payloadOffset(message.data(), message.size(),
+                                       key_delimiter) : 0;
+    uint32_t length = message.size() - offset;
 
     try {
-      thriftFileTransport->write(reinterpret_cast<const uint8_t*>((*iter)->message.data()), length);
+      thriftFileTransport->write(reinterpret_cast<const uint8_t*>(message.data() + offset), length);
       currentSize += length;
       ++eventsWritten;
       ++messages_handled;
@@ -1574,51 +1979,63 @@ void BufferStore::periodicCheck() {
     unsigned sent = 0;
     try {
       for (sent = 0; sent < bufferSendRate; ++sent) {
-        boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
-        // Reads come complete buffered file
-        // this file size is controlled by max_size in the configuration
-        if (secondaryStore->readOldest(messages, &nowinfo)) {
-
-          unsigned long size = messages->size();
-          if (size) {
-            if (primaryStore->handleMessages(messages)) {
-              secondaryStore->deleteOldest(&nowinfo);
-              if (adaptiveBackoff) {
-                setNewRetryInterval(true);
-              }
-            } else {
-
-              if (messages->size() != size) {
-                // We were only able to process some, but not all of this batch
-                // of messages.  Replace this batch of messages with
-                // just the messages that were not processed.
-                LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages",
-                    categoryHandled.c_str(), size - messages->size(), size);
-
-                // Put back un-handled messages
-                if (!secondaryStore->replaceOldest(messages, &nowinfo)) {
-                  // Nothing we can do but try to remove oldest messages and
-                  // report a loss
-                  LOG_OPER("[%s] buffer store secondary store lost %lu messages",
-                      categoryHandled.c_str(), messages->size());
-                  g_Handler->incCounter(categoryHandled, "lost", messages->size());
-                  secondaryStore->deleteOldest(&nowinfo);
+        // Wire format buffer files are sent without reading the messages
+        replay_result_t replayed =
+          secondaryStore->replayOldest(primaryStore, &nowinfo);
+        if (replayed == REPLAY_FAILED) {
+          changeState(DISCONNECTED);
+          break;
+        } else if (replayed == REPLAY_OK) {
+          if (adaptiveBackoff) {
+            setNewRetryInterval(true);
+          }
+        } else {
+          boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+          // Reads come complete buffered file
+          // this file size is controlled by max_size in the configuration
+          if (secondaryStore->readOldest(messages, &nowinfo)) {
+
+            unsigned long size = messages->size();
+            if (size) {
+              if (primaryStore->handleMessages(messages)) {
+                secondaryStore->deleteOldest(&nowinfo);
+                if (adaptiveBackoff) {
+                  setNewRetryInterval(true);
+                }
+              } else {
+
+                if (messages->size() != size) {
+                  // We were only able to process some, but not all of this batch
+                  // of messages.  Replace this batch of messages with
+                  // just the messages that were not processed.
+                  LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages",
+                      categoryHandled.c_str(), size - messages->size(), size);
+
+                  // Put back un-handled messages
+                  if (!secondaryStore->replaceOldest(messages, &nowinfo)) {
+                    // Nothing we can do but try to remove oldest messages and
+                    // report a loss
+                    LOG_OPER("[%s] buffer store secondary store lost %lu messages",
+                        categoryHandled.c_str(), messages->size());
+                    g_Handler->incCounter(categoryHandled, "lost", messages->size());
+                    secondaryStore->deleteOldest(&nowinfo);
+                  }
                 }
+                changeState(DISCONNECTED);
+                break;
               }
-              changeState(DISCONNECTED);
-              break;
+            }  else {
+              // else it's valid for read to not find anything but not error
+              secondaryStore->deleteOldest(&nowinfo);
             }
-          }  else {
-            // else it's valid for read to not find anything but not error
-            secondaryStore->deleteOldest(&nowinfo);
+          } else {
+            // This is bad news. We'll stay in the sending state
+            // and keep trying to read.
+            setStatus("Failed to read from secondary store");
+            LOG_OPER("[%s] WARNING: buffer store can't read from secondary store",
+                categoryHandled.c_str());
+            break;
           }
-        } else {
-          // This is bad news. We'll stay in the sending state
-          // and keep trying to read.
-          setStatus("Failed to read from secondary store");
-          LOG_OPER("[%s] WARNING: buffer store can't read from secondary store",
-              categoryHandled.c_str());
-          break;
         }
 
         if (secondaryStore->empty(&nowinfo)) {
@@ -1739,16 +2156,100 @@ std::string BufferStore::getStatus() {
 }
 
 
+NetworkConnect::NetworkConnect()
+  : useConnPool(false),
+    serviceBased(false),
+    remotePort(0),
+    timeout(0),
+    connPoolSize(DEFAULT_NETWORKSTORE_CONN_POOL_SIZE),
+    success(false),
+    done(false),
+    abandoned(false) {
+  pthread_mutex_init(&mutex, NULL);
+}
+
+NetworkConnect::~NetworkConnect() {
+  pthread_mutex_destroy(&mutex);
+}
+
+bool NetworkConnect::connect() {
+  if (useConnPool) {
+    if (serviceBased) {
+      success = g_connPool.open(serviceName, servers, timeout, connPoolSize,
+                                compression, balancing);
+    } else {
+      success = g_connPool.open(remoteHost, remotePort, timeout,
+                                connPoolSize, compression);
+    }
+  } else {
+    if (serviceBased) {
+      conns = scribeConnSet::forService(serviceName, servers, timeout, 1,
+                                        compression, balancing);
+    } else {
+      conns = scribeConnSet::forHost(remoteHost, remotePort, timeout, 1,
+                                     compression);
+    }
+    success = conns->open();
+    if (!success) {
+      conns.reset();
+    }
+  }
+  return success;
+}
+
+void NetworkConnect::disconnect() {
+  if (!success) {
+    return;
+  }
+  if (useConnPool) {
+    if (serviceBased) {
+      g_connPool.close(serviceName);
+    } else {
+      g_connPool.close(remoteHost, remotePort);
+    }
+  } else {
+    conns->close();
+    conns.reset();
+  }
+  success = false;
+}
+
+void* NetworkConnect::threadStatic(void* arg) {
+  shared_ptr<NetworkConnect>* holder = (shared_ptr<NetworkConnect>*) arg;
+  shared_ptr<NetworkConnect> attempt = *holder;
+  delete holder;
+
+  attempt->connect();
+
+  pthread_mutex_lock(&attempt->mutex);
+  attempt->done = true;
+  bool abandoned = attempt->abandoned;
+  pthread_mutex_unlock(&attempt->mutex);
+
+  if (abandoned) {
+    attempt->disconnect();
+  }
+  return NULL;
+}
+
 NetworkStore::NetworkStore(StoreQueue* storeq,
                           const string& category,
                           bool multi_category)
   : Store(storeq, category, "network", multi_category),
     useConnPool(false),
+    connPoolSize(DEFAULT_NETWORKSTORE_CONN_POOL_SIZE),
     serviceBased(false),
     listBased(false),
     remotePort(0),
     serviceCacheTimeout(DEFAULT_NETWORKSTORE_CACHE_TIMEOUT),
     ignoreNetworkError(false),
+    cacheRequests(false),
+    asyncConnect(false),
+    maxBatchBytes(0),
+    maxBatchMessages(0),
+    coalesce(false),
+    coalesceMaxBytes(DEFAULT_NETWORKSTORE_COALESCE_MAX_BYTES),
+    coalesceMaxMs(DEFAULT_NETWORKSTORE_COALESCE_MAX_MS),
     configmod(NULL),
     opened(false),
     lastServiceCheck(0) {
@@ -1793,11 +2294,78 @@ void NetworkStore::configure(pStoreConf configuration, pStoreConf parent) {
       useConnPool = true;
     }
   }
+  // Number of pooled connections to open to the same destination.
+  // Only the first store to open a destination decides its size.
+  configuration->getUnsigned("conn_pool_size", connPoolSize);
+  if (connPoolSize == 0) {
+    LOG_OPER("[%s] Bad config - conn_pool_size must be at least 1",
+             categoryHandled.c_str());
+    connPoolSize = DEFAULT_NETWORKSTORE_CONN_POOL_SIZE;
+  }
   if (configuration->getString("ignore_network_error", temp)) {
     if (0 == temp.compare("yes")) {
       ignoreNetworkError = true;
     }
   }
+  if (configuration->getString("cache_serialized_batch", temp)) {
+    if (0 == temp.compare("yes")) {
+      cacheRequests = true;
+    }
+  }
+  // e.g. compression=zstd,lz4,zlib
+  // Only used if the remote server was started with wire_compression=yes
+  configuration->getString("compression", compression);
+
+  // Circuit breaker, off by default. The thresholds are shared with every
+  // store sending to the same destination, and the last store to open a
+  // destination sets them.
+  if (configuration->getString("circuit_breaker", temp)) {
+    healthPolicy.enabled = (0 == temp.compare("yes"));
+  }
+  configuration->getUnsigned("breaker_failures",
+                             healthPolicy.failureThreshold);
+  configuration->getUnsigned("breaker_error_rate", healthPolicy.maxErrorRate);
+  configuration->getUnsigned("breaker_min_sends", healthPolicy.minSends);
+  configuration->getUnsigned("breaker_slow_ms", healthPolicy.slowSendMs);
+  configuration->getUnsigned("breaker_open_ms", healthPolicy.openTimeMs);
+
+  // Spread batches over all the servers of a service or service_list
+  // instead of sticking to one. none, least_bytes, or ewma.
+  if (configuration->getString("load_balance", temp) &&
+      !scribeConnSet::parseBalance(temp, balancing.mode)) {
+    LOG_OPER("[%s] Bad config - unknown load_balance <%s>",
+             categoryHandled.c_str(), temp.c_str());
+    balancing.mode = BALANCE_NONE;
+  }
+
+  // Split large batches into several Log calls, 0 means no limit
+  configuration->getUnsigned("max_batch_bytes", maxBatchBytes);
+  configuration->getUnsigned("max_batch_messages", maxBatchMessages);
+
+  // Share Log calls with other stores sending to the same destination
+  if (configuration->getString("coalesce", temp)) {
+    if (0 == temp.compare("yes")) {
+      coalesce = true;
+    }
+  }
+  configuration->getUnsigned("coalesce_max_bytes", coalesceMaxBytes);
+  configuration->getUnsigned("coalesce_max_ms", coalesceMaxMs);
+
+  // Only used with load_balance
+  if (configuration->getString("hedge_sends", temp)) {
+    if (0 == temp.compare("yes")) {
+      balancing.hedge = true;
+    }
+  }
+  configuration->getUnsigned("hedge_min_ms", balancing.hedgeMinMs);
+
+  // Connect in a background thread instead of blocking this store's
+  // queue for up to the timeout
+  if (configuration->getString("async_connect", temp)) {
+    if (0 == temp.compare("yes")) {
+      asyncConnect = true;
+    }
+  }
 
   // if this network store dynamic configured?
   // get network dynamic updater parameters
@@ -1845,10 +2413,13 @@ void NetworkStore::periodicCheck() {
       close();
     }
   }
+  refreshService();
 }
 
+// Entries are host, host:port, or host:port:weight
 bool NetworkStore::loadFromList(const std::string &list, unsigned long defaultPort,
-                                server_vector_t& _return) {
+                                server_vector_t& _return,
+                                weight_map_t& weights) {
   vector<string> strs;
   boost::split(strs, list, boost::is_any_of("\t "));
   vector<string> split;
@@ -1859,6 +2430,10 @@ bool NetworkStore::loadFromList(const std::string &list, unsigned long defaultPo
       // split the port
       boost::split(split, (*iter), boost::is_any_of(":"));
       _return.push_back(pair<string, int>(split[0], atoi(split[1].c_str())));
+      if (split.size() > 2) {
+        weights[HostHealthTracker::makeKey(split[0], _return.back().second)] =
+          strtoul(split[2].c_str(), NULL, 10);
+      }
     } else {
       _return.push_back(pair<string, int>((*iter), defaultPort));
     }
@@ -1866,6 +2441,43 @@ bool NetworkStore::loadFromList(const std::string &list, unsigned long defaultPo
   return true;
 }
 
+// With load balancing every server of the service has its own
+// connection, so pick up servers that were added or removed without
+// waiting for the store to fail and reopen.
+void NetworkStore::refreshService() {
+  time_t now = time(NULL);
+  if (!serviceBased || balancing.mode == BALANCE_NONE || !isOpen() ||
+      lastServiceCheck > (time_t) (now - serviceCacheTimeout)) {
+    return;
+  }
+  lastServiceCheck = now;
+
+  server_vector_t new_servers;
+  if (!scribe::network_config::getService(serviceName, serviceOptions,
+                                          new_servers) ||
+      new_servers.empty() || new_servers == servers) {
+    return;
+  }
+  LOG_OPER("[%s] servers of service <%s> changed from <%lu> to <%lu> servers",
+           categoryHandled.c_str(), serviceName.c_str(),
+           (unsigned long) servers.size(), (unsigned long) new_servers.size());
+  if (useConnPool) {
+    // Other stores may hold the pooled set open, so reopening would just
+    // share the old one again. Replace it for all of them instead.
+    if (!g_connPool.replace(serviceName, new_servers, timeout, connPoolSize,
+                            compression, balancing)) {
+      LOG_OPER("[%s] failed to connect to the new servers of <%s>, "
+               "will retry", categoryHandled.c_str(), serviceName.c_str());
+      return;
+    }
+    servers = new_servers;
+  } else {
+    servers = new_servers;
+    // reconnects to the new servers on the next open
+    close();
+  }
+}
+
 bool NetworkStore::open() {
   if (isOpen()) {
     /* re-opening an already open NetworkStore can be bad. For example,
@@ -1873,6 +2485,28 @@ bool NetworkStore::open() {
      */
     return (true);
   }
+
+  if (pendingConnect) {
+    pthread_mutex_lock(&pendingConnect->mutex);
+    bool done = pendingConnect->done;
+    pthread_mutex_unlock(&pendingConnect->mutex);
+    if (!done) {
+      return false;
+    }
+    shared_ptr<NetworkConnect> attempt = pendingConnect;
+    pendingConnect.reset();
+    return finishConnect(attempt);
+  }
+
+  // Don't wait on connect timeouts to a destination that keeps failing
+  g_hostHealth.setPolicy(healthKey(), healthPolicy);
+  if (!g_hostHealth.isAvailable(healthKey())) {
+    if (!ignoreNetworkError) {
+      setStatus("Circuit breaker open");
+    }
+    return false;
+  }
+
   bool success = true;
   if (serviceBased) {
     time_t now = time(NULL);
@@ -1886,7 +2520,10 @@ bool NetworkStore::open() {
     }
   } else if (listBased) {
     // load 'servers' from the list
-    success = loadFromList(serviceList, serviceListDefaultPort, servers);
+    servers.clear();
+    balancing.weights.clear();
+    success = loadFromList(serviceList, serviceListDefaultPort, servers,
+                           balancing.weights);
   }
 
   if (serviceBased || listBased) {
@@ -1896,56 +2533,91 @@ bool NetworkStore::open() {
       setStatus("Could not get list of servers from service");
       return false;
     }
-
-    if (useConnPool) {
-      opened = g_connPool.open(serviceName, servers, static_cast<int>(timeout));
-    } else {
-      if (unpooledConn != NULL) {
-        LOG_OPER("Logic error: NetworkStore::open unpooledConn is not NULL"
-            " service = %s", serviceName.c_str());
-      }
-      unpooledConn = shared_ptr<scribeConn>(new scribeConn(serviceName,
-            servers, static_cast<int>(timeout)));
-      opened = unpooledConn->open();
-      if (!opened) {
-        unpooledConn.reset();
-      }
+    if (!useConnPool && unpooledConns != NULL) {
+      LOG_OPER("Logic error: NetworkStore::open unpooledConns is not NULL"
+          " service = %s", serviceName.c_str());
     }
-
   } else if (remotePort <= 0 || remoteHost.empty()) {
     LOG_OPER("[%s] Bad config - won't attempt to connect to <%s:%lu>",
         categoryHandled.c_str(), remoteHost.c_str(), remotePort);
     setStatus("Bad config - invalid location for remote server");
     return false;
-  } else {
-    if (useConnPool) {
-      opened = g_connPool.open(remoteHost, remotePort,
-          static_cast<int>(timeout));
-    } else {
-      // only open unpooled connection if not already open
-      if (unpooledConn != NULL) {
-        LOG_OPER("Logic error: NetworkStore::open unpooledConn is not NULL"
-            " %s:%lu", remoteHost.c_str(), remotePort);
-      }
-      unpooledConn = shared_ptr<scribeConn>(new scribeConn(remoteHost,
-          remotePort, static_cast<int>(timeout)));
-      opened = unpooledConn->open();
-      if (!opened) {
-        unpooledConn.reset();
-      }
+  } else if (!useConnPool && unpooledConns != NULL) {
+    LOG_OPER("Logic error: NetworkStore::open unpooledConns is not NULL"
+        " %s:%lu", remoteHost.c_str(), remotePort);
+  }
+
+  shared_ptr<NetworkConnect> attempt(new NetworkConnect());
+  attempt->useConnPool = useConnPool;
+  attempt->serviceBased = serviceBased || listBased;
+  attempt->remoteHost = remoteHost;
+  attempt->remotePort = remotePort;
+  attempt->serviceName = serviceName;
+  attempt->servers = servers;
+  attempt->timeout = static_cast<int>(timeout);
+  attempt->connPoolSize = connPoolSize;
+  attempt->compression = compression;
+  attempt->balancing = balancing;
+
+  if (asyncConnect && startConnect(attempt)) {
+    if (!ignoreNetworkError) {
+      setStatus("Connecting");
     }
+    return false;
   }
+  attempt->connect();
+  return finishConnect(attempt);
+}
 
-  if (opened || ignoreNetworkError) {
-    // clear status on success or if we should not signal error here
-    setStatus("");
-  } else {
-    setStatus("Failed to connect");
+bool NetworkStore::startConnect(shared_ptr<NetworkConnect> attempt) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  // the thread owns this extra reference to the attempt
+  shared_ptr<NetworkConnect>* arg = new shared_ptr<NetworkConnect>(attempt);
+  pthread_t thread;
+  int error = pthread_create(&thread, &attr, NetworkConnect::threadStatic,
+                             (void*) arg);
+  pthread_attr_destroy(&attr);
+  if (error != 0) {
+    LOG_OPER("[%s] Failed to start connect thread, error <%d>",
+             categoryHandled.c_str(), error);
+    delete arg;
+    return false;
+  }
+  pendingConnect = attempt;
+  return true;
+}
+
+// Takes over the connection made by a finished attempt
+bool NetworkStore::finishConnect(shared_ptr<NetworkConnect> attempt) {
+  opened = attempt->success;
+  unpooledConns = attempt->conns;
+
+  if (opened || ignoreNetworkError) {
+    // clear status on success or if we should not signal error here
+    setStatus("");
+  } else {
+    setStatus("Failed to connect");
   }
   return opened;
 }
 
 void NetworkStore::close() {
+  if (pendingConnect) {
+    pthread_mutex_lock(&pendingConnect->mutex);
+    bool done = pendingConnect->done;
+    if (!done) {
+      pendingConnect->abandoned = true;
+    }
+    pthread_mutex_unlock(&pendingConnect->mutex);
+    if (done) {
+      finishConnect(pendingConnect);
+    }
+    pendingConnect.reset();
+  }
+
   if (!opened) {
     return;
   }
@@ -1957,10 +2629,10 @@ void NetworkStore::close() {
       g_connPool.close(remoteHost, remotePort);
     }
   } else {
-    if (unpooledConn != NULL) {
-      unpooledConn->close();
+    if (unpooledConns != NULL) {
+      unpooledConns->close();
     }
-    unpooledConn.reset();
+    unpooledConns.reset();
   }
 }
 
@@ -1968,11 +2640,29 @@ bool NetworkStore::isOpen() {
   return opened;
 }
 
+string NetworkStore::healthKey() {
+  if (serviceBased || listBased) {
+    return serviceName;
+  }
+  return HostHealthTracker::makeKey(remoteHost, remotePort);
+}
+
 shared_ptr<Store> NetworkStore::copy(const std::string &category) {
   NetworkStore *store = new NetworkStore(storeQueue, category, multiCategory);
   shared_ptr<Store> copied = shared_ptr<Store>(store);
 
   store->useConnPool = useConnPool;
+  store->connPoolSize = connPoolSize;
+  store->cacheRequests = cacheRequests;
+  store->compression = compression;
+  store->healthPolicy = healthPolicy;
+  store->asyncConnect = asyncConnect;
+  store->balancing = balancing;
+  store->maxBatchBytes = maxBatchBytes;
+  store->maxBatchMessages = maxBatchMessages;
+  store->coalesce = coalesce;
+  store->coalesceMaxBytes = coalesceMaxBytes;
+  store->coalesceMaxMs = coalesceMaxMs;
   store->serviceBased = serviceBased;
   store->listBased = listBased;
   store->timeout = timeout;
@@ -1984,12 +2674,143 @@ shared_ptr<Store> NetworkStore::copy(const std::string &category) {
 }
 
 
-// If the size of messages is greater than a threshold
-// first try sending an empty vector to catch dfqs
+// Fails right away while the destination's circuit breaker is open.
+// Once it is half open a single empty Log is sent as a probe before
+// the real batch.
+// Batches larger than max_batch_bytes or max_batch_messages are sent in
+// chunks. If a chunk fails, only the messages that were not sent are
+// left in messages.
 bool
 NetworkStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   int ret;
 
+  if (!allowSend()) {
+    return false;
+  }
+
+  size_t num_messages = messages->size();
+  size_t num_sent = 0;
+  if (!needsSplit(*messages)) {
+    // Retries and sibling stores sending this same batch reuse the request
+    log_request_ptr_t request;
+    if (coalesce) {
+      ret = sendCoalesced(messages);
+    } else {
+      if (cacheRequests) {
+        request = g_logRequestCache.get(messages);
+      }
+      ret = send(messages, request);
+    }
+    if (ret == CONN_OK) {
+      num_sent = num_messages;
+    }
+  } else {
+    // Send in chunks of at most maxBatchMessages messages and
+    // maxBatchBytes bytes, stopping at the first chunk that fails
+    ret = CONN_OK;
+    while (num_sent < num_messages && ret == CONN_OK) {
+      size_t end = num_sent;
+      unsigned long bytes = 0;
+      do {
+        const LogEntry& entry = *(*messages)[end];
+        bytes += entry.category.size() + entry.message.size();
+        ++end;
+      } while (end < num_messages &&
+               (maxBatchMessages == 0 || end - num_sent < maxBatchMessages) &&
+               (maxBatchBytes == 0 ||
+                bytes + (*messages)[end]->category.size() +
+                (*messages)[end]->message.size() <= maxBatchBytes));
+
+      boost::shared_ptr<logentry_vector_t> chunk(
+        new logentry_vector_t(messages->begin() + num_sent,
+                              messages->begin() + end));
+      ret = send(chunk, log_request_ptr_t());
+      if (ret == CONN_OK) {
+        num_sent = end;
+      }
+    }
+    g_Handler->incCounter(categoryHandled, "split batches");
+  }
+
+  if (ret == CONN_FATAL) {
+    close();
+  }
+  if (num_sent > 0 && num_sent < num_messages) {
+    // return only the messages that weren't sent
+    LOG_OPER("[%s] sent <%lu> of <%lu> messages before failing",
+             categoryHandled.c_str(), (unsigned long) num_sent,
+             (unsigned long) num_messages);
+    messages->erase(messages->begin(), messages->begin() + num_sent);
+  }
+  return (num_sent == num_messages);
+}
+
+// The keys are left out while serializing the request, so the messages
+// aren't copied first. Batches that have to be split or coalesced are
+// copied and sent the usual way.
+bool NetworkStore::handleMessagesWithoutKey(
+  boost::shared_ptr<logentry_vector_t> messages, char key_delimiter) {
+  if (coalesce || needsSplit(*messages)) {
+    return Store::handleMessagesWithoutKey(messages, key_delimiter);
+  }
+
+  if (!allowSend()) {
+    return false;
+  }
+  int ret = send(messages,
+                 LogRequestCache::serializeWithoutKeys(*messages,
+                                                       key_delimiter));
+  if (ret == CONN_FATAL) {
+    close();
+  }
+  return ret == CONN_OK;
+}
+
+// Relayed messages are sent without being deserialized. They are never
+// split or coalesced, relay mode is meant for servers that only forward
+// what they receive and already get reasonably sized batches.
+bool NetworkStore::handleRelay(boost::shared_ptr<RelayBatch> batch,
+                               boost::shared_ptr<logentry_vector_t>& unhandled) {
+  if (allowSend()) {
+    int ret = sendRequest(batch->serialize(), batch->entries.size());
+    if (ret == CONN_OK) {
+      g_Handler->incCounter(categoryHandled, "relayed", batch->entries.size());
+      return true;
+    }
+    if (ret == CONN_FATAL) {
+      close();
+    }
+  }
+  unhandled = batch->toLogEntries();
+  return false;
+}
+
+// Sends frames from a wire format buffer file, stopping at the first
+// one that fails
+bool NetworkStore::handleFrames(const vector<wire_frame_t>& frames,
+                                size_t& num_sent) {
+  num_sent = 0;
+  if (!allowSend()) {
+    return false;
+  }
+  for (vector<wire_frame_t>::const_iterator iter = frames.begin();
+       iter != frames.end();
+       ++iter) {
+    int ret = sendFrame(*iter);
+    if (ret != CONN_OK) {
+      if (ret == CONN_FATAL) {
+        close();
+      }
+      return false;
+    }
+    ++num_sent;
+  }
+  return true;
+}
+
+// Opens the store if needed and checks the destination's circuit breaker.
+// Once it is half open a single empty Log is sent as a probe.
+bool NetworkStore::allowSend() {
   if (!isOpen()) {
     if (!open()) {
     LOG_OPER("[%s] Could not open NetworkStore in handleMessages",
@@ -1998,52 +2819,246 @@ NetworkStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
     }
   }
 
-  bool tryDummySend = shouldSendDummy(messages);
-  boost::shared_ptr<logentry_vector_t> dummymessages(new logentry_vector_t);
+  bool probe = false;
+  if (!g_hostHealth.allowSend(healthKey(), &probe)) {
+    g_Handler->incCounter(categoryHandled, "circuit breaker rejected");
+    return false;
+  }
+
+  if (probe) {
+    boost::shared_ptr<logentry_vector_t> dummymessages(new logentry_vector_t);
+    int ret = send(dummymessages, log_request_ptr_t());
+    if (ret != CONN_OK) {
+      if (ret == CONN_FATAL) {
+        close();
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+int NetworkStore::send(boost::shared_ptr<logentry_vector_t> messages,
+                       log_request_ptr_t request) {
+  if (useConnPool) {
+    if (serviceBased || listBased) {
+      return g_connPool.send(serviceName, messages, request);
+    } else {
+      return g_connPool.send(remoteHost, remotePort, messages, request);
+    }
+  } else if (unpooledConns) {
+    return unpooledConns->send(messages, request);
+  }
+  LOG_OPER("[%s] Logic error: NetworkStore::handleMessages unpooledConns "
+      "is NULL", categoryHandled.c_str());
+  return CONN_FATAL;
+}
 
+int NetworkStore::sendRequest(log_request_ptr_t request, int count) {
   if (useConnPool) {
     if (serviceBased || listBased) {
-      if (!tryDummySend ||
-          ((ret = g_connPool.send(serviceName, dummymessages)) == CONN_OK)) {
-        ret = g_connPool.send(serviceName, messages);
-      }
+      return g_connPool.sendRequest(serviceName, request, count);
     } else {
-      if (!tryDummySend ||
-          (ret = g_connPool.send(remoteHost, remotePort, dummymessages)) ==
-          CONN_OK) {
-        ret = g_connPool.send(remoteHost, remotePort, messages);
-      }
+      return g_connPool.sendRequest(remoteHost, remotePort, request, count);
     }
-  } else if (unpooledConn) {
-    if (!tryDummySend ||
-        ((ret = unpooledConn->send(dummymessages)) == CONN_OK)) {
-      ret = unpooledConn->send(messages);
+  } else if (unpooledConns) {
+    return unpooledConns->sendRequest(request, count);
+  }
+  LOG_OPER("[%s] Logic error: NetworkStore::sendRequest unpooledConns "
+      "is NULL", categoryHandled.c_str());
+  return CONN_FATAL;
+}
+
+int NetworkStore::sendFrame(const wire_frame_t& frame) {
+  if (useConnPool) {
+    if (serviceBased || listBased) {
+      return g_connPool.sendFrame(serviceName, frame);
+    } else {
+      return g_connPool.sendFrame(remoteHost, remotePort, frame);
     }
-  } else {
-    ret = CONN_FATAL;
-    LOG_OPER("[%s] Logic error: NetworkStore::handleMessages unpooledConn "
-        "is NULL", categoryHandled.c_str());
+  } else if (unpooledConns) {
+    return unpooledConns->sendFrame(frame);
   }
-  if (ret == CONN_FATAL) {
-    close();
+  LOG_OPER("[%s] Logic error: NetworkStore::sendFrame unpooledConns "
+      "is NULL", categoryHandled.c_str());
+  return CONN_FATAL;
+}
+
+// Sends messages as part of a Log() call shared with other stores
+// sending to the same destination, see LogCoalescer
+int NetworkStore::sendCoalesced(boost::shared_ptr<logentry_vector_t> messages) {
+  int ret;
+  LogCoalescer::batch_ptr_t batch =
+    g_logCoalescer.join(healthKey(), messages, coalesceMaxBytes,
+                        coalesceMaxMs, &ret);
+  if (batch) {
+    ret = send(batch->messages, log_request_ptr_t());
+    g_logCoalescer.finish(batch, ret);
   }
-  return (ret == CONN_OK);
+  return ret;
+}
+
+bool NetworkStore::needsSplit(const logentry_vector_t& messages) {
+  if (maxBatchMessages != 0 && messages.size() > maxBatchMessages) {
+    return true;
+  }
+  if (maxBatchBytes == 0) {
+    return false;
+  }
+  unsigned long bytes = 0;
+  for (logentry_vector_t::const_iterator iter = messages.begin();
+       iter != messages.end();
+       ++iter) {
+    bytes += (*iter)->category.size() + (*iter)->message.size();
+    if (bytes > maxBatchBytes) {
+      return true;
+    }
+  }
+  return false;
 }
 
 void NetworkStore::flush() {
   // Nothing to do
 }
 
+bucket_job_t::bucket_job_t()
+  : type(HANDLE_MESSAGES),
+    bucket(0),
+    removeKey(false),
+    delimiter(0),
+    handled(false),
+    latencyMs(0) {
+}
+
+BucketDispatcher::BucketDispatcher(const string& category_,
+                                   unsigned long num_threads)
+  : category(category_),
+    jobs(NULL),
+    nextJob(0),
+    runningJobs(0),
+    stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&workCond, NULL);
+  pthread_cond_init(&doneCond, NULL);
+
+  for (unsigned long i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, threadStatic, (void*) this);
+    if (error) {
+      // the calling thread still runs jobs, so fewer threads is fine
+      LOG_OPER("[%s] could only start <%lu> of <%lu> bucket threads: %s",
+               category.c_str(), i, num_threads, strerror(error));
+      break;
+    }
+    threads.push_back(thread);
+  }
+}
+
+BucketDispatcher::~BucketDispatcher() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&workCond);
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<pthread_t>::iterator iter = threads.begin();
+       iter != threads.end();
+       ++iter) {
+    pthread_join(*iter, NULL);
+  }
+
+  pthread_cond_destroy(&doneCond);
+  pthread_cond_destroy(&workCond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void* BucketDispatcher::threadStatic(void* arg) {
+  BucketDispatcher* dispatcher = (BucketDispatcher*) arg;
+  dispatcher->threadMain();
+  return NULL;
+}
+
+void BucketDispatcher::threadMain() {
+  pthread_mutex_lock(&mutex);
+  while (!stopping) {
+    runJobs();
+    if (!stopping) {
+      pthread_cond_wait(&workCond, &mutex);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void BucketDispatcher::run(vector<bucket_job_t>& jobs_) {
+  pthread_mutex_lock(&mutex);
+  jobs = &jobs_;
+  nextJob = 0;
+  pthread_cond_broadcast(&workCond);
+
+  runJobs();
+  while (runningJobs > 0) {
+    pthread_cond_wait(&doneCond, &mutex);
+  }
+  jobs = NULL;
+  pthread_mutex_unlock(&mutex);
+}
+
+void BucketDispatcher::runJobs() {
+  while (jobs != NULL && nextJob < jobs->size()) {
+    bucket_job_t& job = (*jobs)[nextJob++];
+    ++runningJobs;
+    pthread_mutex_unlock(&mutex);
+
+    runJob(job, category);
+
+    pthread_mutex_lock(&mutex);
+    if (--runningJobs == 0 && nextJob >= jobs->size()) {
+      pthread_cond_broadcast(&doneCond);
+    }
+  }
+}
+
+void BucketDispatcher::runJob(bucket_job_t& job, const string& category) {
+  unsigned long start = scribe::clock::nowInMsec();
+  try {
+    if (job.type == bucket_job_t::OPEN) {
+      job.handled = job.store->open();
+    } else {
+      // The bucket gets the original messages and leaves out the keys
+      // itself, so they don't have to be copied here
+      job.handled = job.removeKey ?
+        job.store->handleMessagesWithoutKey(job.messages, job.delimiter) :
+        job.store->handleMessages(job.messages);
+    }
+  } catch (const std::exception& e) {
+    LOG_OPER("[%s] bucket <%lu> failed to %s: %s", category.c_str(),
+             job.bucket, job.type == bucket_job_t::OPEN ?
+             "open" : "handle messages", e.what());
+    job.handled = false;
+  }
+  job.latencyMs = scribe::clock::nowInMsec() - start;
+}
+
 BucketStore::BucketStore(StoreQueue* storeq,
                         const string& category,
                         bool multi_category)
   : Store(storeq, category, "bucket", multi_category),
     bucketType(context_log),
+    bucketHash(scribe::buckethash::DEFAULT),
     delimiter(DEFAULT_BUCKETSTORE_DELIMITER),
     removeKey(false),
     opened(false),
     bucketRange(0),
-    numBuckets(1) {
+    numBuckets(1),
+    ringVnodes(DEFAULT_BUCKETSTORE_RING_VNODES),
+    numThreads(0),
+    numOpenThreads(0),
+    bufferMaxSize(0),
+    bufferedBytes(0),
+    bufferRetryInterval(DEFAULT_BUCKETSTORE_BUFFER_RETRY_INTERVAL),
+    bucketStats(false),
+    statsInterval(DEFAULT_BUCKETSTORE_STATS_INTERVAL),
+    skewFactor(DEFAULT_BUCKETSTORE_SKEW_FACTOR),
+    lastStatsReport(0) {
 }
 
 BucketStore::~BucketStore() {
@@ -2240,9 +3255,10 @@ handle_error:
 void BucketStore::configure(pStoreConf configuration, pStoreConf parent) {
   Store::configure(configuration, parent);
 
-  string error_msg, bucketizer_str, remove_key_str;
+  string error_msg, bucketizer_str, remove_key_str, tmp_string;
   unsigned long delim_long = 0;
-  pStoreConf bucket_conf;
+  unsigned long start;
+  pStoreConf bucket_conf, buffer_conf;
   //set this to true for bucket types that have a delimiter
   bool need_delimiter = false;
 
@@ -2268,6 +3284,26 @@ void BucketStore::configure(pStoreConf configuration, pStoreConf parent) {
       LOG_OPER("[%s] config warning - bucket_range is 0",
                categoryHandled.c_str());
     }
+  } else if (0 == bucketizer_str.compare("key_jump")) {
+    bucketType = key_jump;
+    need_delimiter = true;
+  } else if (0 == bucketizer_str.compare("key_ring")) {
+    bucketType = key_ring;
+    need_delimiter = true;
+    configuration->getUnsigned("ring_vnodes", ringVnodes);
+    if (ringVnodes == 0) {
+      LOG_OPER("[%s] config warning - ring_vnodes is 0, using default",
+               categoryHandled.c_str());
+      ringVnodes = DEFAULT_BUCKETSTORE_RING_VNODES;
+    }
+  }
+
+  // Optionally use a better hash than djb2 for keys and none for ids
+  if (configuration->getString("bucket_hash", tmp_string) &&
+      !scribe::buckethash::parse(tmp_string, bucketHash)) {
+    LOG_OPER("[%s] config warning - unknown bucket_hash <%s>, using default",
+             categoryHandled.c_str(), tmp_string.c_str());
+    bucketHash = scribe::buckethash::DEFAULT;
   }
 
   // This is either a key_hash or key_modulo, not context log, figure out the delimiter and store it
@@ -2301,12 +3337,46 @@ void BucketStore::configure(pStoreConf configuration, pStoreConf parent) {
     goto handle_error;
   }
 
+  if (bucketType == key_ring) {
+    ring.build(numBuckets, ringVnodes);
+  }
+
+  // Optionally hand batches to the buckets from a pool of threads
+  configuration->getUnsigned("bucket_threads", numThreads);
+  // and open them in parallel, so hosts that are down time out together
+  configuration->getUnsigned("bucket_open_threads", numOpenThreads);
+
+  // Optionally keep traffic stats for every bucket
+  if (configuration->getString("bucket_stats", tmp_string) &&
+      tmp_string == "yes") {
+    bucketStats = true;
+    unsigned long interval = statsInterval;
+    configuration->getUnsigned("bucket_stats_interval", interval);
+    statsInterval = interval;
+    configuration->getFloat("bucket_skew_factor", skewFactor);
+    intervalMessages.assign(numBuckets + 1, 0);
+    lastStatsReport = time(NULL);
+  }
+
   // Buckets can be defined explicitely or by specifying a single "bucket"
+  start = scribe::clock::nowInMsec();
   if (configuration->getStore("bucket", bucket_conf)) {
     createBucketsFromBucket(configuration, bucket_conf);
   } else {
     createBuckets(configuration);
   }
+  LOG_OPER("[%s] configured <%lu> buckets in <%lu> ms",
+           categoryHandled.c_str(), (unsigned long) buckets.size(),
+           scribe::clock::nowInMsec() - start);
+
+  // Optionally give each bucket its own buffer, see createBucketBuffers()
+  if (configuration->getStore("bucket_buffer", buffer_conf)) {
+    configuration->getUnsigned("bucket_buffer_max_size", bufferMaxSize);
+    unsigned long retry_interval = bufferRetryInterval;
+    configuration->getUnsigned("bucket_buffer_retry_interval", retry_interval);
+    bufferRetryInterval = retry_interval;
+    createBucketBuffers(buffer_conf);
+  }
 
   return;
 
@@ -2324,15 +3394,62 @@ bool BucketStore::open() {
     return false;
   }
 
-  for (std::vector<shared_ptr<Store> >::iterator iter = buckets.begin();
-       iter != buckets.end();
-       ++iter) {
+  unsigned long start = scribe::clock::nowInMsec();
+  time_t now = time(NULL);
+  struct tm nowinfo;
+  localtime_r(&now, &nowinfo);
 
-    if (!(*iter)->open()) {
-      close();
-      opened = false;
-      return false;
+  vector<bucket_job_t> jobs(buckets.size());
+  for (unsigned long i = 0; i < buckets.size(); ++i) {
+    if (!bucketBuffers.empty() && !bucketBuffers[i]->empty(&nowinfo)) {
+      // left over from before a restart, send it before anything new
+      buffering[i] = true;
+      nextReplay[i] = now;
     }
+    jobs[i].type = bucket_job_t::OPEN;
+    jobs[i].bucket = i;
+    jobs[i].store = buckets[i];
+  }
+
+  unsigned long num_threads = min(numOpenThreads, numBuckets);
+  if (num_threads > 0) {
+    // only needed while opening, so not the dispatcher used for sends
+    BucketDispatcher dispatcher(categoryHandled, num_threads);
+    dispatcher.run(jobs);
+  } else {
+    for (unsigned long i = 0; i < jobs.size(); ++i) {
+      BucketDispatcher::runJob(jobs[i], categoryHandled);
+      if (!jobs[i].handled && bucketBuffers.empty()) {
+        // the store can't open anyway, don't wait for the rest
+        break;
+      }
+    }
+  }
+
+  unsigned long num_failed = 0;
+  for (unsigned long i = 0; i < jobs.size(); ++i) {
+    if (jobs[i].handled) {
+      continue;
+    }
+    ++num_failed;
+    if (!bucketBuffers.empty()) {
+      // a bucket that can't be opened doesn't stop the others
+      LOG_OPER("[%s] can't open bucket <%lu>, buffering its messages",
+               categoryHandled.c_str(), i);
+      buffering[i] = true;
+      nextReplay[i] = now + bufferRetryInterval;
+    }
+  }
+
+  LOG_OPER("[%s] opened <%lu> of <%lu> buckets in <%lu> ms using <%lu> "
+           "threads", categoryHandled.c_str(), jobs.size() - num_failed,
+           (unsigned long) jobs.size(), scribe::clock::nowInMsec() - start,
+           max(num_threads, 1UL));
+
+  if (num_failed > 0 && bucketBuffers.empty()) {
+    close();
+    opened = false;
+    return false;
   }
   opened = true;
   return true;
@@ -2351,6 +3468,13 @@ void BucketStore::close() {
        ++iter) {
     (*iter)->close();
   }
+  for (std::vector<shared_ptr<Store> >::iterator iter = bucketBuffers.begin();
+       iter != bucketBuffers.end();
+       ++iter) {
+    if ((*iter)->isOpen()) {
+      (*iter)->close();
+    }
+  }
   opened = false;
 }
 
@@ -2360,6 +3484,13 @@ void BucketStore::flush() {
        ++iter) {
     (*iter)->flush();
   }
+  for (std::vector<shared_ptr<Store> >::iterator iter = bucketBuffers.begin();
+       iter != bucketBuffers.end();
+       ++iter) {
+    if ((*iter)->isOpen()) {
+      (*iter)->flush();
+    }
+  }
 }
 
 string BucketStore::getStatus() {
@@ -2388,6 +3519,235 @@ void BucketStore::periodicCheck() {
     uint32_t idx = storeIndex[i];
     buckets[idx]->periodicCheck();
   }
+
+  time_t now = time(NULL);
+  if (bucketStats && now - lastStatsReport >= statsInterval) {
+    reportSkew(now);
+  }
+
+  if (bucketBuffers.empty()) {
+    return;
+  }
+
+  struct tm nowinfo;
+  localtime_r(&now, &nowinfo);
+  for (unsigned long i = 0; i < bucketBuffers.size(); ++i) {
+    if (bucketBuffers[i]->isOpen()) {
+      bucketBuffers[i]->periodicCheck();
+    }
+    if (buffering[i] && now >= nextReplay[i]) {
+      replayBuffer(i, &nowinfo);
+    }
+  }
+}
+
+void BucketStore::recordBucketTraffic(unsigned long bucket,
+                                      const logentry_vector_t& messages) {
+  unsigned long bytes = 0;
+  for (logentry_vector_t::const_iterator iter = messages.begin();
+       iter != messages.end();
+       ++iter) {
+    bytes += (*iter)->message.size();
+  }
+  intervalMessages[bucket] += messages.size();
+
+  ostringstream prefix;
+  prefix << "bucket " << bucket << " ";
+  g_Handler->incCategoryCounter(categoryHandled, prefix.str() + "messages",
+                                messages.size());
+  g_Handler->incCategoryCounter(categoryHandled, prefix.str() + "bytes",
+                                bytes);
+}
+
+// Send latencies are counted in a few fixed ranges, which is enough to
+// see which buckets are slow without keeping samples
+void BucketStore::recordBucketLatency(unsigned long bucket,
+                                      unsigned long latency_ms) {
+  static const unsigned long limits[] = {1, 10, 100, 1000};
+  static const char* names[] = {"<1ms", "<10ms", "<100ms", "<1s", ">=1s"};
+  static const size_t num_limits = sizeof(limits) / sizeof(limits[0]);
+
+  size_t range = 0;
+  while (range < num_limits && latency_ms >= limits[range]) {
+    ++range;
+  }
+
+  ostringstream counter;
+  counter << "bucket " << bucket << " latency " << names[range];
+  g_Handler->incCategoryCounter(categoryHandled, counter.str(), 1);
+}
+
+// Logs the buckets that got much more than their share of the messages
+// since the last report
+void BucketStore::reportSkew(time_t now) {
+  unsigned long total = 0;
+  for (unsigned long i = 0; i < intervalMessages.size(); ++i) {
+    total += intervalMessages[i];
+  }
+
+  // bucket 0 only gets messages without a usable key, so the even share
+  // is that of the numBuckets real buckets
+  if (total > 0 && numBuckets > 0) {
+    double even_share = 1.0 / numBuckets;
+    ostringstream hot;
+    unsigned long num_hot = 0;
+    for (unsigned long i = 0; i < intervalMessages.size(); ++i) {
+      double share = (double) intervalMessages[i] / total;
+      if (share > skewFactor * even_share) {
+        hot << (num_hot ? ", " : "") << "<" << i << "> "
+            << setprecision(3) << share * 100 << "% ("
+            << setprecision(2) << share / even_share << "x)";
+        ++num_hot;
+
+        ostringstream counter;
+        counter << "bucket " << i << " hot intervals";
+        g_Handler->incCategoryCounter(categoryHandled, counter.str(), 1);
+      }
+    }
+    if (num_hot) {
+      LOG_OPER("[%s] <%lu> hot buckets out of <%lu> messages in the last "
+               "<%lu> seconds: %s", categoryHandled.c_str(), num_hot, total,
+               (unsigned long) (now - lastStatsReport), hot.str().c_str());
+    }
+  }
+
+  intervalMessages.assign(intervalMessages.size(), 0);
+  lastStatsReport = now;
+}
+
+/*
+ * Buffers are file stores configured by <bucket_buffer>, each in a
+ * subdirectory named after its bucket:
+ *
+ * <store>
+ *   type=bucket
+ *   ...
+ *   bucket_buffer_max_size=1000000000
+ *   bucket_buffer_retry_interval=30
+ *   <bucket_buffer>
+ *     file_path=/tmp/scribe/buckets
+ *     max_size=5000000
+ *   </bucket_buffer>
+ * </store>
+ *
+ * A bucket that fails sends its messages to its buffer and keeps doing so
+ * until the buffer has been replayed, so they are delivered in order.
+ */
+void BucketStore::createBucketBuffers(pStoreConf buffer_conf) {
+  string sub_directory, base_filename;
+  buffer_conf->getString("sub_directory", sub_directory);
+  if (!buffer_conf->getString("base_filename", base_filename)) {
+    buffer_conf->setString("base_filename", categoryHandled);
+  }
+  // every open starts a new file, so a buffer being replayed is never
+  // appended to
+  buffer_conf->setString("rotate_on_reopen", "yes");
+
+  for (unsigned long i = 0; i < buckets.size(); ++i) {
+    ostringstream bucket_dir;
+    if (!sub_directory.empty()) {
+      bucket_dir << sub_directory << '/';
+    }
+    bucket_dir << "bucket" << setw(3) << setfill('0') << i;
+    buffer_conf->setString("sub_directory", bucket_dir.str());
+
+    shared_ptr<Store> buffer =
+      createStore(storeQueue, "file", categoryHandled, true, multiCategory);
+    buffer->configure(buffer_conf, storeConf);
+    bucketBuffers.push_back(buffer);
+  }
+  buffering.assign(buckets.size(), false);
+  nextReplay.assign(buckets.size(), 0);
+}
+
+// Returns false if the buffer is full or can't be written
+bool BucketStore::bufferMessages(unsigned long bucket,
+                                 shared_ptr<logentry_vector_t> messages) {
+  unsigned long bytes = 0;
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end();
+       ++iter) {
+    bytes += (*iter)->category.size() + (*iter)->message.size();
+  }
+  if (bufferMaxSize != 0 && bufferedBytes + bytes > bufferMaxSize) {
+    g_Handler->incCounter(categoryHandled, "bucket buffers full");
+    return false;
+  }
+
+  if (!bucketBuffers[bucket]->handleMessages(messages)) {
+    LOG_OPER("[%s] failed to write to the buffer of bucket <%lu>",
+             categoryHandled.c_str(), bucket);
+    return false;
+  }
+
+  bufferedBytes += bytes;
+  if (!buffering[bucket]) {
+    LOG_OPER("[%s] bucket <%lu> failed, buffering its messages",
+             categoryHandled.c_str(), bucket);
+    buffering[bucket] = true;
+    nextReplay[bucket] = time(NULL) + bufferRetryInterval;
+  }
+  g_Handler->incCounter(categoryHandled, "bucket buffered", messages->size());
+  return true;
+}
+
+// Sends the oldest file of a bucket's buffer, same as a BufferStore in
+// SENDING_BUFFER with buffer_send_rate=1
+void BucketStore::replayBuffer(unsigned long bucket, struct tm* now) {
+  shared_ptr<Store> buffer = bucketBuffers[bucket];
+
+  // anything buffered from now on goes to a new file
+  if (buffer->isOpen()) {
+    buffer->close();
+  }
+
+  shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+  if (!buffer->readOldest(messages, now)) {
+    LOG_OPER("[%s] WARNING: can't read the buffer of bucket <%lu>",
+             categoryHandled.c_str(), bucket);
+    nextReplay[bucket] = time(NULL) + bufferRetryInterval;
+    return;
+  }
+
+  if (!messages->empty()) {
+    unsigned long size = messages->size();
+    unsigned long bytes = 0;
+    for (logentry_vector_t::iterator iter = messages->begin();
+         iter != messages->end();
+         ++iter) {
+      bytes += (*iter)->category.size() + (*iter)->message.size();
+    }
+
+    bucket_job_t job;
+    job.bucket = bucket;
+    job.store = buckets[bucket];
+    job.messages = messages;
+    job.removeKey = removeKey;
+    job.delimiter = delimiter;
+    BucketDispatcher::runJob(job, categoryHandled);
+
+    if (!job.handled) {
+      if (messages->size() != size &&
+          !buffer->replaceOldest(messages, now)) {
+        LOG_OPER("[%s] buffer of bucket <%lu> lost %lu messages",
+                 categoryHandled.c_str(), bucket,
+                 (unsigned long) messages->size());
+        g_Handler->incCounter(categoryHandled, "lost", messages->size());
+        buffer->deleteOldest(now);
+      }
+      nextReplay[bucket] = time(NULL) + bufferRetryInterval;
+      return;
+    }
+    // sizes of files left from before a restart aren't known
+    bufferedBytes -= min(bytes, bufferedBytes);
+  }
+  buffer->deleteOldest(now);
+
+  if (buffer->empty(now)) {
+    LOG_OPER("[%s] buffer of bucket <%lu> sent, sending to it directly",
+             categoryHandled.c_str(), bucket);
+    buffering[bucket] = false;
+  }
 }
 
 shared_ptr<Store> BucketStore::copy(const std::string &category) {
@@ -2396,13 +3756,32 @@ shared_ptr<Store> BucketStore::copy(const std::string &category) {
 
   store->numBuckets = numBuckets;
   store->bucketType = bucketType;
+  store->bucketHash = bucketHash;
   store->delimiter = delimiter;
+  store->ringVnodes = ringVnodes;
+  store->ring = ring;
+  store->numThreads = numThreads;
+  store->numOpenThreads = numOpenThreads;
+  store->bucketStats = bucketStats;
+  store->statsInterval = statsInterval;
+  store->skewFactor = skewFactor;
+  store->lastStatsReport = lastStatsReport;
+  store->intervalMessages.assign(intervalMessages.size(), 0);
+  store->bufferMaxSize = bufferMaxSize;
+  store->bufferRetryInterval = bufferRetryInterval;
+  store->buffering.assign(bucketBuffers.size(), false);
+  store->nextReplay.assign(bucketBuffers.size(), 0);
 
   for (std::vector<shared_ptr<Store> >::iterator iter = buckets.begin();
        iter != buckets.end();
        ++iter) {
     store->buckets.push_back((*iter)->copy(category));
   }
+  for (std::vector<shared_ptr<Store> >::iterator iter = bucketBuffers.begin();
+       iter != bucketBuffers.end();
+       ++iter) {
+    store->bucketBuffers.push_back((*iter)->copy(category));
+  }
 
   return copied;
 }
@@ -2442,34 +3821,59 @@ bool BucketStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
   }
 
   // handle all batches of messages
+  vector<bucket_job_t> jobs;
   for (unsigned long i = 0; i <= numBuckets; i++) {
-    shared_ptr<logentry_vector_t> batch = bucketed_messages[i];
-
-    if (batch) {
-
-      if (removeKey) {
-        // Create new set of messages with keys removed
-        shared_ptr<logentry_vector_t> key_removed =
-          shared_ptr<logentry_vector_t> (new logentry_vector_t);
-
-        for (logentry_vector_t::iterator iter = batch->begin();
-             iter != batch->end();
-             ++iter) {
-          logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
-          entry->category = (*iter)->category;
-          entry->message = getMessageWithoutKey((*iter)->message);
-          key_removed->push_back(entry);
-        }
-        batch = key_removed;
-      }
+    if (bucketStats && bucketed_messages[i]) {
+      recordBucketTraffic(i, *bucketed_messages[i]);
+    }
 
-      if (!buckets[i]->handleMessages(batch)) {
-        // keep track of messages that were not handled
+    if (bucketed_messages[i] && !bucketBuffers.empty() && buffering[i]) {
+      // keep the bucket's messages in order behind what it has buffered
+      if (!bufferMessages(i, bucketed_messages[i])) {
         failed_messages->insert(failed_messages->end(),
                                 bucketed_messages[i]->begin(),
                                 bucketed_messages[i]->end());
         success = false;
       }
+    } else if (bucketed_messages[i]) {
+      bucket_job_t job;
+      job.bucket = i;
+      job.store = buckets[i];
+      job.messages = bucketed_messages[i];
+      job.removeKey = removeKey;
+      job.delimiter = delimiter;
+      jobs.push_back(job);
+    }
+  }
+
+  if (numThreads > 0 && jobs.size() > 1) {
+    if (!dispatcher) {
+      dispatcher = shared_ptr<BucketDispatcher>(
+        new BucketDispatcher(categoryHandled, min(numThreads, numBuckets)));
+    }
+    dispatcher->run(jobs);
+  } else {
+    for (vector<bucket_job_t>::iterator iter = jobs.begin();
+         iter != jobs.end();
+         ++iter) {
+      BucketDispatcher::runJob(*iter, categoryHandled);
+    }
+  }
+
+  // keep track of messages that were neither handled nor buffered
+  for (vector<bucket_job_t>::iterator iter = jobs.begin();
+       iter != jobs.end();
+       ++iter) {
+    if (bucketStats) {
+      recordBucketLatency(iter->bucket, iter->latencyMs);
+    }
+    if (!iter->handled &&
+        (bucketBuffers.empty() || !bufferMessages(iter->bucket,
+                                                  iter->messages))) {
+      failed_messages->insert(failed_messages->end(),
+                              iter->messages->begin(),
+                              iter->messages->end());
+      success = false;
     }
   }
 
@@ -2484,24 +3888,12 @@ bool BucketStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
 // Return the bucket number a message must be put into
 unsigned long BucketStore::bucketize(const std::string& message) {
 
-  string::size_type length = message.length();
+  // The key is parsed in place, building a bucket shouldn't allocate
+  const char* data = message.data();
+  size_t length = message.length();
 
   if (bucketType == context_log) {
-    // the key is in ascii after the third delimiter
-    char delim = 1;
-    string::size_type pos = 0;
-    for (int i = 0; i < 3; ++i) {
-      pos = message.find(delim, pos);
-      if (pos == string::npos || length <= pos + 1) {
-        return 0;
-      }
-      ++pos;
-    }
-    if (message[pos] == delim) {
-      return 0;
-    }
-
-    uint32_t id = strtoul(message.substr(pos).c_str(), NULL, 10);
+    uint32_t id = scribe::bucketkey::contextLogId(data, length);
     if (id == 0) {
       return 0;
     }
@@ -2509,21 +3901,22 @@ unsigned long BucketStore::bucketize(const std::string& message) {
     if (numBuckets == 0) {
       return 0;
     } else {
-      return (scribe::integerhash::hash32(id) % numBuckets) + 1;
+      return (scribe::buckethash::hash32(bucketHash, id) % numBuckets) + 1;
     }
   } else if (bucketType == random) {
     // return any random bucket
     return (rand() % numBuckets) + 1;
   } else {
     // just hash everything before the first user-defined delimiter
-    string::size_type pos = message.find(delimiter);
-    if (pos == string::npos) {
+    size_t key_len;
+    const char* key = scribe::bucketkey::find(data, length, delimiter,
+                                              key_len);
+    if (key == NULL) {
       // if no delimiter found, write to bucket 0
       return 0;
     }
 
-    string key = message.substr(0, pos).c_str();
-    if (key.empty()) {
+    if (key_len == 0) {
       // if no key found, write to bucket 0
       return 0;
     }
@@ -2534,7 +3927,7 @@ unsigned long BucketStore::bucketize(const std::string& message) {
       switch (bucketType) {
         case key_modulo:
           // No hashing, just simple modulo
-          return (atol(key.c_str()) % numBuckets) + 1;
+          return (scribe::bucketkey::toLong(key, key_len) % numBuckets) + 1;
           break;
         case key_range:
           if (bucketRange == 0) {
@@ -2542,14 +3935,23 @@ unsigned long BucketStore::bucketize(const std::string& message) {
           } else {
             // Calculate what bucket this key would fall into if we used
             // bucket_range to compute the modulo
-           double key_mod = atol(key.c_str()) % bucketRange;
+           double key_mod =
+             scribe::bucketkey::toLong(key, key_len) % bucketRange;
            return (unsigned long) ((key_mod / bucketRange) * numBuckets) + 1;
           }
           break;
+        case key_jump:
+          return scribe::consistenthash::jump(
+            scribe::consistenthash::hash64(key, key_len), numBuckets) + 1;
+          break;
+        case key_ring:
+          return ring.lookup(scribe::consistenthash::hash64(key, key_len)) + 1;
+          break;
         case key_hash:
         default:
           // Hashing by default.
-          return (scribe::strhash::hash32(key.c_str()) % numBuckets) + 1;
+          return (scribe::buckethash::hash32(bucketHash, key, key_len) %
+                  numBuckets) + 1;
           break;
       }
     }
@@ -2558,17 +3960,6 @@ unsigned long BucketStore::bucketize(const std::string& message) {
   return 0;
 }
 
-string BucketStore::getMessageWithoutKey(const std::string& message) {
-  string::size_type pos = message.find(delimiter);
-
-  if (pos == string::npos) {
-    return message;
-  }
-
-  return message.substr(pos+1);
-}
-
-
 NullStore::NullStore(StoreQueue* storeq,
                      const std::string& category,
                      bool multi_category)
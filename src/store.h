@@ -31,10 +31,13 @@
 #include "conf.h"
 #include "file.h"
 #include "conn_pool.h"
+#include "consistent_hash.h"
+#include "bucket_key.h"
 #include "store_queue.h"
 #include "network_dynamic_config.h"
 
 class StoreQueue;
+class RelayBatch;
 
 /* defines used by the store class */
 enum roll_period_t {
@@ -51,6 +54,13 @@ enum roll_period_t {
  */
 class Store {
  public:
+  // see replayOldest()
+  enum replay_result_t {
+    REPLAY_UNSUPPORTED, // nothing was sent, use readOldest() instead
+    REPLAY_OK,
+    REPLAY_FAILED
+  };
+
   // Creates an object of the appropriate subclass.
   static boost::shared_ptr<Store>
     createStore(StoreQueue* storeq,
@@ -70,6 +80,23 @@ class Store {
   // Attempts to store messages and returns true if successful.
   // On failure, returns false and messages contains any un-processed messages
   virtual bool handleMessages(boost::shared_ptr<logentry_vector_t> messages) = 0;
+  // Same for messages received in relay mode, see relay.h. On failure
+  // unhandled contains the messages that still need to be stored.
+  // The default converts the batch and calls handleMessages().
+  virtual bool handleRelay(boost::shared_ptr<RelayBatch> batch,
+                           boost::shared_ptr<logentry_vector_t>& unhandled);
+  // Same as handleMessages(), but each message is stored without the key
+  // before its first key_delimiter. Stores that can skip the key while
+  // writing override this, the default stores copies of the messages.
+  // On failure messages still holds, with their keys, at least the
+  // messages that weren't stored.
+  virtual bool handleMessagesWithoutKey(
+    boost::shared_ptr<logentry_vector_t> messages, char key_delimiter);
+  // Stores that can send framed Log() requests straight from a file.
+  // On failure num_sent is the number of frames that were sent.
+  virtual bool canHandleFrames() { return false; }
+  virtual bool handleFrames(const std::vector<wire_frame_t>& frames,
+                            size_t& num_sent);
   virtual void periodicCheck() {}
   virtual void flush() = 0;
 
@@ -82,6 +109,10 @@ class Store {
   virtual bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
                              struct tm* now);
   virtual bool empty(struct tm* now);
+  // Sends the oldest file to destination without reading the messages,
+  // and deletes it if the whole file was sent
+  virtual replay_result_t replayOldest(boost::shared_ptr<Store> destination,
+                                       struct tm* now);
 
   // don't need to override
   virtual const std::string& getType();
@@ -197,6 +228,8 @@ class FileStore : public FileStoreBase {
 
   boost::shared_ptr<Store> copy(const std::string &category);
   bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+  bool handleMessagesWithoutKey(boost::shared_ptr<logentry_vector_t> messages,
+                                char key_delimiter);
   bool isOpen();
   void configure(pStoreConf configuration, pStoreConf parent);
   void close();
@@ -211,16 +244,35 @@ class FileStore : public FileStoreBase {
                              struct tm* now);
   void deleteOldest(struct tm* now);
   bool empty(struct tm* now);
+  replay_result_t replayOldest(boost::shared_ptr<Store> destination,
+                               struct tm* now);
 
  protected:
   // Implement FileStoreBase virtual function
   bool openInternal(bool incrementFilename, struct tm* current_time);
+  // If remove_key is set everything up to the first key_delimiter of
+  // each message is skipped
   bool writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                      boost::shared_ptr<FileInterface> write_file =
-                     boost::shared_ptr<FileInterface>());
+                     boost::shared_ptr<FileInterface>(),
+                     bool remove_key = false, char key_delimiter = 0);
+
+  // Wire format buffer files hold serialized Log() requests instead of
+  // messages, so they can be replayed with sendfile(). The first record
+  // of the file identifies the format, files without it are read the
+  // old way.
+  bool writeWireMessages(boost::shared_ptr<logentry_vector_t> messages,
+                         boost::shared_ptr<FileInterface> write_file);
+  bool writeWireHeader(boost::shared_ptr<FileInterface> write_file);
+  bool isWireFile(const std::string& filename);
+  bool readWireRecord(const std::string& record,
+                      boost::shared_ptr<logentry_vector_t> messages);
+  bool scanWireFrames(int fd, std::vector<wire_frame_t>& frames);
+  bool dropSentFrames(const std::string& filename, int fd, off_t offset);
 
   bool isBufferFile;
   bool addNewlines;
+  bool wireFormat;
 
   // State
   boost::shared_ptr<FileInterface> writeFile;
@@ -244,6 +296,8 @@ class ThriftFileStore : public FileStoreBase {
 
   boost::shared_ptr<Store> copy(const std::string &category);
   bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+  bool handleMessagesWithoutKey(boost::shared_ptr<logentry_vector_t> messages,
+                                char key_delimiter);
   bool open();
   bool isOpen();
   void configure(pStoreConf configuration, pStoreConf parent);
@@ -254,6 +308,8 @@ class ThriftFileStore : public FileStoreBase {
  protected:
   // Implement FileStoreBase virtual function
   bool openInternal(bool incrementFilename, struct tm* current_time);
+  bool writeMessages(boost::shared_ptr<logentry_vector_t> messages,
+                     bool remove_key, char key_delimiter);
 
   boost::shared_ptr<apache::thrift::transport::TTransport> thriftFileTransport;
 
@@ -363,6 +419,41 @@ class BufferStore : public Store {
   BufferStore& operator=(BufferStore& rhs);
 };
 
+/*
+ * One attempt by a NetworkStore to connect to its destination, either
+ * in the store's own thread or in the background (see async_connect).
+ * The fields describing the destination are copied from the store so
+ * the background thread never touches the store itself.
+ */
+class NetworkConnect {
+ public:
+  NetworkConnect();
+  ~NetworkConnect();
+
+  bool connect();
+  void disconnect(); // undoes a successful connect()
+  static void* threadStatic(void* arg);
+
+  bool useConnPool;
+  bool serviceBased; // smc_service or service_list
+  std::string remoteHost;
+  unsigned long remotePort;
+  std::string serviceName;
+  server_vector_t servers;
+  int timeout;
+  unsigned long connPoolSize;
+  std::string compression;
+  balance_config_t balancing;
+
+  // results, only valid once done is set
+  bool success;
+  boost::shared_ptr<scribeConnSet> conns; // null if useConnPool
+
+  pthread_mutex_t mutex; // protects done and abandoned
+  bool done;
+  bool abandoned; // the store was closed, drop the connection when done
+};
+
 /*
  * This store sends messages to another scribe server.
  * This class is really just an adapter to the global
@@ -378,6 +469,13 @@ class NetworkStore : public Store {
 
   boost::shared_ptr<Store> copy(const std::string &category);
   bool handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+  bool handleMessagesWithoutKey(boost::shared_ptr<logentry_vector_t> messages,
+                                char key_delimiter);
+  bool handleRelay(boost::shared_ptr<RelayBatch> batch,
+                   boost::shared_ptr<logentry_vector_t>& unhandled);
+  bool canHandleFrames() { return true; }
+  bool handleFrames(const std::vector<wire_frame_t>& frames,
+                    size_t& num_sent);
   bool open();
   bool isOpen();
   void configure(pStoreConf configuration, pStoreConf parent);
@@ -388,10 +486,22 @@ class NetworkStore : public Store {
  protected:
   static const long int DEFAULT_SOCKET_TIMEOUT_MS = 5000; // 5 sec timeout
   bool loadFromList(const std::string &list, unsigned long defaultPort,
-                    server_vector_t& _return);
+                    server_vector_t& _return, weight_map_t& weights);
+  void refreshService();
+  std::string healthKey(); // destination in g_hostHealth
+  int send(boost::shared_ptr<logentry_vector_t> messages,
+           log_request_ptr_t request);
+  int sendRequest(log_request_ptr_t request, int count);
+  int sendCoalesced(boost::shared_ptr<logentry_vector_t> messages);
+  int sendFrame(const wire_frame_t& frame);
+  bool allowSend();
+  bool needsSplit(const logentry_vector_t& messages);
+  bool startConnect(boost::shared_ptr<NetworkConnect> attempt);
+  bool finishConnect(boost::shared_ptr<NetworkConnect> attempt);
 
   // configuration
   bool useConnPool;
+  unsigned long connPoolSize; // connections per destination in g_connPool
   bool serviceBased;
   bool listBased;
   long int timeout;
@@ -402,15 +512,28 @@ class NetworkStore : public Store {
   unsigned long serviceListDefaultPort;
   std::string serviceOptions;
   server_vector_t servers;
+  balance_config_t balancing;
   unsigned long serviceCacheTimeout;
   time_t lastServiceCheck;
   // if true do not update status to reflect failure to connect
   bool ignoreNetworkError;
+  // if true reuse the serialized request when the same batch is resent
+  bool cacheRequests;
+  std::string compression; // codecs to offer the remote server, in order
+  health_policy_t healthPolicy;
+  // if true connect in a background thread, open() fails until it is done
+  bool asyncConnect;
+  unsigned long maxBatchBytes;    // 0 for no limit
+  unsigned long maxBatchMessages; // 0 for no limit
+  bool coalesce; // share Log calls with other stores, see LogCoalescer
+  unsigned long coalesceMaxBytes;
+  unsigned long coalesceMaxMs;
   NetworkDynamicConfigMod* configmod;
 
   // state
   bool opened;
-  boost::shared_ptr<scribeConn> unpooledConn; // null if useConnPool
+  boost::shared_ptr<scribeConnSet> unpooledConns; // null if useConnPool
+  boost::shared_ptr<NetworkConnect> pendingConnect; // background connect
 
  private:
   // disallow copy, assignment, and empty construction
@@ -419,6 +542,66 @@ class NetworkStore : public Store {
   NetworkStore& operator=(NetworkStore& rhs);
 };
 
+// One bucket's share of a batch, see BucketDispatcher
+struct bucket_job_t {
+  enum job_type_t {
+    HANDLE_MESSAGES,
+    OPEN
+  };
+
+  bucket_job_t();
+
+  job_type_t type;
+  unsigned long bucket;
+  boost::shared_ptr<Store> store;
+  boost::shared_ptr<logentry_vector_t> messages;
+  bool removeKey;
+  char delimiter;
+  bool handled;             // result, set once the job has run
+  unsigned long latencyMs;  // how long the job took
+};
+
+/*
+ * Worker threads that let a BucketStore hand its batches to many buckets
+ * at the same time. Total latency is then that of the slowest bucket
+ * instead of the sum of all of them, and one slow bucket doesn't hold up
+ * delivery to the others. Each bucket is only used by one thread at a
+ * time, and run() doesn't return before every job is done, so the
+ * contained stores need no locking of their own.
+ */
+class BucketDispatcher {
+ public:
+  BucketDispatcher(const std::string& category, unsigned long num_threads);
+  ~BucketDispatcher();
+
+  // Runs all jobs on the worker threads and the calling thread
+  void run(std::vector<bucket_job_t>& jobs);
+  // Runs a single job in the calling thread
+  static void runJob(bucket_job_t& job, const std::string& category);
+
+  static void* threadStatic(void* arg);
+
+ protected:
+  void threadMain();
+  // Runs jobs until there are none left to take, called holding mutex
+  void runJobs();
+
+  std::string category;
+  std::vector<pthread_t> threads;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t workCond;   // there are jobs to take or we are stopping
+  pthread_cond_t doneCond;   // the last running job finished
+  std::vector<bucket_job_t>* jobs;
+  size_t nextJob;
+  size_t runningJobs;
+  bool stopping;
+
+ private:
+  BucketDispatcher(BucketDispatcher& rhs);
+  BucketDispatcher& operator=(BucketDispatcher& rhs);
+};
+
 /*
  * This store separates messages into many groups based on a
  * hash function, and sends each group to a different store.
@@ -448,19 +631,54 @@ class BucketStore : public Store {
     random,      // randomly hash messages without using any key
     key_hash,    // use hashing to split keys into buckets
     key_modulo,  // use modulo to split keys into buckets
-    key_range    // use bucketRange to compute modulo to split keys into buckets
+    key_range,   // use bucketRange to compute modulo to split keys into buckets
+    key_jump,    // jump consistent hash of the key, see consistent_hash.h
+    key_ring     // ring of ringVnodes points per bucket
   };
 
   bucketizer_type bucketType;
+  scribe::buckethash::type_t bucketHash; // for key_hash and context_log
   char delimiter;
   bool removeKey;
   bool opened;
   unsigned long bucketRange;  // used to compute key_range bucketizing
   unsigned long numBuckets;
+  unsigned long ringVnodes;   // used by key_ring bucketizing
+  scribe::HashRing ring;
+  unsigned long numThreads;   // 0 to handle buckets in the store thread
+  unsigned long numOpenThreads; // 0 to open buckets one at a time
   std::vector<boost::shared_ptr<Store> > buckets;
+  boost::shared_ptr<BucketDispatcher> dispatcher; // started on first use
+
+  // Optional file store per bucket that holds the bucket's messages while
+  // it is failing, so the other buckets keep going. Empty if there's no
+  // bucket_buffer.
+  std::vector<boost::shared_ptr<Store> > bucketBuffers;
+  std::vector<bool> buffering;         // bucket's messages go to its buffer
+  std::vector<time_t> nextReplay;      // when to retry sending the buffer
+  unsigned long bufferMaxSize;         // shared by all buffers, 0 = no limit
+  unsigned long bufferedBytes;         // written to buffers since startup
+  time_t bufferRetryInterval;          // in seconds
+
+  // Optional per bucket traffic stats, exported as fb303 counters like
+  // "<category>:bucket 7 bytes". Every statsInterval the buckets that
+  // got more than skewFactor times their even share of the messages are
+  // logged, to spot key skew before it overloads a single host.
+  bool bucketStats;
+  time_t statsInterval;                  // in seconds
+  float skewFactor;
+  time_t lastStatsReport;
+  std::vector<unsigned long> intervalMessages; // since lastStatsReport
 
   unsigned long bucketize(const std::string& message);
-  std::string getMessageWithoutKey(const std::string& message);
+  void recordBucketTraffic(unsigned long bucket,
+                           const logentry_vector_t& messages);
+  void recordBucketLatency(unsigned long bucket, unsigned long latency_ms);
+  void reportSkew(time_t now);
+  void createBucketBuffers(pStoreConf buffer_conf);
+  bool bufferMessages(unsigned long bucket,
+                      boost::shared_ptr<logentry_vector_t> messages);
+  void replayBuffer(unsigned long bucket, struct tm* now);
 
  private:
   // disallow copy, assignment, and emtpy construction
@@ -23,6 +23,8 @@
 
 #include "common.h"
 #include "scribe_server.h"
+#include "relay.h"
+#include "spool.h"
 
 using namespace std;
 using namespace boost;
@@ -42,6 +44,9 @@ StoreQueue::StoreQueue(const string& type, const string& category,
   : msgQueueSize(0),
     hasWork(false),
     stopping(false),
+    stopped(false),
+    drainDeadline(0),
+    snapshotOnStop(false),
     isModel(is_model),
     multiCategory(multi_category),
     categoryHandled(category),
@@ -63,6 +68,9 @@ StoreQueue::StoreQueue(const boost::shared_ptr<StoreQueue> example,
   : msgQueueSize(0),
     hasWork(false),
     stopping(false),
+    stopped(false),
+    drainDeadline(0),
+    snapshotOnStop(false),
     isModel(false),
     multiCategory(example->multiCategory),
     categoryHandled(category),
@@ -88,7 +96,8 @@ StoreQueue::~StoreQueue() {
   }
 }
 
-void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
+void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry,
+                            unsigned long ingest_ms) {
   if (isModel) {
     LOG_OPER("ERROR: called addMessage on model store");
   } else {
@@ -97,6 +106,10 @@ void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
     pthread_mutex_lock(&msgMutex);
     msgQueue->push_back(entry);
     msgQueueSize += entry->message.size();
+    if (ingest_ms) {
+      traced_message_t traced = { entry, ingest_ms };
+      tracedMessages.push_back(traced);
+    }
 
     waitForWork = (msgQueueSize >= targetWriteSize) ? true : false;
     pthread_mutex_unlock(&msgMutex);
@@ -114,6 +127,61 @@ void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
   }
 }
 
+// Queues a batch with a single lock, for bulk loading
+void StoreQueue::addMessages(const logentry_vector_t& entries) {
+  if (isModel) {
+    LOG_OPER("ERROR: called addMessages on model store");
+    return;
+  }
+
+  unsigned long long size = 0;
+  for (logentry_vector_t::const_iterator iter = entries.begin();
+       iter != entries.end(); ++iter) {
+    size += (*iter)->message.size();
+  }
+
+  pthread_mutex_lock(&msgMutex);
+  msgQueue->insert(msgQueue->end(), entries.begin(), entries.end());
+  msgQueueSize += size;
+  bool waitForWork = (msgQueueSize >= targetWriteSize);
+  pthread_mutex_unlock(&msgMutex);
+
+  if (waitForWork) {
+    pthread_mutex_lock(&hasWorkMutex);
+    if (!hasWork) {
+      hasWork = true;
+      pthread_cond_signal(&hasWorkCond);
+    }
+    pthread_mutex_unlock(&hasWorkMutex);
+  }
+}
+
+void StoreQueue::addRelayBatch(boost::shared_ptr<RelayBatch> batch) {
+  if (isModel) {
+    LOG_OPER("ERROR: called addRelayBatch on model store");
+    return;
+  }
+
+  pthread_mutex_lock(&msgMutex);
+  if (relayQueue) {
+    relayQueue->append(*batch);
+  } else {
+    relayQueue = batch;
+  }
+  msgQueueSize += batch->bytes;
+  bool waitForWork = (msgQueueSize >= targetWriteSize);
+  pthread_mutex_unlock(&msgMutex);
+
+  if (waitForWork) {
+    pthread_mutex_lock(&hasWorkMutex);
+    if (!hasWork) {
+      hasWork = true;
+      pthread_cond_signal(&hasWorkCond);
+    }
+    pthread_mutex_unlock(&hasWorkMutex);
+  }
+}
+
 void StoreQueue::configureAndOpen(pStoreConf configuration) {
   // model store has to handle this inline since it has no queue
   if (isModel) {
@@ -137,7 +205,39 @@ void StoreQueue::configureAndOpen(pStoreConf configuration) {
 void StoreQueue::stop() {
   if (isModel) {
     LOG_OPER("ERROR: called stop() on model store");
-  } else if(!stopping) {
+  } else if (!stopped) {
+    requestStop();
+    pthread_join(storeThread, NULL);
+    stopped = true;
+  }
+}
+
+void StoreQueue::drain(time_t drain_deadline, const string& spool_dir) {
+  if (isModel) {
+    LOG_OPER("ERROR: called drain() on model store");
+  } else {
+    pthread_mutex_lock(&cmdMutex);
+    drainDeadline = drain_deadline;
+    spoolDir = spool_dir;
+    pthread_mutex_unlock(&cmdMutex);
+    requestStop();
+  }
+}
+
+void StoreQueue::snapshot(const string& spool_dir) {
+  if (isModel) {
+    LOG_OPER("ERROR: called snapshot() on model store");
+  } else {
+    pthread_mutex_lock(&cmdMutex);
+    snapshotOnStop = true;
+    spoolDir = spool_dir;
+    pthread_mutex_unlock(&cmdMutex);
+    requestStop();
+  }
+}
+
+void StoreQueue::requestStop() {
+  if (!stopping) {
     pthread_mutex_lock(&cmdMutex);
     StoreCommand cmd(CMD_STOP);
     cmdQueue.push(cmd);
@@ -151,8 +251,6 @@ void StoreQueue::stop() {
       pthread_cond_signal(&hasWorkCond);
     }
     pthread_mutex_unlock(&hasWorkMutex);
-
-    pthread_join(storeThread, NULL);
   }
 }
 
@@ -214,7 +312,10 @@ void StoreQueue::threadMember() {
 
   bool stop = false;
   bool open = false;
-  while (!stop) {
+  bool snapshot = false;
+  time_t drain_deadline = 0;
+  string spool_dir;
+  while (true) {
 
     // handle commands
     //
@@ -235,6 +336,9 @@ void StoreQueue::threadMember() {
         break;
       case CMD_STOP:
         stop = true;
+        snapshot = snapshotOnStop;
+        drain_deadline = drainDeadline;
+        spool_dir = spoolDir;
         break;
       default:
         LOG_OPER("LOGIC ERROR: unknown command to store queue");
@@ -254,21 +358,28 @@ void StoreQueue::threadMember() {
     pthread_mutex_unlock(&cmdMutex);
 
     boost::shared_ptr<logentry_vector_t> messages;
+    boost::shared_ptr<RelayBatch> relay;
+    traced_vector_t traced;
 
-    // handle messages if stopping, enough time has passed, or queue is large
+    // handle messages if stopping, enough time has passed, or queue is large,
+    // but leave them all for the spool when taking a snapshot
     //
-    if (stop ||
-        (this_loop - last_handle_messages >= maxWriteInterval) ||
-        msgQueueSize >= targetWriteSize) {
+    if (stop ? !snapshot :
+        ((this_loop - last_handle_messages >= maxWriteInterval) ||
+         msgQueueSize >= targetWriteSize)) {
 
       if (failedMessages) {
         // process any messages we were not able to process last time
         messages = failedMessages;
         failedMessages = boost::shared_ptr<logentry_vector_t>();
+        traced.swap(tracedFailed);
       } else if (msgQueueSize > 0) {
         // process message in queue
         messages = msgQueue;
         msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
+        traced.swap(tracedMessages);
+        relay = relayQueue;
+        relayQueue.reset();
         msgQueueSize = 0;
       }
 
@@ -278,15 +389,66 @@ void StoreQueue::threadMember() {
 
     pthread_mutex_unlock(&msgMutex);
 
-    if (messages) {
+    bool failed = false;
+    unsigned long handle_ms = 0;
+    if (messages && !messages->empty()) {
+      if (!traced.empty()) {
+        handle_ms = scribe::clock::nowInMsec();
+      }
       if (!store->handleMessages(messages)) {
         // Store could not handle these messages
+        // The store leaves only the messages it couldn't handle, so the
+        // traced messages that aren't there anymore did go through
+        set<LogEntry*> unhandled;
+        for (logentry_vector_t::iterator iter = messages->begin();
+             iter != messages->end(); ++iter) {
+          unhandled.insert(iter->get());
+        }
+        traced_vector_t handled;
+        for (traced_vector_t::iterator iter = traced.begin();
+             iter != traced.end(); ++iter) {
+          if (unhandled.find(iter->entry.get()) == unhandled.end()) {
+            handled.push_back(*iter);
+          } else if (mustSucceed) {
+            // traced again when the retry succeeds
+            tracedFailed.push_back(*iter);
+          }
+        }
+        traced.swap(handled);
+
         processFailedMessages(messages);
+        failed = true;
+      }
+    }
+    if (relay) {
+      boost::shared_ptr<logentry_vector_t> unhandled;
+      if (!store->handleRelay(relay, unhandled)) {
+        processFailedMessages(unhandled);
+        failed = true;
       }
+    }
+    if (messages || relay) {
       store->flush();
     }
+    if (!traced.empty()) {
+      recordLatency(traced, handle_ms);
+    }
 
-    if (!stop) {
+    if (stop) {
+      // When draining, keep going until the queues are empty
+      pthread_mutex_lock(&msgMutex);
+      bool pending = failedMessages || msgQueueSize > 0;
+      pthread_mutex_unlock(&msgMutex);
+
+      time(&this_loop);
+      if (!pending || snapshot || this_loop >= drain_deadline) {
+        break;
+      }
+      if (failed) {
+        // give the store a moment before retrying
+        sleep(1);
+      }
+    } else {
       // set timeout to when we need to handle messages or do a periodic check
       abs_timeout.tv_sec = min(last_periodic_check + checkPeriod,
           last_handle_messages + maxWriteInterval);
@@ -301,9 +463,62 @@ void StoreQueue::threadMember() {
       pthread_mutex_unlock(&hasWorkMutex);
     }
 
-  } // while (!stop)
+  } // while (true)
 
   store->close();
+  spoolMessages(spool_dir);
+}
+
+// Writes whatever is still queued to the spool, or gives it up if there
+// is no spool
+void StoreQueue::spoolMessages(const string& spool_dir) {
+  shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+
+  pthread_mutex_lock(&msgMutex);
+  if (failedMessages) {
+    messages->swap(*failedMessages);
+    failedMessages.reset();
+  }
+  messages->insert(messages->end(), msgQueue->begin(), msgQueue->end());
+  msgQueue->clear();
+  if (relayQueue) {
+    shared_ptr<logentry_vector_t> relayed = relayQueue->toLogEntries();
+    messages->insert(messages->end(), relayed->begin(), relayed->end());
+    relayQueue.reset();
+  }
+  msgQueueSize = 0;
+  tracedMessages.clear();
+  tracedFailed.clear();
+  pthread_mutex_unlock(&msgMutex);
+
+  if (messages->empty()) {
+    return;
+  }
+
+  if (!spool_dir.empty() &&
+      MessageSpool::write(spool_dir, categoryHandled, *messages)) {
+    LOG_OPER("[%s] Spooled %lu messages left when stopping",
+             categoryHandled.c_str(), messages->size());
+    g_Handler->incCounter(categoryHandled, "spooled", messages->size());
+  } else {
+    LOG_OPER("[%s] WARNING: Lost %lu messages left when stopping!",
+             categoryHandled.c_str(), messages->size());
+    g_Handler->incCounter(categoryHandled, "lost", messages->size());
+  }
+}
+
+// Reports the latency of traced messages that were just handled, as of
+// handle_ms when they were handed to the store and now that it's flushed
+void StoreQueue::recordLatency(const traced_vector_t& traced,
+                               unsigned long handle_ms) {
+  unsigned long now = scribe::clock::nowInMsec();
+  for (traced_vector_t::const_iterator iter = traced.begin();
+       iter != traced.end(); ++iter) {
+    // the clock can go backwards
+    unsigned long ingest = min(iter->ingestMs, handle_ms);
+    g_Handler->recordLatency(iter->entry->category, handle_ms - ingest,
+                             max(now, handle_ms) - ingest);
+  }
 }
 
 void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
@@ -311,8 +526,13 @@ void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
   // requeue them or give up depending on the value of mustSucceed
 
   if (mustSucceed) {
-    // Save failed messages
-    failedMessages = messages;
+    // Save failed messages, after any that failed earlier in this loop
+    if (failedMessages) {
+      failedMessages->insert(failedMessages->end(), messages->begin(),
+                             messages->end());
+    } else {
+      failedMessages = messages;
+    }
 
     LOG_OPER("[%s] WARNING: Re-queueing %lu messages!",
              categoryHandled.c_str(), messages->size());
@@ -27,6 +27,7 @@
 #include "common.h"
 
 class Store;
+class RelayBatch;
 
 /*
  * This class implements a queue and a thread for dispatching
@@ -41,10 +42,21 @@ class StoreQueue {
              const std::string &category);
   virtual ~StoreQueue();
 
-  void addMessage(logentry_ptr_t entry);
+  // ingest_ms is when Log() got a message sampled for latency tracing,
+  // 0 for all the others, see latency.h
+  void addMessage(logentry_ptr_t entry, unsigned long ingest_ms = 0);
+  void addMessages(const logentry_vector_t& entries);
+  void addRelayBatch(boost::shared_ptr<RelayBatch> batch); // see relay.h
   void configureAndOpen(pStoreConf configuration); // closes first if already open
   void open();                                     // closes first if already open
   void stop();
+  // Asks the thread to stop once everything queued has been handled or
+  // drain_deadline has passed, whichever comes first. What is left is then
+  // written to spool_dir, see spool.h. Doesn't wait, call stop() for that.
+  void drain(time_t drain_deadline, const std::string& spool_dir);
+  // Like drain(), but writes everything queued to spool_dir without
+  // handling any of it first
+  void snapshot(const std::string& spool_dir);
   boost::shared_ptr<Store> copyStore(const std::string &category);
   std::string getStatus(); // An empty string means OK, anything else is an error
   std::string getBaseType();
@@ -65,6 +77,15 @@ class StoreQueue {
   void configureInline(pStoreConf configuration);
   void openInline();
   void processFailedMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void requestStop();
+
+  struct traced_message_t {
+    logentry_ptr_t entry;
+    unsigned long ingestMs;
+  };
+  typedef std::vector<traced_message_t> traced_vector_t;
+  void recordLatency(const traced_vector_t& traced, unsigned long handle_ms);
+  void spoolMessages(const std::string& spool_dir);
 
   // implementation of queues and thread
   enum store_command_t {
@@ -89,13 +110,17 @@ class StoreQueue {
   // respect to messages is not preserved.
   cmd_queue_t cmdQueue;
   boost::shared_ptr<logentry_vector_t> msgQueue;
+  boost::shared_ptr<RelayBatch> relayQueue; // null if nothing was relayed
   boost::shared_ptr<logentry_vector_t> failedMessages;
+  traced_vector_t tracedMessages; // sampled messages in msgQueue
+  traced_vector_t tracedFailed;   // sampled messages in failedMessages
   unsigned long long msgQueueSize;   // in bytes
   pthread_t storeThread;
 
   // Mutexes
   pthread_mutex_t cmdMutex;     // Must be held to read/modify cmdQueue
   pthread_mutex_t msgMutex;     // Must be held to read/modify msgQueue
+                                // and relayQueue
   pthread_mutex_t hasWorkMutex; // Must be held to read/modify hasWork
   // If acquiring multiple mutexes, always acquire in this order:
   // {cmdMutex, msgMutex, hasWorkMutex}
@@ -104,6 +129,10 @@ class StoreQueue {
   pthread_cond_t hasWorkCond; // cond variable to wait on for hasWork
 
   bool stopping;
+  bool stopped;              // the thread has been joined
+  time_t drainDeadline;      // set by drain(), protected by cmdMutex
+  std::string spoolDir;      // set by drain(), protected by cmdMutex
+  bool snapshotOnStop;       // set by snapshot(), protected by cmdMutex
   bool isModel;
   bool multiCategory; // Whether multiple categories are handled
 
@@ -11,6 +11,7 @@ my $receiverhost = '127.0.0.1';
 my $receiverporteven = 9998;
 my $receiverportodd = 9999;
 my $numbuckets = 600;
+my $bucketthreads = 0;
 my $help = '';
 my $outputdir = ".";
 my $scribefilepath ="/tmp/scribetest/600buckets";
@@ -23,6 +24,7 @@ my $result = GetOptions (
       "receiverporteven=i" => \$receiverporteven,
       "receiverportodd=i" => \$receiverportodd,
       "numbuckets=i" => \$numbuckets,
+      "bucketthreads=i" => \$bucketthreads,
       "outputdir=s" => \$outputdir,
       "scribefilepath=s" => \$scribefilepath,
       "help" => \$help);
@@ -31,7 +33,7 @@ if ($help) {
   print <<EOD;
 perl $0   --midtierhost mhost --midtierport mport --receiverhost host 
           --receiverporteven port1 --receiverportodd port2 
-          --numbuckets numbuckets --outputdir --help
+          --numbuckets numbuckets --bucketthreads threads --outputdir --help
           --category category --scribefilepath scribefilepath
 Usage:
 help: print this message
@@ -43,6 +45,8 @@ receiverporteven: reciver that will accept messages with even bucket id,
 receiverportodd: reciver that will accept messages with odd bucket id, 
                   default to 9999.
 numbickets: number of buckets, default to 600
+bucketthreads: threads the midtier uses to send to its buckets, default to 0
+               (send from the store thread, one bucket at a time)
 outputdir: direcotry to output the conf files, default to ".".
 category: scribe category that will be used in the test, default to ad_imps_2
 scribefilepath: the directory underwhich scribe file store will log message to.
@@ -94,6 +98,7 @@ bucket_type=key_modulo
 bucket_range=$numbuckets
 num_buckets=$numbuckets
 delimiter=1
+bucket_threads=$bucketthreads
 # make write every 6 seconds
 max_write_interval=6
 # for 10MBps input rate,  max_write_interval of 6 sec,
@@ -0,0 +1,160 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "consistent_hash.h"
+
+using namespace std;
+using scribe::consistenthash;
+using scribe::HashRing;
+
+#define DEFAULT_NUM_KEYS    1000000
+#define DEFAULT_NUM_BUCKETS 64
+#define RING_VNODES         160 // DEFAULT_BUCKETSTORE_RING_VNODES
+
+void usage() {
+  fprintf(stderr, "usage: bucketbench [num_keys] [num_buckets]\n");
+  fprintf(stderr, "Times how long each BucketStore bucket_type takes to pick a bucket\n");
+  fprintf(stderr, "for a key, and how many keys move when one bucket is added.\n");
+}
+
+// Same as scribe::strhash::hash32 in env_default.cpp, which can't be
+// built without thrift
+uint32_t djb2(const char *s) {
+  uint32_t hash = 5381;
+  int c;
+  while ((c = *s++)) {
+    hash = ((hash << 5) + hash) + c; // hash * 33 + c
+  }
+  return hash;
+}
+
+double nowInSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct bucketizer {
+  virtual ~bucketizer() {}
+  virtual void resize(uint32_t num_buckets) = 0;
+  virtual uint32_t bucket(const string& key) = 0;
+};
+
+struct key_hash : public bucketizer {
+  uint32_t numBuckets;
+  void resize(uint32_t num_buckets) { numBuckets = num_buckets; }
+  uint32_t bucket(const string& key) {
+    return djb2(key.c_str()) % numBuckets;
+  }
+};
+
+struct key_jump : public bucketizer {
+  uint32_t numBuckets;
+  void resize(uint32_t num_buckets) { numBuckets = num_buckets; }
+  uint32_t bucket(const string& key) {
+    return consistenthash::jump(consistenthash::hash64(key.data(), key.size()),
+                                numBuckets);
+  }
+};
+
+struct key_ring : public bucketizer {
+  HashRing ring;
+  void resize(uint32_t num_buckets) { ring.build(num_buckets, RING_VNODES); }
+  uint32_t bucket(const string& key) {
+    return ring.lookup(consistenthash::hash64(key.data(), key.size()));
+  }
+};
+
+void run(const char* name, bucketizer& b, const vector<string>& keys,
+         uint32_t num_buckets) {
+  vector<uint32_t> before(keys.size());
+  vector<unsigned long> counts(num_buckets, 0);
+
+  b.resize(num_buckets);
+  double start = nowInSec();
+  for (size_t i = 0; i < keys.size(); ++i) {
+    before[i] = b.bucket(keys[i]);
+  }
+  double elapsed = nowInSec() - start;
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ++counts[before[i]];
+  }
+  unsigned long smallest = counts[0], largest = counts[0];
+  for (size_t i = 1; i < counts.size(); ++i) {
+    smallest = min(smallest, counts[i]);
+    largest = max(largest, counts[i]);
+  }
+
+  b.resize(num_buckets + 1);
+  unsigned long moved = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (b.bucket(keys[i]) != before[i]) {
+      ++moved;
+    }
+  }
+
+  printf("%-10s %8.1f ns/key   bucket sizes %lu-%lu   %5.1f%% moved "
+         "(ideal %.1f%%)\n", name, elapsed * 1e9 / keys.size(),
+         smallest, largest, 100.0 * moved / keys.size(),
+         100.0 / (num_buckets + 1));
+}
+
+int main(int argc, char** argv) {
+  unsigned long num_keys = DEFAULT_NUM_KEYS;
+  unsigned long num_buckets = DEFAULT_NUM_BUCKETS;
+  if (argc > 3) {
+    usage();
+    return -1;
+  }
+  if (argc > 1) {
+    num_keys = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    num_buckets = strtoul(argv[2], NULL, 10);
+  }
+  if (num_keys == 0 || num_buckets == 0) {
+    usage();
+    return -1;
+  }
+
+  // keys look like the user ids most bucket stores are keyed on
+  vector<string> keys;
+  keys.reserve(num_keys);
+  srand(1);
+  for (unsigned long i = 0; i < num_keys; ++i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long) rand() * 7919 + i);
+    keys.push_back(buf);
+  }
+
+  printf("%lu keys, %lu buckets growing to %lu\n", num_keys, num_buckets,
+         num_buckets + 1);
+  key_hash hash;
+  key_jump jump;
+  key_ring ring;
+  run("key_hash", hash, keys, num_buckets);
+  run("key_jump", jump, keys, num_buckets);
+  run("key_ring", ring, keys, num_buckets);
+  return 0;
+}
@@ -0,0 +1,156 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "bucket_key.h"
+
+using namespace std;
+using scribe::buckethash;
+
+#define DEFAULT_NUM_KEYS 1000000
+#define NUM_BUCKETS      600
+
+// A hash passes when its chi-square over NUM_BUCKETS buckets is within
+// this many standard deviations of what a uniform hash would get
+#define MAX_CHI_SQUARE_SIGMAS 4.0
+
+void usage() {
+  fprintf(stderr, "usage: hashbench [num_keys]\n");
+  fprintf(stderr, "Times each bucket_hash and checks how evenly it spreads\n");
+  fprintf(stderr, "string keys and sequential context_log ids over %d buckets.\n",
+          NUM_BUCKETS);
+  fprintf(stderr, "Exits with 1 if a hash other than default spreads them badly.\n");
+}
+
+double nowInSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Chi-square of the bucket counts, as the number of standard deviations
+// away from the mean of the distribution a uniform hash would give
+double chiSquareSigmas(const vector<unsigned long>& counts,
+                       unsigned long total) {
+  double expected = (double) total / counts.size();
+  double chi_square = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    double diff = counts[i] - expected;
+    chi_square += diff * diff / expected;
+  }
+  double dof = counts.size() - 1;
+  return (chi_square - dof) / sqrt(2 * dof);
+}
+
+// Times hashing keys of one length, returns ns per key
+double timeHash(buckethash::type_t type, const vector<string>& keys,
+                uint32_t& checksum) {
+  double start = nowInSec();
+  for (size_t i = 0; i < keys.size(); ++i) {
+    checksum += buckethash::hash32(type, keys[i].data(), keys[i].size());
+  }
+  return (nowInSec() - start) * 1e9 / keys.size();
+}
+
+int main(int argc, char** argv) {
+  unsigned long num_keys = DEFAULT_NUM_KEYS;
+  if (argc > 2) {
+    usage();
+    return -1;
+  }
+  if (argc > 1) {
+    num_keys = strtoul(argv[1], NULL, 10);
+  }
+  if (num_keys == 0) {
+    usage();
+    return -1;
+  }
+
+  buckethash::type_t types[] = {buckethash::DEFAULT, buckethash::MURMUR3,
+                                buckethash::XXHASH64, buckethash::CRC32C};
+  size_t num_types = sizeof(types) / sizeof(types[0]);
+  size_t lengths[] = {8, 16, 64, 256};
+  size_t num_lengths = sizeof(lengths) / sizeof(lengths[0]);
+
+  srand(1);
+  printf("%-10s", "ns/key");
+  for (size_t l = 0; l < num_lengths; ++l) {
+    printf(" %6lu B", (unsigned long) lengths[l]);
+  }
+  printf("\n");
+
+  vector<vector<string> > keys(num_lengths);
+  for (size_t l = 0; l < num_lengths; ++l) {
+    for (unsigned long i = 0; i < num_keys / 10 + 1; ++i) {
+      string key;
+      for (size_t c = 0; c < lengths[l]; ++c) {
+        key += 'a' + rand() % 26;
+      }
+      keys[l].push_back(key);
+    }
+  }
+
+  uint32_t checksum = 0;
+  for (size_t t = 0; t < num_types; ++t) {
+    printf("%-10s", buckethash::name(types[t]));
+    for (size_t l = 0; l < num_lengths; ++l) {
+      printf(" %8.1f", timeHash(types[t], keys[l], checksum));
+    }
+    printf("\n");
+  }
+
+  // Distribution: user id keys as key_hash sees them, and sequential ids
+  // as context_log sees them
+  bool passed = true;
+  printf("\nchi-square sigmas over %d buckets (uniform is about 0, "
+         "fails above %.0f)\n", NUM_BUCKETS, MAX_CHI_SQUARE_SIGMAS);
+  printf("%-10s %12s %12s\n", "", "user keys", "seq ids");
+  for (size_t t = 0; t < num_types; ++t) {
+    vector<unsigned long> key_counts(NUM_BUCKETS, 0);
+    vector<unsigned long> id_counts(NUM_BUCKETS, 0);
+    for (unsigned long i = 0; i < num_keys; ++i) {
+      char key[32];
+      int len = snprintf(key, sizeof(key), "%lu", 100000000UL + i * 7);
+      ++key_counts[buckethash::hash32(types[t], key, len) % NUM_BUCKETS];
+      // ids that step by the number of buckets are the worst case for
+      // the default, which uses the id itself
+      uint32_t id = 1 + i * (NUM_BUCKETS / 4);
+      ++id_counts[buckethash::hash32(types[t], id) % NUM_BUCKETS];
+    }
+    double key_sigmas = chiSquareSigmas(key_counts, num_keys);
+    double id_sigmas = chiSquareSigmas(id_counts, num_keys);
+    bool ok = types[t] == buckethash::DEFAULT ||
+              (key_sigmas < MAX_CHI_SQUARE_SIGMAS &&
+               id_sigmas < MAX_CHI_SQUARE_SIGMAS);
+    printf("%-10s %12.1f %12.1f%s\n", buckethash::name(types[t]),
+           key_sigmas, id_sigmas, ok ? "" : "   FAILED");
+    passed = passed && ok;
+  }
+
+  // keep the timing loops from being optimized away
+  if (checksum == 42) {
+    printf("\n");
+  }
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "bucket_key.h"
+
+using namespace std;
+using scribe::bucketkey;
+
+#define DEFAULT_NUM_MESSAGES 200000
+// Messages are built up to this many bytes per case. Bigger messages are
+// timed over more passes of fewer messages, so every size parses the
+// same number of messages without building gigabytes of them.
+#define MAX_CASE_BYTES       (64 * 1024 * 1024)
+#define NUM_BUCKETS          64
+#define KEY_DELIMITER        ':'
+
+void usage() {
+  fprintf(stderr, "usage: keybench [num_messages]\n");
+  fprintf(stderr, "Times BucketStore key parsing with substr() copies against\n");
+  fprintf(stderr, "parsing in place, for key_hash and context_log messages.\n");
+}
+
+// Same as scribe::strhash::hash32 in env_default.cpp, which can't be
+// built without thrift
+uint32_t djb2(const char *s) {
+  uint32_t hash = 5381;
+  int c;
+  while ((c = *s++)) {
+    hash = ((hash << 5) + hash) + c; // hash * 33 + c
+  }
+  return hash;
+}
+
+double nowInSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What BucketStore::bucketize() used to do
+unsigned long keyHashCopy(const string& message) {
+  string::size_type pos = message.find(KEY_DELIMITER);
+  if (pos == string::npos) {
+    return 0;
+  }
+  string key = message.substr(0, pos).c_str();
+  if (key.empty()) {
+    return 0;
+  }
+  return (djb2(key.c_str()) % NUM_BUCKETS) + 1;
+}
+
+unsigned long contextLogCopy(const string& message) {
+  string::size_type length = message.length();
+  char delim = 1;
+  string::size_type pos = 0;
+  for (int i = 0; i < 3; ++i) {
+    pos = message.find(delim, pos);
+    if (pos == string::npos || length <= pos + 1) {
+      return 0;
+    }
+    ++pos;
+  }
+  if (message[pos] == delim) {
+    return 0;
+  }
+  uint32_t id = strtoul(message.substr(pos).c_str(), NULL, 10);
+  if (id == 0) {
+    return 0;
+  }
+  return (id % NUM_BUCKETS) + 1;
+}
+
+// What it does now
+unsigned long keyHashInPlace(const string& message) {
+  size_t key_len;
+  const char* key = bucketkey::find(message.data(), message.length(),
+                                    KEY_DELIMITER, key_len);
+  if (key == NULL || key_len == 0) {
+    return 0;
+  }
+  return (bucketkey::hash32(key, key_len) % NUM_BUCKETS) + 1;
+}
+
+unsigned long contextLogInPlace(const string& message) {
+  uint32_t id = bucketkey::contextLogId(message.data(), message.length());
+  if (id == 0) {
+    return 0;
+  }
+  return (id % NUM_BUCKETS) + 1;
+}
+
+typedef unsigned long (*bucketize_t)(const string&);
+
+double timeBucketize(bucketize_t bucketize, const vector<string>& messages,
+                     unsigned long passes, unsigned long& checksum) {
+  double start = nowInSec();
+  for (unsigned long pass = 0; pass < passes; ++pass) {
+    for (size_t i = 0; i < messages.size(); ++i) {
+      checksum += bucketize(messages[i]);
+    }
+  }
+  return (nowInSec() - start) * 1e9 / (messages.size() * passes);
+}
+
+void run(const char* name, bucketize_t copy, bucketize_t in_place,
+         const vector<string>& messages, unsigned long passes, size_t size) {
+  unsigned long copy_sum = 0, in_place_sum = 0;
+  double copy_ns = timeBucketize(copy, messages, passes, copy_sum);
+  double in_place_ns = timeBucketize(in_place, messages, passes,
+                                     in_place_sum);
+  printf("%-12s %6lu bytes   substr %7.1f ns/msg   in place %7.1f ns/msg%s\n",
+         name, (unsigned long) size, copy_ns, in_place_ns,
+         copy_sum == in_place_sum ? "" : "   BUCKETS DIFFER");
+}
+
+string randomText(size_t len) {
+  string text;
+  text.reserve(len);
+  for (size_t i = 0; i < len; ++i) {
+    text += 'a' + rand() % 26;
+  }
+  return text;
+}
+
+int main(int argc, char** argv) {
+  unsigned long num_messages = DEFAULT_NUM_MESSAGES;
+  if (argc > 2) {
+    usage();
+    return -1;
+  }
+  if (argc > 1) {
+    num_messages = strtoul(argv[1], NULL, 10);
+  }
+  if (num_messages == 0) {
+    usage();
+    return -1;
+  }
+
+  srand(1);
+  size_t sizes[] = {64, 256, 1024, 4096, 16384};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    // every message is its own copy, so cap how many are built
+    unsigned long case_messages = num_messages;
+    unsigned long max_messages = MAX_CASE_BYTES / (2 * sizes[s]);
+    unsigned long passes = 1;
+    if (case_messages > max_messages) {
+      passes = (num_messages + max_messages - 1) / max_messages;
+      case_messages = (num_messages + passes - 1) / passes;
+    }
+
+    vector<string> key_messages, context_messages;
+    // a few random bodies are enough to get varied keys
+    vector<string> bodies;
+    for (int i = 0; i < 16; ++i) {
+      bodies.push_back(randomText(sizes[s]));
+    }
+    for (unsigned long i = 0; i < case_messages; ++i) {
+      char id[32];
+      snprintf(id, sizeof(id), "%lu", (unsigned long) rand());
+      const string& body = bodies[i % bodies.size()];
+      key_messages.push_back(id + string(1, KEY_DELIMITER) + body);
+      context_messages.push_back("1234\001web\001" + body.substr(0, 16) +
+                                 "\001" + id + "\001" + body);
+    }
+    run("key_hash", keyHashCopy, keyHashInPlace, key_messages, passes,
+        sizes[s]);
+    run("context_log", contextLogCopy, contextLogInPlace, context_messages,
+        passes, sizes[s]);
+  }
+  return 0;
+}